@@ -21,9 +21,14 @@
 #include <errno.h>
 #include <libusb.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
 #include <unistd.h>
+#include <algorithm>
 #include <iostream>
 #include <string>
+#include <vector>
 
 using std::cerr;
 using std::cout;
@@ -34,65 +39,681 @@ static const uint16_t kProductId = 0x5252;
 static const uint16_t kVendorId = 0x1d50;
 static const uint8_t kInEndpoint  = 0x83;
 static const uint8_t kOutEndpoint = 0x02;
-static const unsigned int kReadTimeout = 1000;
 static const uint8_t ACM_CTRL_DTR = 0x01;
 static const uint8_t ACM_CTRL_RTS = 0x02;
 
+// The async write path.
+static const unsigned int kWriteTimeout = 1000;
+static const unsigned int kMaxWritesInFlight = 8;
+
+// The continuous reader.
+static const unsigned int kReadTransfers = 4;
+static const unsigned int kReadRingSize = 64 * 1024;
+// Give up reading after this many failed transfers in a row.
+static const unsigned int kMaxReadFailures = 8;
+
+void WriteCompleteHandler(struct libusb_transfer *transfer);
+void ReadCompleteHandler(struct libusb_transfer *transfer);
 
 /**
- * Write data to the device.
+ * libusb_error_name() only knows about libusb_error codes, so transfer
+ * statuses need their own names.
  */
-bool Write(libusb_device_handle *device, const string &data) {
-  int actual_length;
-  int r = libusb_bulk_transfer(
-      device, kOutEndpoint,
-      // Terrible
-      reinterpret_cast<uint8_t*>(const_cast<char*>(data.c_str())),
-      data.size(), &actual_length, 0);
-  if (r < 0) {
-    cerr << "Build transfer failed: " << libusb_error_name(r) << endl;
-    cerr << "Transferred " << actual_length << " / " << data.size() << " bytes"
+const char *TransferStatusName(libusb_transfer_status status) {
+  switch (status) {
+    case LIBUSB_TRANSFER_COMPLETED: return "COMPLETED";
+    case LIBUSB_TRANSFER_ERROR: return "ERROR";
+    case LIBUSB_TRANSFER_TIMED_OUT: return "TIMED_OUT";
+    case LIBUSB_TRANSFER_CANCELLED: return "CANCELLED";
+    case LIBUSB_TRANSFER_STALL: return "STALL";
+    case LIBUSB_TRANSFER_NO_DEVICE: return "NO_DEVICE";
+    case LIBUSB_TRANSFER_OVERFLOW: return "OVERFLOW";
+  }
+  return "UNKNOWN";
+}
+
+/**
+ * A fixed size byte ring buffer.
+ *
+ * The capacity must be a power of two, so that the indices can wrap with a
+ * mask.
+ */
+class RingBuffer {
+ public:
+  explicit RingBuffer(unsigned int capacity)
+      : m_buffer(new uint8_t[capacity]),
+        m_mask(capacity - 1),
+        m_head(0),
+        m_tail(0) {
+    if (capacity == 0 || (capacity & (capacity - 1))) {
+      cerr << "RingBuffer capacity " << capacity << " isn't a power of two"
+           << endl;
+      abort();
+    }
+  }
+
+  ~RingBuffer() { delete[] m_buffer; }
+
+  unsigned int Size() const { return m_tail - m_head; }
+  unsigned int Capacity() const { return m_mask + 1; }
+  unsigned int Free() const { return Capacity() - Size(); }
+
+  /**
+   * Append data to the buffer.
+   * @returns the number of bytes appended, which is less than size if the
+   *   buffer filled up.
+   */
+  unsigned int Append(const uint8_t *data, unsigned int size) {
+    size = std::min(size, Free());
+    unsigned int offset = m_tail & m_mask;
+    unsigned int first = std::min(size, Capacity() - offset);
+    memcpy(m_buffer + offset, data, first);
+    memcpy(m_buffer, data + first, size - first);
+    m_tail += size;
+    return size;
+  }
+
+  /**
+   * Remove data from the buffer.
+   * @returns the number of bytes copied into data.
+   */
+  unsigned int Consume(uint8_t *data, unsigned int size) {
+    size = std::min(size, Size());
+    unsigned int offset = m_head & m_mask;
+    unsigned int first = std::min(size, Capacity() - offset);
+    memcpy(data, m_buffer + offset, first);
+    memcpy(data + first, m_buffer, size - first);
+    m_head += size;
+    return size;
+  }
+
+ private:
+  uint8_t *m_buffer;
+  const unsigned int m_mask;
+  // These are free running and wrap at UINT_MAX, which is fine since the
+  // capacity is a power of two.
+  unsigned int m_head;
+  unsigned int m_tail;
+
+  RingBuffer(const RingBuffer&);
+  RingBuffer& operator=(const RingBuffer&);
+};
+
+/**
+ * Continuously reads from the device.
+ *
+ * Several IN transfers are kept submitted at all times; as soon as one
+ * completes its data is copied into a ring buffer and it's resubmitted. This
+ * means there is always a transfer waiting when the device has data, so the
+ * endpoint never sits idle between reads.
+ *
+ * The data callback runs, from libusb_handle_events(), whenever new data is
+ * added to the ring buffer. The consumer then drains it with Read().
+ *
+ * A stalled endpoint has its halt cleared before the transfer is resubmitted.
+ * Any other error retires the transfer, and after kMaxReadFailures failures in
+ * a row the reader stops, rather than spinning on an endpoint that will never
+ * work again.
+ */
+class ContinuousReader {
+ public:
+  typedef void (*DataCallback)(void *user_data);
+
+  ContinuousReader(libusb_context *context,
+                   libusb_device_handle *device,
+                   unsigned int transfer_count = kReadTransfers,
+                   unsigned int ring_size = kReadRingSize)
+      : m_context(context),
+        m_device(device),
+        m_ring(ring_size),
+        m_callback(NULL),
+        m_callback_data(NULL),
+        m_running(false),
+        m_pending(0),
+        m_dropped(0),
+        m_failures(0) {
+    for (unsigned int i = 0; i < transfer_count; i++) {
+      Slot *slot = new Slot();
+      slot->transfer = libusb_alloc_transfer(0);
+      m_slots.push_back(slot);
+    }
+  }
+
+  ~ContinuousReader() {
+    Stop();
+    for (std::vector<Slot*>::iterator iter = m_slots.begin();
+         iter != m_slots.end(); ++iter) {
+      libusb_free_transfer((*iter)->transfer);
+      delete *iter;
+    }
+  }
+
+  void SetDataCallback(DataCallback callback, void *user_data) {
+    m_callback = callback;
+    m_callback_data = user_data;
+  }
+
+  /**
+   * Submit all the IN transfers.
+   * @returns true if at least one transfer was submitted.
+   */
+  bool Start() {
+    m_running = true;
+    m_failures = 0;
+    for (std::vector<Slot*>::iterator iter = m_slots.begin();
+         iter != m_slots.end(); ++iter) {
+      Submit(*iter);
+    }
+    if (!m_pending) {
+      m_running = false;
+    }
+    return m_running;
+  }
+
+  /**
+   * Cancel the IN transfers and wait for them to complete.
+   */
+  void Stop() {
+    m_running = false;
+    for (std::vector<Slot*>::iterator iter = m_slots.begin();
+         iter != m_slots.end(); ++iter) {
+      if ((*iter)->in_flight) {
+        libusb_cancel_transfer((*iter)->transfer);
+      }
+    }
+    while (m_pending) {
+      libusb_handle_events(m_context);
+    }
+  }
+
+  /**
+   * Copy received data out of the ring buffer.
+   * @returns the number of bytes copied.
+   */
+  unsigned int Read(uint8_t *data, unsigned int size) {
+    return m_ring.Consume(data, size);
+  }
+
+  unsigned int Available() const { return m_ring.Size(); }
+
+  // The number of bytes lost because the consumer didn't keep up.
+  unsigned int Dropped() const { return m_dropped; }
+
+  // False once Stop() was called or the reader gave up on the endpoint.
+  bool Running() const { return m_running; }
+
+  void _ReadComplete(struct libusb_transfer *transfer) {
+    Slot *slot = NULL;
+    for (std::vector<Slot*>::iterator iter = m_slots.begin();
+         iter != m_slots.end(); ++iter) {
+      if ((*iter)->transfer == transfer) {
+        slot = *iter;
+        break;
+      }
+    }
+    slot->in_flight = false;
+    m_pending--;
+
+    bool got_data = false;
+    bool resubmit = m_running;
+    switch (transfer->status) {
+      case LIBUSB_TRANSFER_COMPLETED:
+        {
+          unsigned int length = transfer->actual_length;
+          unsigned int appended = m_ring.Append(slot->buffer, length);
+          m_dropped += length - appended;
+          got_data = appended > 0;
+          m_failures = 0;
+        }
+        break;
+      case LIBUSB_TRANSFER_CANCELLED:
+      case LIBUSB_TRANSFER_TIMED_OUT:
+        break;
+      case LIBUSB_TRANSFER_STALL:
+        cerr << "Read stalled, clearing halt" << endl;
+        m_failures++;
+        if (m_running) {
+          int r = libusb_clear_halt(m_device, kInEndpoint);
+          if (r) {
+            cerr << "Failed to clear halt: " << libusb_error_name(r) << endl;
+            resubmit = false;
+          }
+        }
+        break;
+      default:
+        cerr << "Read failed: " << TransferStatusName(transfer->status)
+             << endl;
+        m_failures++;
+        resubmit = false;
+    }
+
+    if (m_running && m_failures >= kMaxReadFailures) {
+      cerr << "Too many failed reads, giving up" << endl;
+      m_running = false;
+    }
+
+    // Re-arm before running the callback, so the device isn't kept waiting
+    // on the consumer.
+    if (resubmit && m_running) {
+      Submit(slot);
+    }
+    if (!m_pending) {
+      m_running = false;
+    }
+
+    if (got_data && m_callback) {
+      m_callback(m_callback_data);
+    }
+  }
+
+ private:
+  struct Slot {
+    Slot() : transfer(NULL), in_flight(false) {}
+
+    // A multiple of the endpoint packet size to avoid overflows.
+    enum { BUFFER_SIZE = 4096 };
+
+    libusb_transfer *transfer;
+    bool in_flight;
+    uint8_t buffer[BUFFER_SIZE];
+  };
+
+  libusb_context *m_context;
+  libusb_device_handle *m_device;
+  RingBuffer m_ring;
+  DataCallback m_callback;
+  void *m_callback_data;
+  std::vector<Slot*> m_slots;
+  bool m_running;
+  unsigned int m_pending;
+  unsigned int m_dropped;
+  unsigned int m_failures;
+
+  void Submit(Slot *slot) {
+    // No timeout, the transfer waits for as long as it takes.
+    libusb_fill_bulk_transfer(slot->transfer, m_device, kInEndpoint,
+                              slot->buffer, Slot::BUFFER_SIZE,
+                              ReadCompleteHandler, static_cast<void*>(this),
+                              0);
+    int r = libusb_submit_transfer(slot->transfer);
+    if (r) {
+      cerr << "Failed to submit read: " << libusb_error_name(r) << endl;
+      return;
+    }
+    slot->in_flight = true;
+    m_pending++;
+  }
+
+  ContinuousReader(const ContinuousReader&);
+  ContinuousReader& operator=(const ContinuousReader&);
+};
+
+/**
+ * Writes data to the device using asynchronous bulk transfers.
+ *
+ * A fixed number of transfers, each with its own buffer, are allocated up
+ * front so writing doesn't allocate. Up to that many writes can be in flight
+ * at once, which keeps the OUT endpoint busy. When they are all in use,
+ * Write() returns 0 and the caller should wait for the writable callback
+ * before trying again.
+ *
+ * Completions are delivered from libusb_handle_events(), which must be called
+ * from the same thread as Write().
+ */
+class AsyncWriter {
+ public:
+  // Called when a write completes, with the libusb transfer status.
+  typedef void (*CompletionCallback)(void *user_data,
+                                     libusb_transfer_status status);
+
+  AsyncWriter(libusb_context *context,
+              libusb_device_handle *device,
+              unsigned int max_in_flight = kMaxWritesInFlight,
+              unsigned int timeout = kWriteTimeout)
+      : m_context(context),
+        m_device(device),
+        m_timeout(timeout),
+        m_callback(NULL),
+        m_callback_data(NULL),
+        m_timeouts(0),
+        m_errors(0) {
+    for (unsigned int i = 0; i < max_in_flight; i++) {
+      Slot *slot = new Slot();
+      slot->transfer = libusb_alloc_transfer(0);
+      m_slots.push_back(slot);
+      m_free_slots.push_back(slot);
+    }
+  }
+
+  ~AsyncWriter() {
+    // Cancel anything that's still outstanding and wait for the cancellations
+    // to complete, so that the callbacks don't fire after we're gone.
+    for (std::vector<Slot*>::iterator iter = m_slots.begin();
+         iter != m_slots.end(); ++iter) {
+      if ((*iter)->in_flight) {
+        libusb_cancel_transfer((*iter)->transfer);
+      }
+    }
+    while (InFlight()) {
+      libusb_handle_events(m_context);
+    }
+    for (std::vector<Slot*>::iterator iter = m_slots.begin();
+         iter != m_slots.end(); ++iter) {
+      libusb_free_transfer((*iter)->transfer);
+      delete *iter;
+    }
+  }
+
+  /**
+   * Set the callback to run each time a write completes. Since a completion
+   * frees a transfer, this is also the signal that Write() can be retried.
+   */
+  void SetCompletionCallback(CompletionCallback callback, void *user_data) {
+    m_callback = callback;
+    m_callback_data = user_data;
+  }
+
+  /**
+   * Queue data to be written.
+   *
+   * Data larger than a single transfer is split across transfers. If there
+   * aren't enough free transfers for all of it, nothing is queued. A submit
+   * can still fail part way through, and the chunks before it are already in
+   * flight by then, so the caller should only resend the data past the
+   * returned count.
+   * @param size the number of bytes to write, this must be more than 0.
+   * @returns the number of bytes queued, which is less than size if a submit
+   *   failed. For a valid size, 0 means there aren't enough free transfers.
+   */
+  unsigned int Write(const uint8_t *data, unsigned int size) {
+    if (!size) {
+      // A zero length write would also return 0, and look like backpressure.
+      cerr << "Refusing a zero length write" << endl;
+      return 0;
+    }
+    unsigned int transfers_required =
+        (size + Slot::BUFFER_SIZE - 1) / Slot::BUFFER_SIZE;
+    if (transfers_required > m_free_slots.size()) {
+      return 0;
+    }
+
+    unsigned int offset = 0;
+    do {
+      unsigned int chunk = std::min<unsigned int>(size - offset,
+                                                  Slot::BUFFER_SIZE);
+      Slot *slot = m_free_slots.back();
+      memcpy(slot->buffer, data + offset, chunk);
+      libusb_fill_bulk_transfer(slot->transfer, m_device, kOutEndpoint,
+                                slot->buffer, chunk, WriteCompleteHandler,
+                                static_cast<void*>(this), m_timeout);
+      int r = libusb_submit_transfer(slot->transfer);
+      if (r) {
+        cerr << "Failed to submit write: " << libusb_error_name(r) << endl;
+        m_errors++;
+        return offset;
+      }
+      slot->in_flight = true;
+      m_free_slots.pop_back();
+      offset += chunk;
+    } while (offset < size);
+    return size;
+  }
+
+  unsigned int Write(const string &data) {
+    return Write(reinterpret_cast<const uint8_t*>(data.data()), data.size());
+  }
+
+  /**
+   * @returns true if a transfer is available for writing.
+   */
+  bool CanWrite() const { return !m_free_slots.empty(); }
+
+  unsigned int InFlight() const { return m_slots.size() - m_free_slots.size(); }
+
+  unsigned int Timeouts() const { return m_timeouts; }
+  unsigned int Errors() const { return m_errors; }
+
+  void _WriteComplete(struct libusb_transfer *transfer) {
+    for (std::vector<Slot*>::iterator iter = m_slots.begin();
+         iter != m_slots.end(); ++iter) {
+      if ((*iter)->transfer == transfer) {
+        (*iter)->in_flight = false;
+        m_free_slots.push_back(*iter);
+        break;
+      }
+    }
+
+    if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
+      m_timeouts++;
+      cerr << "Write timed out, sent " << transfer->actual_length << " / "
+           << transfer->length << " bytes" << endl;
+    } else if (transfer->status != LIBUSB_TRANSFER_COMPLETED &&
+               transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+      m_errors++;
+      cerr << "Write failed: " << TransferStatusName(transfer->status)
+           << endl;
+    }
+
+    if (m_callback) {
+      m_callback(m_callback_data, transfer->status);
+    }
+  }
+
+ private:
+  struct Slot {
+    Slot() : transfer(NULL), in_flight(false) {}
+
+    // A multiple of the endpoint packet size.
+    enum { BUFFER_SIZE = 4096 };
+
+    libusb_transfer *transfer;
+    bool in_flight;
+    uint8_t buffer[BUFFER_SIZE];
+  };
+
+  libusb_context *m_context;
+  libusb_device_handle *m_device;
+  const unsigned int m_timeout;
+  CompletionCallback m_callback;
+  void *m_callback_data;
+  std::vector<Slot*> m_slots;
+  std::vector<Slot*> m_free_slots;
+  unsigned int m_timeouts;
+  unsigned int m_errors;
+
+  AsyncWriter(const AsyncWriter&);
+  AsyncWriter& operator=(const AsyncWriter&);
+};
+
+void WriteCompleteHandler(struct libusb_transfer *transfer) {
+  AsyncWriter *writer = static_cast<AsyncWriter*>(transfer->user_data);
+  writer->_WriteComplete(transfer);
+}
+
+void ReadCompleteHandler(struct libusb_transfer *transfer) {
+  ContinuousReader *reader = static_cast<ContinuousReader*>(
+      transfer->user_data);
+  reader->_ReadComplete(transfer);
+}
+
+/**
+ * Print whatever the device sent us.
+ */
+void PrintReceivedData(void *user_data) {
+  ContinuousReader *reader = static_cast<ContinuousReader*>(user_data);
+  uint8_t data[256];
+  unsigned int size;
+  while ((size = reader->Read(data, sizeof(data)))) {
+    cout << "Read: '" << string(reinterpret_cast<char*>(data), size) << "'"
          << endl;
-    return false;
   }
-  return true;
 }
 
 /**
- * Read data from the device
+ * The CDC line coding and control line state.
  */
-int Read(libusb_device_handle *device, string *input, int size) {
-  uint8_t data[size];
-  int actual_length;
-  int r = libusb_bulk_transfer(device, kInEndpoint, data, size, &actual_length,
-                               kReadTimeout);
-  if (r == LIBUSB_ERROR_TIMEOUT) {
-    cerr << "Read timeout!" << endl;
-    return -1;
-  } else if (r < 0) {
-    cerr << "Error while reading: " << libusb_error_name(r) << endl;
-    return -1;
-  }
-  input->append(reinterpret_cast<const char*>(data), actual_length);
-  return actual_length;
+struct LineCoding {
+  enum StopBits {
+    ONE_STOP_BIT = 0,
+    ONE_AND_A_HALF_STOP_BITS = 1,
+    TWO_STOP_BITS = 2
+  };
+
+  enum Parity {
+    PARITY_NONE = 0,
+    PARITY_ODD = 1,
+    PARITY_EVEN = 2,
+    PARITY_MARK = 3,
+    PARITY_SPACE = 4
+  };
+
+  // Defaults to 9600 8N1 with DTR & RTS asserted.
+  LineCoding()
+      : baud_rate(9600),
+        stop_bits(ONE_STOP_BIT),
+        parity(PARITY_NONE),
+        data_bits(8),
+        dtr(true),
+        rts(true) {
+  }
+
+  uint32_t baud_rate;
+  StopBits stop_bits;
+  Parity parity;
+  uint8_t data_bits;
+  bool dtr;
+  bool rts;
+};
+
+// CDC class requests
+static const uint8_t kSetLineCoding = 0x20;
+static const uint8_t kSetControlLineState = 0x22;
+static const uint8_t kClassInterfaceRequest = 0x21;
+static const unsigned int kControlTimeout = 1000;
+static const unsigned int kLineCodingSize = 7;
+
+void ControlCompleteHandler(struct libusb_transfer *transfer);
+
+/**
+ * A control transfer that's part of a batch.
+ */
+struct ControlRequest {
+  ControlRequest() : transfer(NULL), outstanding(NULL), device_ok(NULL) {}
+
+  libusb_transfer *transfer;
+  uint8_t buffer[LIBUSB_CONTROL_SETUP_SIZE + kLineCodingSize];
+  unsigned int *outstanding;
+  bool *device_ok;
+};
+
+void ControlCompleteHandler(struct libusb_transfer *transfer) {
+  ControlRequest *request = static_cast<ControlRequest*>(transfer->user_data);
+  if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+    cerr << "Control transfer failed: "
+         << TransferStatusName(transfer->status) << endl;
+    *request->device_ok = false;
+  }
+  (*request->outstanding)--;
 }
 
 /**
- * @returns a new device, or NULL
+ * Set the line coding & control line state on a set of devices.
+ *
+ * The SET_CONTROL_LINE_STATE and SET_LINE_CODING requests for every device
+ * are submitted together, and then we wait for them all to complete. So
+ * configuring N devices takes one control round trip rather than 2N.
+ *
+ * Devices that fail to configure are closed and removed from the list.
  */
-libusb_device_handle* OpenDevice(libusb_context *context) {
-  // Look for a specific device and open it.
-  struct libusb_device_handle *device = libusb_open_device_with_vid_pid(
-      context, kVendorId, kProductId);
-  if (!device) {
-    cout << "Failed to open device: VID: 0x" << std::hex << kVendorId
-         << ", PID: 0x" << std::hex << kProductId << endl;
+void ConfigureDevices(libusb_context *context,
+                      std::vector<libusb_device_handle*> *devices,
+                      const LineCoding &coding) {
+  const unsigned int device_count = devices->size();
+  std::vector<ControlRequest> requests(device_count * 2);
+  // vector<bool> isn't addressable, so use a plain array.
+  bool *device_ok = new bool[device_count];
+  unsigned int outstanding = 0;
+
+  const uint16_t line_state = (coding.dtr ? ACM_CTRL_DTR : 0) |
+                              (coding.rts ? ACM_CTRL_RTS : 0);
+
+  for (unsigned int i = 0; i < device_count; i++) {
+    libusb_device_handle *device = (*devices)[i];
+    device_ok[i] = true;
+
+    ControlRequest *line_state_request = &requests[2 * i];
+    libusb_fill_control_setup(line_state_request->buffer,
+                              kClassInterfaceRequest, kSetControlLineState,
+                              line_state, 0, 0);
+
+    // The line coding is little endian.
+    ControlRequest *coding_request = &requests[2 * i + 1];
+    libusb_fill_control_setup(coding_request->buffer, kClassInterfaceRequest,
+                              kSetLineCoding, 0, 0, kLineCodingSize);
+    uint8_t *encoding = coding_request->buffer + LIBUSB_CONTROL_SETUP_SIZE;
+    encoding[0] = static_cast<uint8_t>(coding.baud_rate);
+    encoding[1] = static_cast<uint8_t>(coding.baud_rate >> 8);
+    encoding[2] = static_cast<uint8_t>(coding.baud_rate >> 16);
+    encoding[3] = static_cast<uint8_t>(coding.baud_rate >> 24);
+    encoding[4] = static_cast<uint8_t>(coding.stop_bits);
+    encoding[5] = static_cast<uint8_t>(coding.parity);
+    encoding[6] = coding.data_bits;
+
+    for (unsigned int j = 2 * i; j < 2 * i + 2; j++) {
+      ControlRequest *request = &requests[j];
+      request->transfer = libusb_alloc_transfer(0);
+      request->outstanding = &outstanding;
+      request->device_ok = &device_ok[i];
+      libusb_fill_control_transfer(request->transfer, device, request->buffer,
+                                   ControlCompleteHandler, request,
+                                   kControlTimeout);
+      int r = libusb_submit_transfer(request->transfer);
+      if (r) {
+        cerr << "Failed to submit control transfer: " << libusb_error_name(r)
+             << endl;
+        device_ok[i] = false;
+      } else {
+        outstanding++;
+      }
+    }
+  }
+
+  // Each transfer has a timeout, so this terminates.
+  while (outstanding) {
+    libusb_handle_events(context);
+  }
+
+  std::vector<libusb_device_handle*> configured;
+  for (unsigned int i = 0; i < device_count; i++) {
+    if (device_ok[i]) {
+      configured.push_back((*devices)[i]);
+    } else {
+      libusb_close((*devices)[i]);
+    }
+  }
+  devices->swap(configured);
+
+  for (std::vector<ControlRequest>::iterator iter = requests.begin();
+       iter != requests.end(); ++iter) {
+    libusb_free_transfer(iter->transfer);
+  }
+  delete[] device_ok;
+}
+
+/**
+ * Open a device and claim its interfaces.
+ * @returns a new device handle, or NULL
+ */
+libusb_device_handle* OpenDevice(libusb_device *usb_device) {
+  libusb_device_handle *device = NULL;
+  int r = libusb_open(usb_device, &device);
+  if (r) {
+    cout << "Failed to open device: " << libusb_error_name(r) << endl;
     return NULL;
   }
 
   // A CDC device has a control and data interface.
   // Detatch the kernel driver from both.
-  int r;
   for (int iface = 0; iface < 2; iface++) {
     if (libusb_kernel_driver_active(device, iface)) {
       r = libusb_detach_kernel_driver(device, iface);
@@ -110,30 +731,40 @@ libusb_device_handle* OpenDevice(libusb_context *context) {
       return NULL;
     }
   }
+  return device;
+}
 
-  /* Start configuring the device:
-   * - set line state
-   */
-  r = libusb_control_transfer(
-      device, 0x21, 0x22, ACM_CTRL_DTR | ACM_CTRL_RTS, 0, NULL, 0, 0);
-  if (r < 0) {
-    cerr << "Control transferr failed: " << libusb_error_name(r) << endl;
-    libusb_close(device);
-    return NULL;
+/**
+ * Open all the attached devices that match our VID / PID.
+ */
+void OpenDevices(libusb_context *context,
+                 std::vector<libusb_device_handle*> *devices) {
+  libusb_device **list;
+  ssize_t count = libusb_get_device_list(context, &list);
+  if (count < 0) {
+    cerr << "libusb_get_device_list failed: " << libusb_error_name(count)
+         << endl;
+    return;
   }
 
-  /* - set line encoding: here 9600 8N1
-   * 9600 = 0x2580 ~> 0x80, 0x25 in little endian
-   */
-  uint8_t encoding[] = { 0x80, 0x25, 0x00, 0x00, 0x00, 0x00, 0x08 };
-  r = libusb_control_transfer(
-      device, 0x21, 0x20, 0, 0, encoding, sizeof(encoding), 0);
-  if (r < 0) {
-    cerr << "Control transfer 2 failed: " << libusb_error_name(r) << endl;
-    libusb_close(device);
-    return NULL;
+  for (ssize_t i = 0; i < count; i++) {
+    struct libusb_device_descriptor descriptor;
+    libusb_get_device_descriptor(list[i], &descriptor);
+    if (descriptor.idVendor != kVendorId ||
+        descriptor.idProduct != kProductId) {
+      continue;
+    }
+    libusb_device_handle *device = OpenDevice(list[i]);
+    if (device) {
+      devices->push_back(device);
+    }
+  }
+  libusb_free_device_list(list, 1);
+
+  if (devices->empty()) {
+    cout << "Failed to find any devices: VID: 0x" << std::hex << kVendorId
+         << ", PID: 0x" << std::hex << kProductId << std::dec << endl;
   }
-  return device;
 }
 
 int main(int argc, char **argv) {
@@ -147,25 +778,54 @@ int main(int argc, char **argv) {
 
   libusb_set_debug(context, 3);
 
-  // Look for a specific device and open it.
-  struct libusb_device_handle *device = OpenDevice(context);
-  if (!device) {
+  // Open all the devices, and configure them in one go.
+  std::vector<libusb_device_handle*> devices;
+  OpenDevices(context, &devices);
+  ConfigureDevices(context, &devices, LineCoding());
+  if (devices.empty()) {
     libusb_exit(context);
     exit(1);
   }
+  cout << "Configured " << devices.size() << " devices" << endl;
+  libusb_device_handle *device = devices[0];
 
-  unsigned char buf[65];
-  int len;
+  ContinuousReader reader(context, device);
+  reader.SetDataCallback(PrintReceivedData, &reader);
+  if (!reader.Start()) {
+    libusb_close(device);
+    libusb_exit(context);
+    exit(1);
+  }
 
+  AsyncWriter writer(context, device);
   const string request = "abc";
   while (true) {
-    Write(device, request);
-    cout << "Wrote: '" << request << "'" << endl;
-    sleep(1);
+    const unsigned int queued = writer.Write(request);
+    if (queued == request.size()) {
+      cout << "Wrote: '" << request << "'" << endl;
+    } else if (queued) {
+      cerr << "Only queued " << queued << " of " << request.size()
+           << " bytes" << endl;
+    } else {
+      cerr << "Write queue full, " << writer.InFlight() << " in flight"
+           << endl;
+    }
+
+    // Service completions until it's time for the next write.
+    struct timeval now, deadline;
+    gettimeofday(&deadline, NULL);
+    deadline.tv_sec += 1;
+    do {
+      struct timeval tv = {0, 100000};
+      libusb_handle_events_timeout(context, &tv);
+      gettimeofday(&now, NULL);
+    } while (timercmp(&now, &deadline, <));
   }
 
-  libusb_release_interface(device, 0);
-  libusb_close(device);
+  for (unsigned int i = 0; i < devices.size(); i++) {
+    libusb_release_interface(devices[i], 0);
+    libusb_close(devices[i]);
+  }
   libusb_exit(context);
   return 0;
 }
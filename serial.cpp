@@ -18,53 +18,1385 @@
  * Copyright (C) 2014 Simon Newton
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
+#include <algorithm>
+#include <fstream>
 #include <string>
 #include <iostream>
+#include <map>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/netlink.h>
+#include <linux/serial.h>
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && \
+    defined(__NR_io_uring_register)
+#define HAVE_IO_URING 1
+#endif
+#endif
 
 using std::cerr;
 using std::cout;
 using std::endl;
 using std::string;
 
-// Use /dev/ttyACN0 on Linux
-// Use "\\\\.\\USBSER000" or "\\\\.\\COM6" on Windows.
-static const char kDevice[] = "/dev/cu.usbmodem1d11111";
+// The ports that may have a widget attached.
+// On Windows these would be "\\\\.\\USBSER000" or "\\\\.\\COM6".
+static const char *kPortPatterns[] = {
+  "/dev/ttyACM*",
+  "/dev/ttyUSB*",
+  "/dev/cu.usbmodem*",
+};
+
+// The same device that libusb.cpp looks for.
+static const uint16_t kProductId = 0x5252;
+static const uint16_t kVendorId = 0x1d50;
+
+// How long to wait for a widget to answer the probe.
+static const int kProbeTimeoutMs = 250;
+
+// Framing, this matches what the vendor device uses.
+static const uint8_t kSOFIdentifier = 0x5a;
+static const uint8_t kEOFIdentifier = 0xa5;
+static const unsigned int kHeaderSize = 5;
+static const unsigned int kMaxMessageSize = 513;
+
+enum {
+  ECHO_COMMAND = 0x80,
+  TX_DMX = 0x81
+};
+
+// The read buffer for each port, when using io_uring.
+static const unsigned int kUringReadSize = 1024;
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/**
+ * @returns the monotonic time in milliseconds.
+ */
+int64_t MonotonicMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Write an entire iovec array to a descriptor.
+ *
+ * Short writes are resumed from where they stopped, and if the descriptor is
+ * non-blocking we poll() until it's writable again. The iovec array is
+ * modified in the process.
+ * @param timeout_ms how long to wait for the descriptor to become writable,
+ *   in total, or -1 to wait forever.
+ * @returns true if all the data was written, false on error or timeout.
+ */
+bool WriteFully(int fd, struct iovec *iov, unsigned int count,
+                int timeout_ms = -1) {
+  const int64_t deadline = MonotonicMs() + timeout_ms;
+  while (count) {
+    ssize_t r = writev(fd, iov, count > IOV_MAX ? IOV_MAX : count);
+    if (r < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        int wait = -1;
+        if (timeout_ms >= 0) {
+          const int64_t remaining = deadline - MonotonicMs();
+          wait = remaining > 0 ? static_cast<int>(remaining) : 0;
+        }
+        struct pollfd pfd = {fd, POLLOUT, 0};
+        int ready = poll(&pfd, 1, wait);
+        if (ready < 0 && errno != EINTR) {
+          cerr << "poll() failed: " << strerror(errno) << endl;
+          return false;
+        } else if (ready == 0) {
+          cerr << "Timed out writing to the port" << endl;
+          return false;
+        }
+        continue;
+      }
+      cerr << "writev() failed: " << strerror(errno) << endl;
+      return false;
+    }
+
+    // Skip over the iovecs that were written completely, then adjust the
+    // first partially written one.
+    size_t written = static_cast<size_t>(r);
+    while (count && written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count) {
+      iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + written;
+      iov->iov_len -= written;
+    }
+  }
+  return true;
+}
 
-int main() {
-  int fd = open(kDevice, O_RDWR | O_NOCTTY);
-  if (fd == -1) {
-    cerr << "Failed to open " << kDevice << " : " << strerror(errno) << endl;
-    return 1;
+/**
+ * How a port should be tuned.
+ */
+enum PortMode {
+  // read() returns as soon as a single byte arrives. Best for small
+  // request / response messages.
+  LOW_LATENCY_MODE,
+  // read() waits until VMIN bytes arrive or the line goes idle for VTIME.
+  // Fewer wakeups when bulk data is streaming in.
+  THROUGHPUT_MODE
+};
+
+/**
+ * Options used to configure a serial port.
+ *
+ * VMIN & VTIME only apply to blocking descriptors, see termios(3).
+ */
+struct PortOptions {
+  explicit PortOptions(PortMode mode = LOW_LATENCY_MODE)
+      : mode(mode),
+        vmin(mode == LOW_LATENCY_MODE ? 1 : 255),
+        vtime(mode == LOW_LATENCY_MODE ? 0 : 1) {
+  }
+
+  PortMode mode;
+  cc_t vmin;  // minimum number of bytes for read() to return
+  cc_t vtime;  // inter-byte timeout, in tenths of a second
+};
+
+/**
+ * Put the terminal into raw mode.
+ *
+ * This is the same as cfmakeraw(), which isn't available everywhere. All
+ * input and output processing is disabled so binary frames pass through
+ * untouched.
+ */
+void MakeRaw(struct termios *options) {
+  options->c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR |
+                        ICRNL | IXON | IXOFF | IXANY);
+  options->c_oflag &= ~OPOST;
+  options->c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+  options->c_cflag &= ~(CSIZE | PARENB | CSTOPB);
+#ifdef CRTSCTS
+  options->c_cflag &= ~CRTSCTS;
+#endif
+  options->c_cflag |= CS8 | CREAD | CLOCAL;
+}
+
+/**
+ * Set the driver's low latency flag, if the platform supports it.
+ *
+ * Failure here isn't fatal, many drivers don't implement TIOCSSERIAL.
+ */
+void SetLowLatency(int fd, bool low_latency) {
+#if defined(__linux__) && defined(TIOCGSERIAL) && defined(ASYNC_LOW_LATENCY)
+  struct serial_struct serial;
+  if (ioctl(fd, TIOCGSERIAL, &serial) < 0) {
+    return;
+  }
+  if (low_latency) {
+    serial.flags |= ASYNC_LOW_LATENCY;
+  } else {
+    serial.flags &= ~ASYNC_LOW_LATENCY;
+  }
+  if (ioctl(fd, TIOCSSERIAL, &serial) < 0) {
+    cerr << "Failed to set ASYNC_LOW_LATENCY: " << strerror(errno) << endl;
   }
+#else
+  (void) fd;
+  (void) low_latency;
+#endif
+}
 
+/**
+ * Configure a serial port for sending binary frames.
+ * @returns true if the port was configured, false otherwise.
+ */
+bool ConfigurePort(int fd, const PortOptions &port_options) {
   struct termios options;
-  tcgetattr(fd, &options);
-  options.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
-  options.c_oflag &= ~(ONLCR | OCRNL);
-  int r = tcsetattr(fd, TCSANOW, &options);
-  if (r) {
+  if (tcgetattr(fd, &options)) {
+    cerr << "tcgetattr failed: " << strerror(errno) << endl;
+    return false;
+  }
+
+  MakeRaw(&options);
+  options.c_cc[VMIN] = port_options.vmin;
+  options.c_cc[VTIME] = port_options.vtime;
+
+  if (tcsetattr(fd, TCSANOW, &options)) {
     cerr << "tcsetattr failed: " << strerror(errno) << endl;
-    return 1;
+    return false;
+  }
+
+  SetLowLatency(fd, port_options.mode == LOW_LATENCY_MODE);
+  // Drop anything that arrived before we were configured.
+  tcflush(fd, TCIOFLUSH);
+  return true;
+}
+
+/**
+ * A message waiting to be written. The header is built here, the payload
+ * stays wherever the caller has it.
+ */
+struct Frame {
+  uint8_t header[kHeaderSize];
+  const uint8_t *data;
+  unsigned int size;
+};
+
+/**
+ * Frame a message, without copying the payload.
+ */
+Frame MakeFrame(uint16_t command, const uint8_t *data, unsigned int size) {
+  Frame frame;
+  frame.header[0] = kSOFIdentifier;
+  frame.header[1] = static_cast<uint8_t>(command & 0xff);
+  frame.header[2] = static_cast<uint8_t>(command >> 8);
+  frame.header[3] = static_cast<uint8_t>(size & 0xff);
+  frame.header[4] = static_cast<uint8_t>(size >> 8);
+  frame.data = data;
+  frame.size = size;
+  return frame;
+}
+
+/**
+ * Add the iovecs that write each frame's header, payload and trailer. They
+ * point into the frames, so the vector mustn't change until the write is
+ * done.
+ */
+void AppendFrameIOVecs(const std::vector<Frame> &frames,
+                       std::vector<struct iovec> *iov) {
+  for (std::vector<Frame>::const_iterator iter = frames.begin();
+       iter != frames.end(); ++iter) {
+    struct iovec entry;
+    // writev() doesn't modify the data.
+    entry.iov_base = const_cast<uint8_t*>(iter->header);
+    entry.iov_len = kHeaderSize;
+    iov->push_back(entry);
+    if (iter->size) {
+      entry.iov_base = const_cast<uint8_t*>(iter->data);
+      entry.iov_len = iter->size;
+      iov->push_back(entry);
+    }
+    entry.iov_base = const_cast<uint8_t*>(&kEOFIdentifier);
+    entry.iov_len = sizeof(kEOFIdentifier);
+    iov->push_back(entry);
+  }
+}
+
+/**
+ * Frames messages and writes them to a serial port.
+ *
+ * Each message is sent as a header, the payload and a trailer using writev()
+ * so the payload is never copied. Messages queued between calls to Flush()
+ * are coalesced into a single writev().
+ */
+class FrameWriter {
+ public:
+  explicit FrameWriter(int fd) : m_fd(fd) {}
+
+  /**
+   * Queue a message for sending.
+   * @param command the command id.
+   * @param data the payload, this must remain valid until Flush() is called.
+   * @param size the size of the payload.
+   * @returns false if the message is too large.
+   */
+  bool Queue(uint16_t command, const uint8_t *data, unsigned int size) {
+    if (size > kMaxMessageSize) {
+      cerr << "Message exceeds max size" << endl;
+      return false;
+    }
+    m_frames.push_back(MakeFrame(command, data, size));
+    return true;
+  }
+
+  /**
+   * Write all queued messages to the port.
+   * @param timeout_ms how long to wait for a non-blocking port to drain, or
+   *   -1 to wait forever.
+   * @returns true if every message was written completely.
+   */
+  bool Flush(int timeout_ms = -1) {
+    if (m_frames.empty()) {
+      return true;
+    }
+
+    // The frames vector doesn't change until the write completes, so it's
+    // safe to point into the headers.
+    m_iov.clear();
+    AppendFrameIOVecs(m_frames, &m_iov);
+    const bool ok = WriteFully(m_fd, &m_iov[0], m_iov.size(), timeout_ms);
+    m_frames.clear();
+    return ok;
+  }
+
+  unsigned int QueuedMessages() const { return m_frames.size(); }
+
+ private:
+  int m_fd;
+  // These are kept between calls so we don't allocate on each Flush().
+  std::vector<Frame> m_frames;
+  std::vector<struct iovec> m_iov;
+};
+
+/**
+ * Read a hex value, like idVendor, from a sysfs file.
+ */
+bool ReadSysfsHex(const string &path, uint16_t *value) {
+  std::ifstream file(path.c_str());
+  unsigned int v;
+  if (!(file >> std::hex >> v)) {
+    return false;
+  }
+  *value = static_cast<uint16_t>(v);
+  return true;
+}
+
+/**
+ * The USB identity of the device behind a tty.
+ */
+struct UsbInfo {
+  UsbInfo() : vendor_id(0), product_id(0) {}
+
+  uint16_t vendor_id;
+  uint16_t product_id;
+  string serial;
+
+  bool IsWidget() const {
+    return vendor_id == kVendorId && product_id == kProductId;
+  }
+};
+
+/**
+ * Look up the USB device behind a tty using sysfs.
+ *
+ * For ttyACM the device link points at the USB interface, for ttyUSB it
+ * points at the usb-serial port, so walk up a couple of levels until we find
+ * the USB device.
+ * @param tty the name of the tty, e.g. ttyACM0
+ * @param info the UsbInfo to populate
+ * @returns false if the info isn't available, e.g. this isn't Linux.
+ */
+bool ReadUsbInfo(const string &tty, UsbInfo *info) {
+  string dir = "/sys/class/tty/" + tty + "/device";
+  for (unsigned int i = 0; i < 3; i++) {
+    if (ReadSysfsHex(dir + "/idVendor", &info->vendor_id) &&
+        ReadSysfsHex(dir + "/idProduct", &info->product_id)) {
+      // Not all devices have a serial number.
+      std::ifstream file((dir + "/serial").c_str());
+      std::getline(file, info->serial);
+      return true;
+    }
+    dir += "/..";
+  }
+  return false;
+}
+
+/**
+ * Caches the USB identity of each tty, from sysfs.
+ *
+ * This lets us identify widgets without opening, and possibly disturbing,
+ * every serial port. On Linux we listen for kernel uevents and only walk
+ * sysfs again once a tty has been added or removed. Elsewhere, or if the
+ * netlink socket can't be opened, we re-read sysfs each time.
+ */
+class SysfsPortCache {
+ public:
+  SysfsPortCache()
+      : m_uevent_fd(-1),
+        m_stale(true) {
+#ifdef __linux__
+    m_uevent_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                         NETLINK_KOBJECT_UEVENT);
+    if (m_uevent_fd >= 0) {
+      struct sockaddr_nl address;
+      memset(&address, 0, sizeof(address));
+      address.nl_family = AF_NETLINK;
+      address.nl_groups = 1;  // kernel events
+      if (bind(m_uevent_fd, reinterpret_cast<struct sockaddr*>(&address),
+               sizeof(address))) {
+        close(m_uevent_fd);
+        m_uevent_fd = -1;
+      }
+    }
+#endif
+  }
+
+  ~SysfsPortCache() {
+    if (m_uevent_fd >= 0) {
+      close(m_uevent_fd);
+    }
+  }
+
+  /**
+   * The descriptor that becomes readable when a uevent arrives, or -1. The
+   * caller can poll() this and then call ProcessUevents().
+   */
+  int UeventFd() const { return m_uevent_fd; }
+
+  /**
+   * Wait for a tty to be added or removed, after the last call to Lookup().
+   * @param timeout_ms the time to wait, or -1 to wait forever.
+   * @returns true if a tty changed, false on timeout or if uevents aren't
+   *   available.
+   */
+  bool WaitForChange(int timeout_ms) {
+    if (m_uevent_fd < 0) {
+      return false;
+    }
+    const int64_t deadline = MonotonicMs() + timeout_ms;
+    while (!ProcessUevents()) {
+      int wait = -1;
+      if (timeout_ms >= 0) {
+        const int64_t remaining = deadline - MonotonicMs();
+        if (remaining <= 0) {
+          return false;
+        }
+        wait = static_cast<int>(remaining);
+      }
+      struct pollfd pfd = {m_uevent_fd, POLLIN, 0};
+      if (poll(&pfd, 1, wait) < 0 && errno != EINTR) {
+        cerr << "poll() failed: " << strerror(errno) << endl;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * Drain any pending uevents, and mark the cache stale if a tty changed.
+   * @returns true if a tty changed, or may have.
+   */
+  bool ProcessUevents() {
+    if (m_uevent_fd < 0) {
+      m_stale = true;
+      return true;
+    }
+
+    char buffer[4096];
+    ssize_t r;
+    bool changed = false;
+    while ((r = recv(m_uevent_fd, buffer, sizeof(buffer) - 1, 0)) > 0) {
+      // Each event is a series of NUL separated strings, the first is
+      // ACTION@DEVPATH.
+      buffer[r] = 0;
+      if (strstr(buffer, "/tty/")) {
+        m_stale = true;
+        changed = true;
+      }
+    }
+    if (r < 0 && errno == ENOBUFS) {
+      // The socket overflowed and events were dropped, so any tty could have
+      // come or gone.
+      m_stale = true;
+      return true;
+    }
+    return changed;
+  }
+
+  /**
+   * Look up the USB info for a port.
+   * @param path the path to the port, e.g. /dev/ttyACM0
+   * @param info the UsbInfo to populate.
+   * @returns true if the port is known to sysfs.
+   */
+  bool Lookup(const string &path, UsbInfo *info) {
+    ProcessUevents();
+    if (m_stale) {
+      Refresh();
+    }
+    PortMap::const_iterator iter = m_ports.find(
+        path.substr(path.rfind('/') + 1));
+    if (iter == m_ports.end()) {
+      return false;
+    }
+    *info = iter->second;
+    return true;
+  }
+
+ private:
+  typedef std::map<string, UsbInfo> PortMap;
+
+  int m_uevent_fd;
+  bool m_stale;
+  PortMap m_ports;
+
+  void Refresh() {
+    m_ports.clear();
+    m_stale = false;
+
+    DIR *dir = opendir("/sys/class/tty");
+    if (!dir) {
+      return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+      const string tty = entry->d_name;
+      if (tty.compare(0, 6, "ttyACM") && tty.compare(0, 6, "ttyUSB")) {
+        continue;
+      }
+      UsbInfo info;
+      if (ReadUsbInfo(tty, &info)) {
+        m_ports[tty] = info;
+      }
+    }
+    closedir(dir);
+  }
+
+  SysfsPortCache(const SysfsPortCache&);
+  SysfsPortCache& operator=(const SysfsPortCache&);
+};
+
+/**
+ * Split the serial ports into those sysfs says are widgets, and those we
+ * don't know about and will have to probe.
+ */
+void ListCandidatePorts(SysfsPortCache *cache,
+                        std::vector<std::pair<string, UsbInfo> > *widgets,
+                        std::vector<string> *unknown) {
+  for (unsigned int i = 0; i < sizeof(kPortPatterns) / sizeof(kPortPatterns[0]);
+       i++) {
+    glob_t results;
+    if (glob(kPortPatterns[i], 0, NULL, &results) == 0) {
+      for (size_t j = 0; j < results.gl_pathc; j++) {
+        const string port = results.gl_pathv[j];
+        UsbInfo info;
+        if (!cache->Lookup(port, &info)) {
+          unknown->push_back(port);
+        } else if (info.IsWidget()) {
+          widgets->push_back(std::make_pair(port, info));
+        }
+      }
+    }
+    globfree(&results);
+  }
+}
+
+/**
+ * A widget attached to a serial port.
+ */
+struct Widget {
+  string path;
+  string serial;  // empty if unknown
+  int fd;
+};
+
+/**
+ * Find the widgets attached to the serial ports.
+ *
+ * Ports that sysfs identifies as widgets are opened directly. The remaining
+ * candidate ports are opened and sent an echo request up front, then we wait
+ * for the responses together. This means discovery takes at most one probe
+ * timeout, rather than one per port.
+ *
+ * The descriptors of the widgets found are returned in blocking mode, the
+ * caller is responsible for closing them.
+ */
+std::vector<Widget> DiscoverWidgets(SysfsPortCache *cache, int timeout_ms) {
+  struct Probe {
+    string path;
+    string response;
+  };
+
+  // The widget echos this back to us.
+  static const char kProbeToken[] = "widget-probe";
+  const unsigned int token_size = sizeof(kProbeToken) - 1;
+
+  std::vector<std::pair<string, UsbInfo> > known;
+  std::vector<string> ports;
+  ListCandidatePorts(cache, &known, &ports);
+
+  std::vector<Widget> widgets;
+  for (std::vector<std::pair<string, UsbInfo> >::const_iterator iter =
+         known.begin();
+       iter != known.end(); ++iter) {
+    int fd = open(iter->first.c_str(), O_RDWR | O_NOCTTY);
+    if (fd < 0) {
+      cerr << "Failed to open " << iter->first << " : " << strerror(errno)
+           << endl;
+      continue;
+    }
+    if (!ConfigurePort(fd, PortOptions(LOW_LATENCY_MODE))) {
+      close(fd);
+      continue;
+    }
+    Widget widget = {iter->first, iter->second.serial, fd};
+    widgets.push_back(widget);
+  }
+
+  // Writing the probes counts towards the timeout too, so a port that
+  // won't drain can't hold up the others.
+  const int64_t deadline = MonotonicMs() + timeout_ms;
+  std::vector<Probe> probes;
+  std::vector<struct pollfd> pfds;
+
+  for (std::vector<string>::const_iterator iter = ports.begin();
+       iter != ports.end(); ++iter) {
+    // Open non-blocking, so a port with the carrier down doesn't stall us.
+    int fd = open(iter->c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0) {
+      continue;
+    }
+
+    FrameWriter writer(fd);
+    writer.Queue(ECHO_COMMAND, reinterpret_cast<const uint8_t*>(kProbeToken),
+                 token_size);
+    const int64_t remaining = std::max<int64_t>(deadline - MonotonicMs(), 0);
+    if (!ConfigurePort(fd, PortOptions(LOW_LATENCY_MODE)) ||
+        !writer.Flush(static_cast<int>(remaining))) {
+      close(fd);
+      continue;
+    }
+
+    Probe probe;
+    probe.path = *iter;
+    probes.push_back(probe);
+    struct pollfd pfd = {fd, POLLIN, 0};
+    pfds.push_back(pfd);
+  }
+
+  unsigned int outstanding = probes.size();
+  while (outstanding) {
+    int64_t remaining = deadline - MonotonicMs();
+    if (remaining <= 0) {
+      break;
+    }
+    int r = poll(&pfds[0], pfds.size(), static_cast<int>(remaining));
+    if (r < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      cerr << "poll() failed: " << strerror(errno) << endl;
+      break;
+    }
+
+    for (unsigned int i = 0; i < pfds.size(); i++) {
+      if (pfds[i].fd < 0 || !pfds[i].revents) {
+        continue;
+      }
+
+      char buffer[128];
+      ssize_t bytes = read(pfds[i].fd, buffer, sizeof(buffer));
+      if (bytes > 0) {
+        probes[i].response.append(buffer, bytes);
+      }
+      bool found = probes[i].response.find(kProbeToken) != string::npos;
+      if (found || bytes == 0 ||
+          (bytes < 0 && errno != EAGAIN && errno != EINTR)) {
+        if (found) {
+          int flags = fcntl(pfds[i].fd, F_GETFL);
+          fcntl(pfds[i].fd, F_SETFL, flags & ~O_NONBLOCK);
+          Widget widget = {probes[i].path, "", pfds[i].fd};
+          widgets.push_back(widget);
+        } else {
+          close(pfds[i].fd);
+        }
+        // poll() ignores negative descriptors.
+        pfds[i].fd = -1;
+        outstanding--;
+      }
+    }
+  }
+
+  for (unsigned int i = 0; i < pfds.size(); i++) {
+    if (pfds[i].fd >= 0) {
+      close(pfds[i].fd);
+    }
+  }
+  return widgets;
+}
+
+#ifdef HAVE_IO_URING
+/**
+ * Drives many serial ports from one thread, using io_uring.
+ *
+ * A read is kept outstanding on every port, and re-armed as soon as it
+ * completes. Messages queued for any of the ports are written by Flush(),
+ * which submits a writev for each port, along with the re-armed reads, in a
+ * single io_uring_enter(). That's one system call per batch, rather than a
+ * read() and a writev() per message per port. Short writes are resubmitted
+ * from where they stopped, and messages queued while a port's write is in
+ * flight follow it.
+ *
+ * This uses the system calls directly, so there's no dependency on
+ * liburing. If the kernel doesn't support io_uring, or the operations used
+ * here, Init() fails and the caller can fall back to read() & write().
+ */
+class UringPortSet {
+ public:
+  // Called when data arrives on a port.
+  typedef void (*DataCallback)(void *user_data, unsigned int port,
+                               const uint8_t *data, unsigned int size);
+
+  UringPortSet()
+      : m_ring_fd(-1),
+        m_sq_ring(NULL),
+        m_cq_ring(NULL),
+        m_sqes(NULL),
+        m_sq_ring_size(0),
+        m_cq_ring_size(0),
+        m_sqes_size(0),
+        m_entries(0),
+        m_to_submit(0),
+        m_callback(NULL),
+        m_callback_data(NULL),
+        m_system_calls(0) {
+  }
+
+  ~UringPortSet() {
+    // Closing the ring doesn't wait for reads io-wq has already started,
+    // which would land in the ports' buffers after they're freed.
+    const bool idle = !m_sqes || CancelAll();
+    if (m_sqes) {
+      munmap(m_sqes, m_sqes_size);
+    }
+    if (m_cq_ring && m_cq_ring != m_sq_ring) {
+      munmap(m_cq_ring, m_cq_ring_size);
+    }
+    if (m_sq_ring) {
+      munmap(m_sq_ring, m_sq_ring_size);
+    }
+    if (m_ring_fd >= 0) {
+      close(m_ring_fd);
+    }
+    if (!idle) {
+      // Better to leak the ports than have the kernel write to freed memory.
+      cerr << "Failed to cancel io_uring operations" << endl;
+      return;
+    }
+    for (std::vector<Port*>::iterator iter = m_ports.begin();
+         iter != m_ports.end(); ++iter) {
+      delete *iter;
+    }
+  }
+
+  /**
+   * Set up the ring.
+   * @param max_ports the most ports that will be added.
+   * @returns false if io_uring, or one of the operations we need, isn't
+   *   available.
+   */
+  bool Init(unsigned int max_ports) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // A read and a write per port, and the timeout.
+    m_ring_fd = syscall(__NR_io_uring_setup, 2 * max_ports + 1, &params);
+    if (m_ring_fd < 0) {
+      cerr << "io_uring_setup failed: " << strerror(errno) << endl;
+      return false;
+    }
+    if (!SupportsOperations()) {
+      return false;
+    }
+    m_entries = params.sq_entries;
+
+    m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(__u32);
+    m_cq_ring_size = params.cq_off.cqes +
+                     params.cq_entries * sizeof(struct io_uring_cqe);
+    // Newer kernels map both rings at once.
+    const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+      m_sq_ring_size = m_cq_ring_size = std::max(m_sq_ring_size,
+                                                 m_cq_ring_size);
+    }
+    m_sq_ring = MapRing(m_sq_ring_size, IORING_OFF_SQ_RING);
+    if (!m_sq_ring) {
+      return false;
+    }
+    m_cq_ring = single_mmap ? m_sq_ring :
+        MapRing(m_cq_ring_size, IORING_OFF_CQ_RING);
+    if (!m_cq_ring) {
+      return false;
+    }
+    m_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    m_sqes = static_cast<struct io_uring_sqe*>(
+        MapRing(m_sqes_size, IORING_OFF_SQES));
+    if (!m_sqes) {
+      return false;
+    }
+
+    uint8_t *sq = static_cast<uint8_t*>(m_sq_ring);
+    m_sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    m_sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    m_sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    m_sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    uint8_t *cq = static_cast<uint8_t*>(m_cq_ring);
+    m_cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    m_cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    m_cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    m_cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+    return true;
+  }
+
+  void SetDataCallback(DataCallback callback, void *user_data) {
+    m_callback = callback;
+    m_callback_data = user_data;
+  }
+
+  /**
+   * Start reading from a port, the descriptor remains the caller's.
+   * @returns the port number, or -1 if the set is full.
+   */
+  int AddPort(int fd) {
+    if (2 * (m_ports.size() + 1) + 1 > m_entries) {
+      return -1;
+    }
+    Port *port = new Port();
+    port->fd = fd;
+    port->reading = true;
+    port->write_pending = false;
+    port->iov_offset = 0;
+    m_ports.push_back(port);
+    PrepareRead(m_ports.size() - 1);
+    return m_ports.size() - 1;
+  }
+
+  /**
+   * Queue a message for a port.
+   * @param data the payload, this must remain valid until the write
+   *   completes, i.e. until a later call to Poll() returns.
+   * @returns false if the message is too large, or there's no such port, or
+   *   the port has stopped reading because it's gone away.
+   */
+  bool Queue(unsigned int port, uint16_t command, const uint8_t *data,
+             unsigned int size) {
+    if (port >= m_ports.size() || size > kMaxMessageSize ||
+        !m_ports[port]->reading) {
+      return false;
+    }
+    m_ports[port]->queued.push_back(MakeFrame(command, data, size));
+    return true;
+  }
+
+  /**
+   * Submit the queued messages, and any reads that need re-arming, with a
+   * single system call.
+   */
+  bool Flush() {
+    for (unsigned int i = 0; i < m_ports.size(); i++) {
+      if (!m_ports[i]->write_pending && !m_ports[i]->queued.empty()) {
+        StartWrite(i);
+      }
+    }
+    return m_to_submit ? Enter(0, 0) : true;
+  }
+
+  /**
+   * Wait for something to complete, and handle everything that has. This
+   * also submits anything that's been prepared.
+   * @param timeout_ms how long to wait, in ms.
+   * @returns false if io_uring_enter() failed.
+   */
+  bool Poll(int timeout_ms) {
+    m_timeout.tv_sec = timeout_ms / 1000;
+    m_timeout.tv_nsec = (timeout_ms % 1000) * 1000000ll;
+    struct io_uring_sqe *sqe = NextSqe();
+    if (!sqe) {
+      return false;
+    }
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = reinterpret_cast<uintptr_t>(&m_timeout);
+    sqe->len = 1;
+    // Complete after one other completion, if that's sooner.
+    sqe->off = 1;
+    sqe->user_data = kTimeoutTag;
+
+    if (!Enter(1, IORING_ENTER_GETEVENTS)) {
+      return false;
+    }
+    Reap();
+    return true;
+  }
+
+  /**
+   * @returns true if a port has a write in flight, anything queued now waits
+   *   for it.
+   */
+  bool WritePending(unsigned int port) const {
+    return port < m_ports.size() && m_ports[port]->write_pending;
+  }
+
+  // The number of io_uring_enter() calls made.
+  unsigned int SystemCalls() const { return m_system_calls; }
+
+ private:
+  struct Port {
+    int fd;
+    // False once a read fails or can't be queued, nothing more is read from
+    // or written to the port after that.
+    bool reading;
+    uint8_t read_buffer[kUringReadSize];
+    // Waiting for the write in flight to complete.
+    std::vector<Frame> queued;
+    // The frames being written, and the iovecs pointing at them.
+    std::vector<Frame> writing;
+    std::vector<struct iovec> iov;
+    // The first iovec that hasn't been written completely.
+    unsigned int iov_offset;
+    bool write_pending;
+  };
+
+  // The low bit of the user data says which operation completed, the rest
+  // is the port.
+  static const __u64 kWriteTag = 1;
+  static const __u64 kTimeoutTag = ~0ull;
+  static const __u64 kCancelTag = ~0ull - 1;
+
+  int m_ring_fd;
+  void *m_sq_ring;
+  void *m_cq_ring;
+  struct io_uring_sqe *m_sqes;
+  size_t m_sq_ring_size;
+  size_t m_cq_ring_size;
+  size_t m_sqes_size;
+  unsigned int m_entries;
+  // The kernel updates the heads of the submission queue, and the tails of
+  // the completion queue, so those are read with acquire semantics.
+  unsigned *m_sq_head;
+  unsigned *m_sq_tail;
+  unsigned m_sq_mask;
+  unsigned *m_sq_array;
+  unsigned *m_cq_head;
+  unsigned *m_cq_tail;
+  unsigned m_cq_mask;
+  struct io_uring_cqe *m_cqes;
+  unsigned int m_to_submit;
+  struct __kernel_timespec m_timeout;
+
+  std::vector<Port*> m_ports;
+  DataCallback m_callback;
+  void *m_callback_data;
+  unsigned int m_system_calls;
+
+  /**
+   * Check the kernel has the operations we use. Kernels from 5.1 to 5.5 set
+   * up a ring, but don't have IORING_OP_READ, so every read would fail.
+   * IORING_REGISTER_PROBE arrived along with it in 5.6.
+   */
+  bool SupportsOperations() {
+    const __u8 operations[] = {
+      IORING_OP_READ, IORING_OP_WRITEV, IORING_OP_TIMEOUT,
+      IORING_OP_ASYNC_CANCEL};
+    std::vector<uint8_t> buffer(sizeof(struct io_uring_probe) +
+                                IORING_OP_LAST * sizeof(io_uring_probe_op));
+    struct io_uring_probe *probe =
+        reinterpret_cast<struct io_uring_probe*>(&buffer[0]);
+    if (syscall(__NR_io_uring_register, m_ring_fd, IORING_REGISTER_PROBE,
+                probe, IORING_OP_LAST) < 0) {
+      cerr << "io_uring is too old, probe failed: " << strerror(errno)
+           << endl;
+      return false;
+    }
+    for (unsigned int i = 0; i < sizeof(operations); i++) {
+      const __u8 operation = operations[i];
+      if (operation > probe->last_op ||
+          !(probe->ops[operation].flags & IO_URING_OP_SUPPORTED)) {
+        cerr << "io_uring doesn't support operation "
+             << static_cast<int>(operation) << endl;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void *MapRing(size_t size, off_t offset) {
+    void *ring = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, m_ring_fd, offset);
+    if (ring == MAP_FAILED) {
+      cerr << "Failed to map io_uring: " << strerror(errno) << endl;
+      return NULL;
+    }
+    return ring;
+  }
+
+  bool Enter(unsigned int min_complete, unsigned int flags) {
+    while (true) {
+      m_system_calls++;
+      int r = syscall(__NR_io_uring_enter, m_ring_fd, m_to_submit,
+                      min_complete, flags, NULL, 0);
+      if (r >= 0) {
+        m_to_submit -= r;
+        return true;
+      }
+      if (errno != EINTR) {
+        cerr << "io_uring_enter failed: " << strerror(errno) << endl;
+        return false;
+      }
+    }
+  }
+
+  /**
+   * @returns the next free submission queue entry, cleared, or NULL if the
+   *   queue is full even after submitting what's there.
+   */
+  struct io_uring_sqe *NextSqe() {
+    unsigned tail = *m_sq_tail;
+    if (tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) == m_entries) {
+      if (!Enter(0, 0) ||
+          tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) == m_entries) {
+        return NULL;
+      }
+    }
+    const unsigned index = tail & m_sq_mask;
+    struct io_uring_sqe *sqe = &m_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    m_sq_array[index] = index;
+    // The kernel doesn't look at the entry until io_uring_enter(), so it's
+    // fine to publish it before it's filled in.
+    __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    m_to_submit++;
+    return sqe;
+  }
+
+  void PrepareRead(unsigned int index) {
+    Port *port = m_ports[index];
+    struct io_uring_sqe *sqe = NextSqe();
+    if (!sqe) {
+      cerr << "io_uring submission queue is full" << endl;
+      port->reading = false;
+      return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = port->fd;
+    sqe->addr = reinterpret_cast<uintptr_t>(port->read_buffer);
+    sqe->len = sizeof(port->read_buffer);
+    // Ttys don't have a position, use the current one.
+    sqe->off = static_cast<__u64>(-1);
+    sqe->user_data = static_cast<__u64>(index) << 1;
+  }
+
+  void StartWrite(unsigned int index) {
+    Port *port = m_ports[index];
+    port->writing.swap(port->queued);
+    port->queued.clear();
+    // The writing vector doesn't change from here on, so it's safe to point
+    // into the headers.
+    port->iov.clear();
+    AppendFrameIOVecs(port->writing, &port->iov);
+    port->iov_offset = 0;
+    PrepareWrite(index);
+  }
+
+  void PrepareWrite(unsigned int index) {
+    Port *port = m_ports[index];
+    struct io_uring_sqe *sqe = NextSqe();
+    if (!sqe) {
+      cerr << "io_uring submission queue is full" << endl;
+      port->writing.clear();
+      return;
+    }
+    const unsigned int count = std::min<size_t>(
+        port->iov.size() - port->iov_offset, IOV_MAX);
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = port->fd;
+    sqe->addr = reinterpret_cast<uintptr_t>(&port->iov[port->iov_offset]);
+    sqe->len = count;
+    sqe->off = static_cast<__u64>(-1);
+    sqe->user_data = (static_cast<__u64>(index) << 1) | kWriteTag;
+    port->write_pending = true;
+  }
+
+  /**
+   * Handle everything on the completion queue.
+   */
+  void Reap() {
+    unsigned head = *m_cq_head;
+    while (head != __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE)) {
+      const struct io_uring_cqe cqe = m_cqes[head & m_cq_mask];
+      head++;
+      // Hand the entry back before the callback, which may submit more.
+      __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+
+      if (cqe.user_data == kTimeoutTag) {
+        continue;
+      }
+      const unsigned int index = cqe.user_data >> 1;
+      if (cqe.user_data & kWriteTag) {
+        WriteComplete(index, cqe.res);
+      } else {
+        ReadComplete(index, cqe.res);
+      }
+    }
+  }
+
+  /**
+   * Cancel every read and write, and wait for them all to complete.
+   * @returns false if they couldn't be cancelled.
+   */
+  bool CancelAll() {
+    for (unsigned int i = 0; i < m_ports.size(); i++) {
+      const __u64 operations[] = {
+        static_cast<__u64>(i) << 1, (static_cast<__u64>(i) << 1) | kWriteTag};
+      const bool in_flight[] = {m_ports[i]->reading,
+                                m_ports[i]->write_pending};
+      for (unsigned int j = 0; j < 2; j++) {
+        if (!in_flight[j]) {
+          continue;
+        }
+        struct io_uring_sqe *sqe = NextSqe();
+        if (!sqe) {
+          return false;
+        }
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = operations[j];
+        sqe->user_data = kCancelTag;
+      }
+    }
+
+    // Each operation still completes, cancelled or not, and only then is it
+    // done with its buffer.
+    while (true) {
+      bool pending = false;
+      for (unsigned int i = 0; i < m_ports.size(); i++) {
+        pending |= m_ports[i]->reading || m_ports[i]->write_pending;
+      }
+      if (!pending) {
+        return true;
+      }
+      if (!Enter(1, IORING_ENTER_GETEVENTS)) {
+        return false;
+      }
+      unsigned head = *m_cq_head;
+      while (head != __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE)) {
+        const __u64 user_data = m_cqes[head & m_cq_mask].user_data;
+        head++;
+        if (user_data == kTimeoutTag || user_data == kCancelTag) {
+          continue;
+        }
+        Port *port = m_ports[user_data >> 1];
+        if (user_data & kWriteTag) {
+          port->write_pending = false;
+        } else {
+          port->reading = false;
+        }
+      }
+      __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+    }
+  }
+
+  void ReadComplete(unsigned int index, int result) {
+    Port *port = m_ports[index];
+    if (result > 0 && m_callback) {
+      m_callback(m_callback_data, index, port->read_buffer, result);
+    }
+    if (result > 0 || result == -EINTR || result == -EAGAIN) {
+      PrepareRead(index);
+      return;
+    }
+    if (result < 0) {
+      cerr << "Read failed: " << strerror(-result) << endl;
+    }
+    // The port has gone away.
+    port->reading = false;
+  }
+
+  void WriteComplete(unsigned int index, int result) {
+    Port *port = m_ports[index];
+    port->write_pending = false;
+    if (result < 0 && result != -EINTR && result != -EAGAIN) {
+      cerr << "writev() failed: " << strerror(-result) << endl;
+      port->writing.clear();
+      return;
+    }
+
+    // Skip over the iovecs that were written completely, then adjust the
+    // first partially written one.
+    size_t written = result > 0 ? result : 0;
+    while (port->iov_offset < port->iov.size() &&
+           written >= port->iov[port->iov_offset].iov_len) {
+      written -= port->iov[port->iov_offset].iov_len;
+      port->iov_offset++;
+    }
+    if (port->iov_offset < port->iov.size()) {
+      struct iovec *iov = &port->iov[port->iov_offset];
+      iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + written;
+      iov->iov_len -= written;
+      PrepareWrite(index);
+      return;
+    }
+    port->writing.clear();
+    if (!port->queued.empty()) {
+      StartWrite(index);
+    }
+  }
+
+  UringPortSet(const UringPortSet&);
+  UringPortSet& operator=(const UringPortSet&);
+};
+#endif
+
+#ifdef HAVE_IO_URING
+void PrintResponse(void *user_data, unsigned int port, const uint8_t *data,
+                   unsigned int size) {
+  const std::vector<Widget> *widgets =
+      static_cast<const std::vector<Widget>*>(user_data);
+  cout << "Got " << size << " bytes from " << (*widgets)[port].path << endl;
+  const string response(reinterpret_cast<const char*>(data), size);
+  cout << response << endl;
+}
+
+/**
+ * Send an echo to every widget once a second, from this thread.
+ */
+int RunUringEcho(UringPortSet *ports, const std::vector<Widget> &widgets) {
+  ports->SetDataCallback(PrintResponse,
+                         const_cast<std::vector<Widget>*>(&widgets));
+  for (unsigned int i = 0; i < widgets.size(); i++) {
+    ports->AddPort(widgets[i].fd);
+  }
+
+  const string request(
+      "this is the request 1234567890 abcdefghijklmnopqrstuvwxyz");
+  while (true) {
+    unsigned int active = 0;
+    for (unsigned int i = 0; i < widgets.size(); i++) {
+      // A port that hasn't finished the last write gets nothing more, so a
+      // stuck one doesn't build up a backlog.
+      if (ports->WritePending(i)) {
+        active++;
+      } else if (ports->Queue(i, ECHO_COMMAND,
+                              reinterpret_cast<const uint8_t*>(
+                                  request.data()),
+                              request.size())) {
+        active++;
+      }
+    }
+    if (!active) {
+      cerr << "All the widgets have gone away" << endl;
+      return -1;
+    }
+    if (!ports->Flush()) {
+      return -1;
+    }
+
+    const int64_t deadline = MonotonicMs() + 1000;
+    int64_t remaining;
+    while ((remaining = deadline - MonotonicMs()) > 0) {
+      if (!ports->Poll(static_cast<int>(remaining))) {
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+#endif
+
+int main(int argc, char *argv[]) {
+  // Usage: serial [--throughput] [port]
+  PortMode mode = LOW_LATENCY_MODE;
+  int arg = 1;
+  if (arg < argc && string(argv[arg]) == "--throughput") {
+    mode = THROUGHPUT_MODE;
+    arg++;
+  }
+
+  string path;
+  int fd = -1;
+  if (arg < argc) {
+    path = argv[arg];
+    fd = open(path.c_str(), O_RDWR | O_NOCTTY);
+    if (fd == -1) {
+      cerr << "Failed to open " << path << " : " << strerror(errno) << endl;
+      return 1;
+    }
+    if (!ConfigurePort(fd, PortOptions(mode))) {
+      close(fd);
+      return 1;
+    }
+  } else {
+    // The cache lasts across attempts, so sysfs is only read again once a
+    // tty has changed.
+    SysfsPortCache cache;
+    std::vector<Widget> widgets;
+    while ((widgets = DiscoverWidgets(&cache, kProbeTimeoutMs)).empty()) {
+      if (cache.UeventFd() < 0) {
+        cerr << "No widgets found" << endl;
+        return 1;
+      }
+      cout << "No widgets found, waiting for one to be plugged in" << endl;
+      if (!cache.WaitForChange(-1)) {
+        return 1;
+      }
+    }
+    for (unsigned int i = 0; i < widgets.size(); i++) {
+      cout << "Found widget at " << widgets[i].path;
+      if (!widgets[i].serial.empty()) {
+        cout << ", serial " << widgets[i].serial;
+      }
+      cout << endl;
+    }
+
+#ifdef HAVE_IO_URING
+    // One thread can drive all the widgets, if the kernel supports it.
+    if (widgets.size() > 1) {
+      UringPortSet ports;
+      if (ports.Init(widgets.size())) {
+        int r = RunUringEcho(&ports, widgets);
+        for (unsigned int i = 0; i < widgets.size(); i++) {
+          close(widgets[i].fd);
+        }
+        return r;
+      }
+    }
+#endif
+
+    for (unsigned int i = 1; i < widgets.size(); i++) {
+      close(widgets[i].fd);
+    }
+    path = widgets[0].path;
+    fd = widgets[0].fd;
+    // Probing and io_uring need low latency mode, so only switch over once
+    // we know this port will be read by the loop below.
+    if (mode != LOW_LATENCY_MODE && !ConfigurePort(fd, PortOptions(mode))) {
+      close(fd);
+      return 1;
+    }
   }
 
+  FrameWriter writer(fd);
   while (true) {
-    // TODO(simon): write the entire message here.
     const string request(
         "this is the request 1234567890 abcdefghijklmnopqrstuvwxyz");
-    int r = write(fd, request.c_str(), request.size());
-    if (r == -1) {
-      cerr << "write() failed: " << strerror(errno) << endl;
+    writer.Queue(ECHO_COMMAND,
+                 reinterpret_cast<const uint8_t*>(request.data()),
+                 request.size());
+    if (!writer.Flush()) {
       return -1;
     }
 
     char buffer[128];
-    r = read(fd, buffer, sizeof(buffer));
+    int r = read(fd, buffer, sizeof(buffer));
     if (r < 0) {
       cerr << "Read failed: " << strerror(errno) << endl;
       break;
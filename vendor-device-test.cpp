@@ -0,0 +1,742 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * vendor-device-test.cpp
+ * Tests for the parts of vendor-device that don't need a widget.
+ */
+
+#define VENDOR_DEVICE_NO_MAIN 1
+#include "vendor-device.cpp"
+
+static unsigned int failures = 0;
+
+#define EXPECT(condition) Expect((condition), #condition, __LINE__)
+
+bool Expect(bool ok, const char *condition, int line) {
+  if (!ok) {
+    cerr << __FILE__ << ":" << line << ": expected " << condition << endl;
+    failures++;
+  }
+  return ok;
+}
+
+/**
+ * Build frames of every size around the packet boundaries, and parse them
+ * back.
+ */
+void TestFrameRoundTrip() {
+  const FrameTermination terminations[] = {
+    PAD_TERMINATION, ZERO_PACKET_TERMINATION};
+  const uint8_t header[] = {0xde, 0xad};
+  std::vector<uint8_t> payload(UsbSender::MAX_FRAME_PAYLOAD);
+  for (unsigned int i = 0; i < payload.size(); i++) {
+    payload[i] = static_cast<uint8_t>(i * 13);
+  }
+  std::vector<uint8_t> frame(TransferPool::BUFFER_SIZE);
+
+  for (unsigned int size = 0; size <= UsbSender::MAX_FRAME_PAYLOAD;
+       size += size < 300 ? 1 : 97) {
+    for (unsigned int checksum = 0; checksum < 2; checksum++) {
+      for (unsigned int t = 0; t < arraysize(terminations); t++) {
+        const unsigned int header_size =
+            size >= arraysize(header) ? arraysize(header) : 0;
+        bool zero_packet;
+        const unsigned int length = UsbSender::BuildFrame(
+            &frame[0], UsbSender::ECHO_COMMAND, header, header_size,
+            &payload[0], size - header_size, checksum, terminations[t],
+            &zero_packet);
+
+        const uint8_t *parsed;
+        unsigned int parsed_size, frame_size;
+        if (!EXPECT(UsbSender::ParseFrame(&frame[0], length,
+                                          UsbSender::ECHO_COMMAND, &parsed,
+                                          &parsed_size, &frame_size))) {
+          continue;
+        }
+        EXPECT(parsed_size == size);
+        EXPECT(memcmp(parsed, header, header_size) == 0);
+        EXPECT(memcmp(parsed + header_size, &payload[0],
+                      size - header_size) == 0);
+        // Anything after the frame is the pad byte.
+        const bool boundary = frame_size % 64 == 0;
+        EXPECT(length == frame_size +
+               (boundary && terminations[t] == PAD_TERMINATION));
+        EXPECT(zero_packet ==
+               (boundary && terminations[t] == ZERO_PACKET_TERMINATION));
+        EXPECT(!UsbSender::ParseFrame(&frame[0], length,
+                                      UsbSender::TX_DMX, &parsed,
+                                      &parsed_size));
+        EXPECT(!UsbSender::ParseFrame(&frame[0], frame_size - 1,
+                                      UsbSender::ECHO_COMMAND, &parsed,
+                                      &parsed_size));
+      }
+    }
+  }
+}
+
+/**
+ * A frame with a checksum catches a corrupt payload, one without doesn't.
+ */
+void TestFrameChecksum() {
+  const uint8_t payload[] = {1, 2, 3, 4, 5, 6, 7, 8};
+  uint8_t frame[64];
+  bool zero_packet;
+  const uint8_t *parsed;
+  unsigned int parsed_size;
+
+  unsigned int length = UsbSender::BuildFrame(
+      frame, UsbSender::TX_DMX, NULL, 0, payload, arraysize(payload), true,
+      PAD_TERMINATION, &zero_packet);
+  EXPECT(length == arraysize(payload) + 10);
+  EXPECT(frame[2] & (UsbSender::CHECKSUM_FLAG >> 8));
+  frame[7] ^= 0x10;
+  EXPECT(!UsbSender::ParseFrame(frame, length, UsbSender::TX_DMX, &parsed,
+                                &parsed_size));
+  frame[7] ^= 0x10;
+  EXPECT(UsbSender::ParseFrame(frame, length, UsbSender::TX_DMX, &parsed,
+                               &parsed_size));
+  // The CRC covers the header too.
+  frame[3]++;
+  EXPECT(!UsbSender::ParseFrame(frame, length, UsbSender::TX_DMX, &parsed,
+                                &parsed_size));
+
+  length = UsbSender::BuildFrame(
+      frame, UsbSender::TX_DMX, NULL, 0, payload, arraysize(payload), false,
+      PAD_TERMINATION, &zero_packet);
+  EXPECT(length == arraysize(payload) + 6);
+  frame[7] ^= 0x10;
+  EXPECT(UsbSender::ParseFrame(frame, length, UsbSender::TX_DMX, &parsed,
+                               &parsed_size));
+}
+
+void TestCrc32c() {
+  const char check[] = "123456789";
+  const uint8_t *data = reinterpret_cast<const uint8_t*>(check);
+  EXPECT(Crc32c(data, 9) == 0xe3069283);
+  // In pieces.
+  EXPECT(Crc32c(data + 4, 5, Crc32c(data, 4)) == 0xe3069283);
+  EXPECT(Crc32c(data, 0) == 0);
+
+  // Each implementation, across the sizes where the interleaved one changes
+  // how it splits the data, and at every alignment.
+  std::vector<uint8_t> buffer(4 * kCrc32cLaneSize + 64);
+  for (unsigned int i = 0; i < buffer.size(); i++) {
+    buffer[i] = static_cast<uint8_t>(i * 31 + (i >> 3));
+  }
+  for (unsigned int offset = 0; offset < 8; offset++) {
+    for (unsigned int size = 0; size + offset <= buffer.size(); size++) {
+      const uint32_t expected =
+          ~Crc32cSoftware(~0u, &buffer[offset], size);
+      EXPECT(Crc32c(&buffer[offset], size) == expected);
+#ifdef HAVE_CRC32C_SSE42
+      if (__builtin_cpu_supports("sse4.2")) {
+        EXPECT(~Crc32cSse42(~0u, &buffer[offset], size) == expected);
+      }
+      if (__builtin_cpu_supports("sse4.2") &&
+          __builtin_cpu_supports("pclmul")) {
+        EXPECT(~Crc32cInterleaved(~0u, &buffer[offset], size) == expected);
+      }
+#endif
+    }
+  }
+}
+
+/**
+ * Append an RX_DMX frame to a transfer.
+ */
+void AppendRxFrame(std::vector<uint8_t> *transfer, uint8_t port,
+                   uint8_t value, bool checksum) {
+  uint8_t payload[6 + 1 + 16];
+  payload[0] = port;
+  payload[1] = 0;
+  UsbSender::WriteLittleEndian(payload + 2, 1000 * port);
+  payload[6] = 0;
+  memset(payload + 7, value, arraysize(payload) - 7);
+  uint8_t frame[64];
+  bool zero_packet;
+  const unsigned int length = UsbSender::BuildFrame(
+      frame, UsbSender::RX_DMX, NULL, 0, payload, arraysize(payload),
+      checksum, PAD_TERMINATION, &zero_packet);
+  transfer->insert(transfer->end(), frame, frame + length);
+}
+
+/**
+ * A corrupt frame is skipped, and decoding picks up again at the next good
+ * one in the same transfer.
+ */
+void TestRxDecodeResync() {
+  const struct timeval arrival = {1, 0};
+  for (unsigned int checksum = 0; checksum < 2; checksum++) {
+    std::vector<uint8_t> transfer;
+    AppendRxFrame(&transfer, 0, 0x11, checksum);
+    const size_t corrupt = transfer.size();
+    AppendRxFrame(&transfer, 1, 0x22, checksum);
+    AppendRxFrame(&transfer, 2, 0x33, checksum);
+    // Without a checksum, a bad length is all that can be caught.
+    transfer[corrupt + 3] += checksum ? 0 : 7;
+    transfer[corrupt + 12] ^= checksum ? 0x40 : 0;
+
+    DmxInput input;
+    const unsigned int malformed = DmxReceiver::Decode(
+        &input, &transfer[0], transfer.size(), arrival);
+    EXPECT(malformed == 1);
+    EXPECT(input.Frames() == 2);
+    DmxSnapshot snapshot;
+    EXPECT(input.Latest(0, &snapshot) && snapshot.data[1] == 0x11);
+    EXPECT(!input.Latest(1, &snapshot));
+    EXPECT(input.Latest(2, &snapshot) && snapshot.data[1] == 0x33 &&
+           snapshot.device_time == 2000 && snapshot.size == 17);
+  }
+
+  // Nothing but noise.
+  const uint8_t noise[] = {0x5a, 0x01, 0x5a, 0xff, 0xa5};
+  DmxInput input;
+  EXPECT(DmxReceiver::Decode(&input, noise, arraysize(noise), arrival) == 1);
+  EXPECT(input.Frames() == 0);
+}
+
+/**
+ * A request sent without a callback that expires while it's queued still
+ * wakes up Wait().
+ */
+void TestExpiredRequestWakesWait() {
+  // Wake() needs a context to interrupt.
+  libusb_context *context = NULL;
+  if (libusb_init(&context)) {
+    cout << "Skipping TestExpiredRequestWakesWait, libusb_init() failed"
+         << endl;
+    return;
+  }
+  {
+    LibUsbThread thread(context);
+    TransferPool pool(2);
+    // There's no device, and nothing here should need one.
+    UsbSender sender(&thread, &pool, NULL);
+    sender.SetVerbose(false);
+
+    const uint8_t data[] = {1, 2, 3};
+    EXPECT(sender.SendRequest(UsbSender::ECHO_COMMAND, data,
+                              arraysize(data), 0, NULL, NULL));
+    // Run what the libusb thread would.
+    ProcessCommandsHandler(&sender);
+
+    uint8_t endpoint;
+    libusb_transfer_status status;
+    if (EXPECT(sender.GetFailure(&endpoint, &status))) {
+      EXPECT(status == LIBUSB_TRANSFER_TIMED_OUT);
+      // This would block forever if the failure hadn't been reported.
+      sender.Wait();
+    }
+  }
+  libusb_exit(context);
+}
+
+/**
+ * Emulates the RDM responders on a widget's ports.
+ *
+ * It's installed as an RdmController's request hook, and Run() answers the
+ * requests, and the requests those answers lead to, the way the widget
+ * would. Responders that collide in a DISC_UNIQUE_BRANCH send a garbled
+ * response, and one can be set to never mute.
+ */
+class RdmResponders {
+ public:
+  // A manufacturer specific PID whose GET response takes two ACK_OVERFLOWs.
+  static const uint16_t kOverflowPid = 0x8001;
+
+  RdmResponders() : m_requests(0) {
+    pthread_mutex_init(&m_mutex, NULL);
+  }
+
+  ~RdmResponders() {
+    pthread_mutex_destroy(&m_mutex);
+  }
+
+  void Add(uint8_t port, RdmUid uid, bool mutes = true) {
+    Responder responder = {port, uid, mutes, false};
+    m_responders.push_back(responder);
+  }
+
+  static bool Hook(void *hook_data, const uint8_t *message,
+                   unsigned int size, void *request) {
+    RdmResponders *responders = static_cast<RdmResponders*>(hook_data);
+    Pending pending = {string(reinterpret_cast<const char*>(message), size),
+                       request};
+    pthread_mutex_lock(&responders->m_mutex);
+    responders->m_pending.push_back(pending);
+    responders->m_requests++;
+    pthread_mutex_unlock(&responders->m_mutex);
+    return true;
+  }
+
+  /**
+   * Answer requests until there aren't any left.
+   */
+  void Run() {
+    while (true) {
+      pthread_mutex_lock(&m_mutex);
+      if (m_pending.empty()) {
+        pthread_mutex_unlock(&m_mutex);
+        return;
+      }
+      const Pending pending = m_pending.front();
+      m_pending.erase(m_pending.begin());
+      pthread_mutex_unlock(&m_mutex);
+      Answer(pending);
+    }
+  }
+
+  unsigned int Requests() {
+    pthread_mutex_lock(&m_mutex);
+    unsigned int requests = m_requests;
+    pthread_mutex_unlock(&m_mutex);
+    return requests;
+  }
+
+  // The parameter data of each kOverflowPid request.
+  const std::vector<string>& OverflowRequests() const {
+    return m_overflow_requests;
+  }
+
+ private:
+  enum {
+    DISCOVERY_COMMAND = 0x10,
+    GET_COMMAND = 0x20,
+    SET_COMMAND = 0x30
+  };
+
+  struct Responder {
+    uint8_t port;
+    RdmUid uid;
+    bool mutes;
+    bool muted;
+  };
+
+  struct Pending {
+    string message;
+    void *request;
+  };
+
+  pthread_mutex_t m_mutex;
+  std::vector<Pending> m_pending;  // GUARDED_BY(m_mutex)
+  unsigned int m_requests;  // GUARDED_BY(m_mutex)
+  std::vector<Responder> m_responders;
+  std::vector<string> m_overflow_requests;
+
+  static RdmUid ReadUid(const uint8_t *data) {
+    RdmUid uid = 0;
+    for (unsigned int i = 0; i < 6; i++) {
+      uid = (uid << 8) | data[i];
+    }
+    return uid;
+  }
+
+  static void WriteUid(uint8_t *data, RdmUid uid) {
+    for (unsigned int i = 0; i < 6; i++) {
+      data[i] = static_cast<uint8_t>(uid >> (8 * (5 - i)));
+    }
+  }
+
+  /**
+   * The response to a DISC_UNIQUE_BRANCH, which is sent without a header.
+   */
+  static string EncodeDiscoveryResponse(RdmUid uid) {
+    uint8_t response[7 + 1 + 16];
+    memset(response, 0xfe, 7);
+    response[7] = 0xaa;
+    uint8_t data[6];
+    WriteUid(data, uid);
+    uint16_t checksum = 0;
+    for (unsigned int i = 0; i < 6; i++) {
+      response[8 + 2 * i] = data[i] | 0xaa;
+      response[9 + 2 * i] = data[i] | 0x55;
+      checksum += response[8 + 2 * i] + response[9 + 2 * i];
+    }
+    response[20] = (checksum >> 8) | 0xaa;
+    response[21] = (checksum >> 8) | 0x55;
+    response[22] = (checksum & 0xff) | 0xaa;
+    response[23] = (checksum & 0xff) | 0x55;
+    return string(reinterpret_cast<const char*>(response), sizeof(response));
+  }
+
+  /**
+   * Build a response to a request, with its checksum.
+   */
+  static string BuildResponse(const uint8_t *request, uint8_t response_type,
+                              const string &data) {
+    uint8_t response[24 + 231 + 2];
+    memcpy(response, request, 24);
+    response[2] = static_cast<uint8_t>(24 + data.size());
+    memcpy(response + 3, request + 9, 6);
+    memcpy(response + 9, request + 3, 6);
+    response[16] = response_type;
+    response[17] = 0;
+    response[20] = request[20] + 1;
+    response[23] = static_cast<uint8_t>(data.size());
+    memcpy(response + 24, data.data(), data.size());
+    uint16_t checksum = 0;
+    for (unsigned int i = 0; i < 24 + data.size(); i++) {
+      checksum += response[i];
+    }
+    response[24 + data.size()] = static_cast<uint8_t>(checksum >> 8);
+    response[25 + data.size()] = static_cast<uint8_t>(checksum & 0xff);
+    return string(reinterpret_cast<const char*>(response),
+                  26 + data.size());
+  }
+
+  /**
+   * Work out what the responders send back, like the widget would.
+   * @returns false if nothing responds.
+   */
+  bool Respond(uint8_t port, const uint8_t *request, string *response) {
+    const RdmUid destination = ReadUid(request + 3);
+    const uint8_t command_class = request[20];
+    const uint16_t pid = (request[21] << 8) | request[22];
+    const uint8_t *data = request + 24;
+    const string parameter(reinterpret_cast<const char*>(data), request[23]);
+
+    if (command_class == DISCOVERY_COMMAND &&
+        pid == RdmController::DISC_UNIQUE_BRANCH) {
+      const RdmUid lower = ReadUid(data);
+      const RdmUid upper = ReadUid(data + 6);
+      for (unsigned int i = 0; i < m_responders.size(); i++) {
+        const Responder &responder = m_responders[i];
+        if (responder.port != port || responder.muted ||
+            responder.uid < lower || responder.uid > upper) {
+          continue;
+        }
+        const string encoded = EncodeDiscoveryResponse(responder.uid);
+        if (response->empty()) {
+          *response = encoded;
+        } else {
+          // Collisions garble the response.
+          for (unsigned int j = 0; j < encoded.size(); j++) {
+            (*response)[j] |= encoded[j];
+          }
+        }
+      }
+      return !response->empty();
+    }
+
+    for (unsigned int i = 0; i < m_responders.size(); i++) {
+      Responder *responder = &m_responders[i];
+      if (responder->port != port ||
+          (destination != RdmController::BROADCAST_UID &&
+           destination != responder->uid)) {
+        continue;
+      }
+      if (command_class == DISCOVERY_COMMAND) {
+        if (pid == RdmController::DISC_UN_MUTE) {
+          responder->muted = false;
+        } else if (pid == RdmController::DISC_MUTE && responder->mutes) {
+          responder->muted = true;
+        } else {
+          continue;
+        }
+        if (destination != RdmController::BROADCAST_UID) {
+          *response = BuildResponse(request, 0x00, string(2, '\0'));
+        }
+      } else if (pid == kOverflowPid) {
+        m_overflow_requests.push_back(parameter);
+        const unsigned int piece = m_overflow_requests.size() - 1;
+        const char *pieces[] = {"over", "flow", "ed"};
+        *response = BuildResponse(request, piece < 2 ? 0x03 : 0x00,
+                                  pieces[std::min(piece, 2u)]);
+      } else {
+        // Echo the parameter data back, with the PID so GETs differ.
+        *response = BuildResponse(request, 0x00,
+                                  parameter + static_cast<char>(pid));
+      }
+    }
+    return !response->empty();
+  }
+
+  void Answer(const Pending &pending) {
+    const uint8_t *message =
+        reinterpret_cast<const uint8_t*>(pending.message.data());
+    const uint8_t port = message[0];
+    string response;
+    const bool responded = Respond(port, message + 1, &response);
+
+    string payload;
+    payload.push_back(static_cast<char>(port));
+    payload.push_back(responded ? 0 : 1);
+    payload += response;
+    uint8_t frame[TransferPool::BUFFER_SIZE];
+    bool zero_packet;
+    RequestResult result;
+    result.status = REQUEST_OK;
+    result.data = frame;
+    result.size = UsbSender::BuildFrame(
+        frame, UsbSender::RDM_COMMAND, NULL, 0,
+        reinterpret_cast<const uint8_t*>(payload.data()), payload.size(),
+        false, PAD_TERMINATION, &zero_packet);
+    timerclear(&result.latency);
+    RdmRequestCompleteHandler(pending.request, result);
+  }
+
+  RdmResponders(const RdmResponders&);
+  RdmResponders& operator=(const RdmResponders&);
+};
+
+/**
+ * Discovery finds every responder, however close together their UIDs are,
+ * and drops one that won't mute.
+ */
+void TestRdmDiscovery() {
+  RdmResponders responders;
+  std::vector<RdmUid> expected[kMaxDmxPorts];
+  for (unsigned int i = 0; i < 20; i++) {
+    // Neighbours, which only differ in the last bit, and far apart UIDs.
+    const RdmUid uid = i < 10 ? 0x7a7000000100ull + i :
+        (static_cast<RdmUid>(i) << 40) | (i * 0x1111);
+    responders.Add(0, uid);
+    expected[0].push_back(uid);
+  }
+  responders.Add(1, 0x000100000001ull);
+  expected[1].push_back(0x000100000001ull);
+  responders.Add(3, 0x4d4400000002ull);
+  responders.Add(3, 0x4d4400000003ull, false);
+  expected[3].push_back(0x4d4400000002ull);
+
+  RdmController rdm(NULL);
+  rdm.SetRequestHook(RdmResponders::Hook, &responders);
+  EXPECT(rdm.Discover(0xf));
+  // Only one discovery at a time.
+  EXPECT(!rdm.Discover(0x1));
+  responders.Run();
+  rdm.WaitForDiscovery();
+
+  for (unsigned int port = 0; port < kMaxDmxPorts; port++) {
+    bool complete = false;
+    std::vector<RdmUid> found = rdm.Responders(port, &complete);
+    std::sort(found.begin(), found.end());
+    std::sort(expected[port].begin(), expected[port].end());
+    EXPECT(complete);
+    EXPECT(found == expected[port]);
+  }
+  EXPECT(rdm.DiscoveryRequests() == responders.Requests());
+}
+
+struct RdmResponse {
+  RdmResponse() : calls(0), status(RDM_FAILED) {}
+
+  unsigned int calls;
+  RdmStatus status;
+  string data;
+};
+
+void RdmResponseHandler(void *user_data, const RdmResult &result) {
+  RdmResponse *response = static_cast<RdmResponse*>(user_data);
+  response->calls++;
+  response->status = result.status;
+  response->data.assign(reinterpret_cast<const char*>(result.data),
+                        result.size);
+}
+
+/**
+ * ACK_OVERFLOW responses are put back together, and each follow up request
+ * carries the same parameter data. GETs are cached until there's a SET.
+ */
+void TestRdmGet() {
+  static const RdmUid kUid = 0x7a7012345678ull;
+  RdmResponders responders;
+  responders.Add(2, kUid);
+  RdmController rdm(NULL);
+  rdm.SetRequestHook(RdmResponders::Hook, &responders);
+
+  const uint8_t parameter[] = {0xab, 0xcd};
+  RdmResponse response;
+  EXPECT(rdm.Get(2, kUid, 0, RdmResponders::kOverflowPid, parameter,
+                 arraysize(parameter), RdmResponseHandler, &response));
+  responders.Run();
+  EXPECT(response.calls == 1);
+  EXPECT(response.status == RDM_ACK);
+  EXPECT(response.data == "overflowed");
+  const string sent(reinterpret_cast<const char*>(parameter),
+                    arraysize(parameter));
+  EXPECT(responders.OverflowRequests().size() == 3);
+  for (unsigned int i = 0; i < responders.OverflowRequests().size(); i++) {
+    EXPECT(responders.OverflowRequests()[i] == sent);
+  }
+
+  // Nothing answers on another port.
+  response = RdmResponse();
+  EXPECT(rdm.Get(1, kUid, 0, RdmController::DEVICE_INFO, NULL, 0,
+                 RdmResponseHandler, &response));
+  responders.Run();
+  EXPECT(response.calls == 1 && response.status == RDM_NO_RESPONSE);
+
+  string cached;
+  EXPECT(!rdm.Lookup(kUid, 0, RdmController::DEVICE_INFO, &cached));
+  response = RdmResponse();
+  EXPECT(rdm.Get(2, kUid, 0, RdmController::DEVICE_INFO, NULL, 0,
+                 RdmResponseHandler, &response));
+  responders.Run();
+  EXPECT(response.status == RDM_ACK);
+  EXPECT(rdm.Lookup(kUid, 0, RdmController::DEVICE_INFO, &cached) &&
+         cached == response.data);
+
+  const uint8_t address[] = {0, 1};
+  response = RdmResponse();
+  EXPECT(rdm.Set(2, kUid, 0, RdmController::DMX_START_ADDRESS, address,
+                 arraysize(address), RdmResponseHandler, &response));
+  responders.Run();
+  EXPECT(response.status == RDM_ACK);
+  EXPECT(!rdm.Lookup(kUid, 0, RdmController::DEVICE_INFO, &cached));
+}
+
+void *RunResponders(void *d) {
+  static_cast<RdmResponders*>(d)->Run();
+  return NULL;
+}
+
+/**
+ * Destroying the controller while discovery is running waits for it to stop.
+ */
+void TestRdmDestroyDuringDiscovery() {
+  RdmResponders responders;
+  for (unsigned int i = 0; i < 8; i++) {
+    responders.Add(0, 0x7a7000000000ull + i * 3);
+  }
+  RdmController *rdm = new RdmController(NULL);
+  rdm->SetRequestHook(RdmResponders::Hook, &responders);
+  EXPECT(rdm->Discover(0x1));
+  // Stop before the UN_MUTE is answered, so the outcome doesn't depend on
+  // whether the answer or the delete runs first.
+  rdm->Stop();
+  EXPECT(responders.Requests() == 1);
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, RunResponders, &responders);
+  delete rdm;
+  pthread_join(thread, NULL);
+  // Discovery stops once the UN_MUTE it was waiting on is answered.
+  EXPECT(responders.Requests() == 1);
+}
+
+/**
+ * Stands in for a WidgetRegistry, and remembers what DmxPlayer sent.
+ */
+class PlaybackSink {
+ public:
+  struct Frame {
+    uint16_t universe;
+    string data;
+  };
+
+  PlaybackSink() : flushes(0) {}
+
+  void SendDmx(uint16_t universe, const uint8_t *data, unsigned int size) {
+    Frame frame = {universe,
+                   string(reinterpret_cast<const char*>(data), size)};
+    frames.push_back(frame);
+  }
+
+  unsigned int Flush() {
+    flushes++;
+    return 1;
+  }
+
+  std::vector<Frame> frames;
+  unsigned int flushes;
+};
+
+/**
+ * Record frames across several segments, and play them back.
+ */
+void TestRecordAndPlay() {
+  static const unsigned int kFrames = 10;
+  char directory[] = "/tmp/vendor-device-test.XXXXXX";
+  if (!EXPECT(mkdtemp(directory))) {
+    return;
+  }
+  const string prefix = string(directory) + "/show";
+
+  std::vector<PlaybackSink::Frame> recorded;
+  {
+    DmxRecorder recorder(prefix, 4);
+    EXPECT(recorder.Start());
+    for (unsigned int i = 0; i < kFrames; i++) {
+      PlaybackSink::Frame frame = {static_cast<uint16_t>(i % 3),
+                                   string(1 + i * 50, static_cast<char>(i))};
+      EXPECT(recorder.Record(
+          frame.universe, reinterpret_cast<const uint8_t*>(frame.data.data()),
+          frame.data.size()));
+      recorded.push_back(frame);
+      // Give the recorder thread time to get the next segment ready, and
+      // keep the frames out of each other's Flush().
+      usleep(2 * kPlaybackGroupWindow / 1000);
+    }
+    recorder.Stop();
+    EXPECT(recorder.Recorded() == kFrames);
+    EXPECT(recorder.Dropped() == 0);
+  }
+
+  {
+    DmxPlayer player(prefix);
+    EXPECT(player.Open());
+    const uint64_t duration = player.Duration();
+    EXPECT(duration >= (kFrames - 1) * 2 * kPlaybackGroupWindow);
+
+    PlaybackSink sink;
+    EXPECT(player.Play(&sink) == kFrames);
+    EXPECT(sink.flushes == kFrames);
+    EXPECT(sink.frames.size() == kFrames);
+    for (unsigned int i = 0; i < sink.frames.size(); i++) {
+      EXPECT(sink.frames[i].universe == recorded[i].universe);
+      EXPECT(sink.frames[i].data == recorded[i].data);
+    }
+
+    // Halfway through lands in a later segment.
+    EXPECT(player.Seek(duration / 2));
+    PlaybackSink second_half;
+    const uint64_t sent = player.Play(&second_half);
+    EXPECT(sent > 0 && sent < kFrames);
+    if (sent) {
+      EXPECT(second_half.frames.back().data == recorded.back().data);
+    }
+
+    EXPECT(player.Seek(duration + 1));
+    PlaybackSink past_end;
+    EXPECT(player.Play(&past_end) == 0);
+  }
+
+  for (unsigned int i = 0; i < kFrames; i++) {
+    std::ostringstream path;
+    path << prefix << "." << std::setw(4) << std::setfill('0') << i
+         << ".dmxlog";
+    unlink(path.str().c_str());
+  }
+  EXPECT(rmdir(directory) == 0);
+}
+
+int main() {
+  TestFrameRoundTrip();
+  TestFrameChecksum();
+  TestCrc32c();
+  TestRxDecodeResync();
+  TestExpiredRequestWakesWait();
+  TestRdmDiscovery();
+  TestRdmGet();
+  TestRdmDestroyDuringDiscovery();
+  TestRecordAndPlay();
+  if (failures) {
+    cerr << failures << " failures" << endl;
+    return 1;
+  }
+  cout << "All tests passed" << endl;
+  return 0;
+}
@@ -19,15 +19,42 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <libusb.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <iomanip>
-#include <queue>
+#include <map>
+#include <sstream>
 #include <string>
+#include <vector>
+
+#ifdef __cpp_impl_coroutine
+#include <coroutine>
+#include <exception>
+#endif
+
+// The SSE4.2 crc32 instruction computes CRC-32C, and PCLMUL combines CRCs.
+// The intrinsics can be used in functions built for those, whatever the rest
+// of the file targets.
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#define HAVE_CRC32C_SSE42 1
+#endif
 
 using std::cerr;
 using std::cout;
@@ -36,11 +63,81 @@ using std::ostream;
 using std::endl;
 using std::string;
 
+// libusb_interrupt_event_handler() was added in libusb 1.0.21.
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+#define HAVE_LIBUSB_INTERRUPT_EVENT_HANDLER 1
+#endif
+
 static const uint16_t kProductId = 0x0053;
 static const uint16_t kVendorId = 0x04d8;
 static const uint8_t kInEndpoint  = 0x81;
 static const uint8_t kOutEndpoint = 0x01;
+// The widget sends the DMX it receives on this endpoint.
+static const uint8_t kRxEndpoint = 0x82;
 static const unsigned int kTimeout = 1000;
+// How long to wait for a device to come back after it disappears.
+static const unsigned int kReconnectTimeout = 5000;
+// How often to re-enumerate while waiting, if hotplug isn't supported.
+static const unsigned int kRescanInterval = 50;
+// The number of consecutive transfer failures before we reset the device.
+static const unsigned int kResetThreshold = 3;
+// The number of concurrent echo requests to make.
+static const unsigned int kEchoTasks = 100;
+// How many times to check for a completion before sleeping.
+static const unsigned int kCompletionSpins = 1000;
+// The number of requests each sender can have queued, a power of two.
+static const unsigned int kCommandQueueSize = 128;
+// The most widgets we'll attach to, this sizes the transfer pool.
+static const unsigned int kMaxWidgets = 16;
+// The number of requests per payload size when benchmarking.
+static const unsigned int kBenchmarkRequests = 200;
+// The number of frames each way of encoding builds, when benchmarking.
+static const unsigned int kEncodeBenchmarkFrames = 1000000;
+// The most chunks of a stream to have in flight at once.
+static const unsigned int kStreamWindow = 4;
+// The largest stream response we'll reassemble.
+static const unsigned int kMaxStreamResponse = 1 << 20;
+// The number of slots in a DMX universe.
+static const unsigned int kDmxUniverseSize = 512;
+// The most DMX ports on a widget, this sizes the TX_DMX_MULTI frame.
+static const unsigned int kMaxDmxPorts = 4;
+// The number of ticks of DMX to send in the example.
+static const unsigned int kDmxTicks = 5;
+// The time between DMX ticks, in us.
+static const unsigned int kDmxTickInterval = 25000;
+// The ports of each widget the example outputs on, more than one so the
+// ports are sent together with TX_DMX_MULTI.
+static const unsigned int kExamplePorts = 2;
+// The number of transfers kept queued on the RX endpoint.
+static const unsigned int kRxTransfers = 4;
+// The RX transfers in a row that can fail before the receiver gives up.
+static const unsigned int kMaxRxFailures = 8;
+// The number of received frames kept for readers, a power of two.
+static const unsigned int kRxRingSize = 256;
+// How long to listen for DMX in the example, in us.
+static const unsigned int kRxListenTime = 500000;
+// The most RDM requests outstanding at once, across all ports.
+static const unsigned int kRdmTransactions = 64;
+// Our RDM UID, from the manufacturer IDs reserved for prototypes.
+static const uint64_t kRdmControllerUid = 0x7ff000000001ull;
+// The number of frames in each file the recorder writes, about 34MB.
+static const unsigned int kRecorderSegmentRecords = 1 << 16;
+// How far ahead of the playhead to prefetch a recording, in bytes.
+static const size_t kPlaybackPrefetch = 1 << 20;
+// Recorded frames this close together, in ns, are played in one Flush().
+static const uint64_t kPlaybackGroupWindow = 1000000;
+// How long before a frame is due to stop sleeping and spin, in ns.
+static const uint64_t kPlaybackSpin = 200000;
+// The longest playback sleeps before checking if it's been stopped, in ns.
+static const uint64_t kPlaybackMaxSleep = 100000000;
+// How often, in us, the libusb thread checks for new requests if it can't be
+// woken up.
+static const unsigned int kCommandPollInterval = 1000;
+// CRC-32C (Castagnoli), bit reversed, for frame checksums.
+static const uint32_t kCrc32cPolynomial = 0x82f63b78;
+// The bytes in each of the three lanes of the interleaved CRC-32C, a
+// multiple of 8. Three lanes hold most of a universe.
+static const unsigned int kCrc32cLaneSize = 168;
 
 template <typename T, size_t N>
   char (&ArraySizeHelper(T (&array)[N]))[N];
@@ -61,19 +158,69 @@ void *StartThread(void *d);
 
 class LibUsbThread {
  public:
+  // Called from the libusb thread on each pass through the event loop.
+  typedef void (*WorkCallback)(void *user_data);
+
   explicit LibUsbThread(libusb_context *context)
       : m_context(context),
         m_thread_id(),
         m_terminate(false),
-        m_devices(0) {
+        m_devices(0),
+        m_wake_pending(false) {
     pthread_mutex_init(&m_mutex, NULL);
+    pthread_mutex_init(&m_work_mutex, NULL);
   }
 
   ~LibUsbThread() {
     cout << m_devices << " devices remain in use" << endl;
+    pthread_mutex_destroy(&m_work_mutex);
     pthread_mutex_destroy(&m_mutex);
   }
 
+  /**
+   * Run a callback on the libusb thread each time it handles events, and
+   * after each call to Wake().
+   */
+  void AddWorkHandler(WorkCallback callback, void *user_data) {
+    WorkHandler handler = {callback, user_data};
+    pthread_mutex_lock(&m_work_mutex);
+    m_work_handlers.push_back(handler);
+    pthread_mutex_unlock(&m_work_mutex);
+  }
+
+  /**
+   * Remove a work handler. Once this returns the callback isn't running and
+   * won't be run again. Must not be called from the libusb thread.
+   */
+  void RemoveWorkHandler(WorkCallback callback, void *user_data) {
+    pthread_mutex_lock(&m_work_mutex);
+    for (std::vector<WorkHandler>::iterator iter = m_work_handlers.begin();
+         iter != m_work_handlers.end(); ++iter) {
+      if (iter->callback == callback && iter->user_data == user_data) {
+        m_work_handlers.erase(iter);
+        break;
+      }
+    }
+    pthread_mutex_unlock(&m_work_mutex);
+  }
+
+  /**
+   * Have the libusb thread run the work handlers soon. Calls made before the
+   * thread gets around to it are coalesced into a single wakeup.
+   */
+  void Wake() {
+    if (m_wake_pending.exchange(true)) {
+      return;
+    }
+#ifdef HAVE_LIBUSB_INTERRUPT_EVENT_HANDLER
+    // The libusb thread runs the handlers anyway once the callback it's in
+    // returns.
+    if (!pthread_equal(pthread_self(), m_thread_id)) {
+      libusb_interrupt_event_handler(m_context);
+    }
+#endif
+  }
+
   int OpenDevice(libusb_device *dev, libusb_device_handle **handle) {
     int r = libusb_open(dev, handle);
     if (r == 0) {
@@ -93,16 +240,21 @@ class LibUsbThread {
   void CloseDevice(libusb_device_handle *handle) {
     cout << "Closing device " << handle << endl;
 
-    if (m_devices > 0) {
+    // Only stop the thread once the last device is closed. libusb_close()
+    // wakes up libusb_handle_events() so the thread sees the flag.
+    bool last_device = m_devices == 1;
+    if (last_device) {
       pthread_mutex_lock(&m_mutex);
       m_terminate = true;
       pthread_mutex_unlock(&m_mutex);
     }
     libusb_close(handle);
     m_devices--;
-    if (m_devices == 0) {
+    if (last_device) {
       cout << "Waiting for libusb thread..." << endl;
       pthread_join(m_thread_id, NULL);
+      // The thread is restarted if another device is opened.
+      m_terminate = false;
     }
   }
 
@@ -110,240 +262,5488 @@ class LibUsbThread {
     while (true) {
       pthread_mutex_lock(&m_mutex);
       if (m_terminate) {
+        pthread_mutex_unlock(&m_mutex);
         return NULL;
       }
       pthread_mutex_unlock(&m_mutex);
+#ifdef HAVE_LIBUSB_INTERRUPT_EVENT_HANDLER
       libusb_handle_events(m_context);
+#else
+      struct timeval tv = {0, kCommandPollInterval};
+      libusb_handle_events_timeout(m_context, &tv);
+#endif
+      RunWorkHandlers();
     }
   }
 
  private:
+  struct WorkHandler {
+    WorkCallback callback;
+    void *user_data;
+  };
+
   libusb_context *m_context;
   pthread_t m_thread_id;
   pthread_mutex_t m_mutex;
   bool m_terminate;  // GUARDED_BY(m_mutex);
   unsigned int m_devices;
+  // Held while the handlers run, so they can be removed safely.
+  pthread_mutex_t m_work_mutex;
+  std::vector<WorkHandler> m_work_handlers;  // GUARDED_BY(m_work_mutex)
+  std::atomic<bool> m_wake_pending;
+
+  void RunWorkHandlers() {
+    // Clear this first, so a Wake() from now on means another pass.
+    m_wake_pending = false;
+    pthread_mutex_lock(&m_work_mutex);
+    for (unsigned int i = 0; i < m_work_handlers.size(); i++) {
+      m_work_handlers[i].callback(m_work_handlers[i].user_data);
+    }
+    pthread_mutex_unlock(&m_work_mutex);
+  }
 };
 
 
+/**
+ * A fixed number of libusb transfers, each with its own buffer.
+ *
+ * Everything is allocated up front and kept on an intrusive free list, so
+ * attaching, detaching and reattaching widgets doesn't allocate, and memory
+ * use doesn't depend on how many times a widget reconnects.
+ */
+class TransferPool {
+ public:
+  // Should be a multiple of the endpoint packet size to avoid libusb overflows.
+  // This holds a TX_DMX_MULTI frame for kMaxDmxPorts universes.
+  enum {
+    BUFFER_SIZE = 4096
+  };
+
+  struct Entry {
+    libusb_transfer *transfer;
+    uint8_t buffer[BUFFER_SIZE];
+
+   private:
+    Entry *next;
+
+    friend class TransferPool;
+  };
+
+  explicit TransferPool(unsigned int size)
+      : m_entries(new Entry[size]),
+        m_size(size),
+        m_free(NULL),
+        m_available(0) {
+    pthread_mutex_init(&m_mutex, NULL);
+    for (unsigned int i = 0; i < size; i++) {
+      m_entries[i].transfer = libusb_alloc_transfer(0);
+      if (m_entries[i].transfer) {
+        m_entries[i].next = m_free;
+        m_free = &m_entries[i];
+        m_available++;
+      }
+    }
+  }
+
+  ~TransferPool() {
+    if (m_available != m_size) {
+      cerr << m_size - m_available << " transfers still in use" << endl;
+    }
+    for (unsigned int i = 0; i < m_size; i++) {
+      if (m_entries[i].transfer) {
+        libusb_free_transfer(m_entries[i].transfer);
+      }
+    }
+    delete[] m_entries;
+    pthread_mutex_destroy(&m_mutex);
+  }
+
+  /**
+   * @returns an unused entry, or NULL if they're all in use.
+   */
+  Entry *Acquire() {
+    pthread_mutex_lock(&m_mutex);
+    Entry *entry = m_free;
+    if (entry) {
+      m_free = entry->next;
+      entry->next = NULL;
+      m_available--;
+    }
+    pthread_mutex_unlock(&m_mutex);
+    return entry;
+  }
+
+  /**
+   * Return an entry, its transfer must not be in flight.
+   */
+  void Release(Entry *entry) {
+    if (!entry) {
+      return;
+    }
+    pthread_mutex_lock(&m_mutex);
+    entry->next = m_free;
+    m_free = entry;
+    m_available++;
+    pthread_mutex_unlock(&m_mutex);
+  }
+
+  unsigned int Available() {
+    pthread_mutex_lock(&m_mutex);
+    unsigned int available = m_available;
+    pthread_mutex_unlock(&m_mutex);
+    return available;
+  }
+
+ private:
+  Entry *m_entries;
+  const unsigned int m_size;
+  pthread_mutex_t m_mutex;
+  Entry *m_free;  // GUARDED_BY(m_mutex)
+  unsigned int m_available;  // GUARDED_BY(m_mutex)
+
+  TransferPool(const TransferPool&);
+  TransferPool& operator=(const TransferPool&);
+};
+
 void InTransferCompleteHandler(struct libusb_transfer *transfer);
 void OutTransferCompleteHandler(struct libusb_transfer *transfer);
+void StreamInCompleteHandler(struct libusb_transfer *transfer);
+void StreamOutCompleteHandler(struct libusb_transfer *transfer);
+void ProcessCommandsHandler(void *user_data);
+
+/**
+ * The outcome of a request.
+ */
+enum RequestStatus {
+  REQUEST_OK,
+  REQUEST_TIMED_OUT,
+  REQUEST_FAILED,
+  REQUEST_CANCELLED,
+  REQUEST_DEVICE_LOST
+};
+
+const char *RequestStatusName(RequestStatus status) {
+  switch (status) {
+    case REQUEST_OK:
+      return "ok";
+    case REQUEST_TIMED_OUT:
+      return "timed out";
+    case REQUEST_FAILED:
+      return "failed";
+    case REQUEST_CANCELLED:
+      return "cancelled";
+    case REQUEST_DEVICE_LOST:
+      return "device lost";
+  }
+  return "unknown";
+}
+
+/**
+ * The libusb_error_name() of a transfer status, which isn't a libusb_error.
+ */
+const char *TransferStatusName(libusb_transfer_status status) {
+  switch (status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+      return "LIBUSB_TRANSFER_COMPLETED";
+    case LIBUSB_TRANSFER_ERROR:
+      return "LIBUSB_TRANSFER_ERROR";
+    case LIBUSB_TRANSFER_TIMED_OUT:
+      return "LIBUSB_TRANSFER_TIMED_OUT";
+    case LIBUSB_TRANSFER_CANCELLED:
+      return "LIBUSB_TRANSFER_CANCELLED";
+    case LIBUSB_TRANSFER_STALL:
+      return "LIBUSB_TRANSFER_STALL";
+    case LIBUSB_TRANSFER_NO_DEVICE:
+      return "LIBUSB_TRANSFER_NO_DEVICE";
+    case LIBUSB_TRANSFER_OVERFLOW:
+      return "LIBUSB_TRANSFER_OVERFLOW";
+  }
+  return "**UNKNOWN**";
+}
+
+RequestStatus StatusFromTransfer(libusb_transfer_status status) {
+  switch (status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+      return REQUEST_OK;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+      return REQUEST_TIMED_OUT;
+    case LIBUSB_TRANSFER_CANCELLED:
+      return REQUEST_CANCELLED;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+      return REQUEST_DEVICE_LOST;
+    default:
+      return REQUEST_FAILED;
+  }
+}
+
+/**
+ * Passed to a ResponseCallback when a request completes.
+ */
+struct RequestResult {
+  RequestStatus status;
+  // The response, only valid for the duration of the callback.
+  const uint8_t *data;
+  unsigned int size;
+  // From when the request was made, including any time spent queued.
+  struct timeval latency;
+};
+
+/**
+ * How the end of a frame is marked, when the frame is a multiple of the
+ * packet size and so doesn't end in a short packet.
+ */
+enum FrameTermination {
+  // Append a zero byte, which the widget ignores.
+  PAD_TERMINATION,
+  // Have libusb send a zero length packet.
+  ZERO_PACKET_TERMINATION
+};
+
+const char *FrameTerminationName(FrameTermination termination) {
+  return termination == PAD_TERMINATION ? "pad byte" : "zero length packet";
+}
+
+/**
+ * The lookup table for computing CRC-32C a byte at a time.
+ */
+class Crc32cTable {
+ public:
+  Crc32cTable() {
+    for (unsigned int i = 0; i < 256; i++) {
+      uint32_t crc = i;
+      for (unsigned int bit = 0; bit < 8; bit++) {
+        crc = (crc >> 1) ^ (crc & 1 ? kCrc32cPolynomial : 0);
+      }
+      m_table[i] = crc;
+    }
+  }
+
+  uint32_t Update(uint32_t crc, const uint8_t *data, unsigned int size) const {
+    for (unsigned int i = 0; i < size; i++) {
+      crc = m_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+  }
+
+ private:
+  uint32_t m_table[256];
+};
+
+uint32_t Crc32cSoftware(uint32_t crc, const uint8_t *data, unsigned int size) {
+  static const Crc32cTable table;
+  return table.Update(crc, data, size);
+}
+
+#ifdef HAVE_CRC32C_SSE42
+inline uint64_t LoadWord(const uint8_t *data) {
+  uint64_t word;
+  memcpy(&word, data, sizeof(word));
+  return word;
+}
+
+__attribute__((target("sse4.2")))
+uint32_t Crc32cSse42(uint32_t crc, const uint8_t *data, unsigned int size) {
+  uint64_t crc64 = crc;
+  for (; size >= 8; data += 8, size -= 8) {
+    crc64 = _mm_crc32_u64(crc64, LoadWord(data));
+  }
+  crc = static_cast<uint32_t>(crc64);
+  for (; size; data++, size--) {
+    crc = _mm_crc32_u8(crc, *data);
+  }
+  return crc;
+}
+
+/**
+ * @returns x^power modulo the CRC-32C polynomial, bit reversed.
+ */
+uint32_t Crc32cPowerOfX(unsigned int power) {
+  uint32_t result = 0x80000000;
+  for (unsigned int i = 0; i < power; i++) {
+    result = (result >> 1) ^ (result & 1 ? kCrc32cPolynomial : 0);
+  }
+  return result;
+}
+
+/**
+ * Move a CRC past n zero bytes, i.e. multiply it by x^(8n).
+ * @param constant Crc32cPowerOfX(8n - 33), the 33 allowing for the crc32
+ *   instruction's multiply by x^32, and the bit reversal.
+ */
+__attribute__((target("sse4.2,pclmul")))
+inline uint32_t Crc32cShift(uint32_t crc, uint32_t constant) {
+  const __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc),
+                                               _mm_cvtsi32_si128(constant),
+                                               0);
+  return _mm_crc32_u64(0, _mm_cvtsi128_si64(product));
+}
+
+/**
+ * Compute the CRC as three lanes at once. Each crc32 instruction has to
+ * wait for the one before it in the same lane, so this keeps three in
+ * flight rather than one. The lanes are then combined, since the CRC of
+ * A followed by B is the CRC of A moved past B, XORed with the CRC of B.
+ */
+__attribute__((target("sse4.2,pclmul")))
+uint32_t Crc32cInterleaved(uint32_t crc, const uint8_t *data,
+                           unsigned int size) {
+  static const unsigned int kLane = kCrc32cLaneSize;
+  static const uint32_t kPastOneLane = Crc32cPowerOfX(8 * kLane - 33);
+  static const uint32_t kPastTwoLanes = Crc32cPowerOfX(16 * kLane - 33);
 
+  for (; size >= 3 * kLane; data += 3 * kLane, size -= 3 * kLane) {
+    uint64_t first = crc, second = 0, third = 0;
+    for (unsigned int i = 0; i < kLane; i += 8) {
+      first = _mm_crc32_u64(first, LoadWord(data + i));
+      second = _mm_crc32_u64(second, LoadWord(data + kLane + i));
+      third = _mm_crc32_u64(third, LoadWord(data + 2 * kLane + i));
+    }
+    crc = Crc32cShift(first, kPastTwoLanes) ^
+          Crc32cShift(second, kPastOneLane) ^ static_cast<uint32_t>(third);
+  }
+  return Crc32cSse42(crc, data, size);
+}
+#endif
+
+/**
+ * @param crc the CRC of the data before this, to compute a CRC in pieces.
+ * @returns the CRC-32C of the data, using the crc32 instruction if the CPU
+ *   has one, and a table otherwise.
+ */
+uint32_t Crc32c(const uint8_t *data, unsigned int size, uint32_t crc = 0) {
+  typedef uint32_t (*UpdateFunction)(uint32_t crc, const uint8_t *data,
+                                     unsigned int size);
+#ifdef HAVE_CRC32C_SSE42
+  static const UpdateFunction update =
+      !__builtin_cpu_supports("sse4.2") ? Crc32cSoftware :
+      __builtin_cpu_supports("pclmul") ? Crc32cInterleaved : Crc32cSse42;
+#else
+  static const UpdateFunction update = Crc32cSoftware;
+#endif
+  return ~update(~crc, data, size);
+}
+
+#ifdef __cpp_impl_coroutine
+class RequestAwaiter;
+#endif
+
+/**
+ * Sends requests to the widget and receives the responses.
+ *
+ * Requests are placed in a bounded, lock-free queue, and the libusb thread
+ * does all the framing and transfer submission. The widget handles one
+ * request at a time, so the libusb thread starts the next request as the
+ * previous one completes.
+ *
+ * Payloads larger than a single frame can be sent with SendStream(), which
+ * splits them into CHUNK_COMMAND frames. Each chunk frame is:
+ *   [command lo] [command hi] [offset, 4 bytes] [total, 4 bytes] [data]
+ * and the widget responds to each one with a CHUNK_COMMAND frame of:
+ *   [offset, 4 bytes] [total, 4 bytes] [data]
+ * which are reassembled into a single response. All values are little
+ * endian. CHUNK_COMMAND is defined here rather than by the widget firmware,
+ * so streams only work with a widget that implements it this way.
+ *
+ * Each IN transfer is assumed to carry exactly one response frame, which is
+ * how the widget answers one request at a time. Unlike DmxReceiver::Decode(),
+ * nothing here splits a transfer holding several frames.
+ *
+ * With SetChecksums(), frames carry a CRC-32C of the command, length and
+ * payload, between the payload and the EOF, and have CHECKSUM_FLAG set in
+ * the command. ParseFrame() checks the CRC of any frame that has one.
+ */
 class UsbSender {
  public:
-  explicit UsbSender(libusb_device_handle *device)
-      : m_device(device),
-        m_in_transfer(NULL),
+  // Called, from the libusb thread, when the device goes away.
+  typedef void (*DisconnectCallback)(void *user_data);
+
+  // Called, from the libusb thread, when a request completes.
+  typedef void (*ResponseCallback)(void *user_data,
+                                   const RequestResult &result);
+
+  UsbSender(LibUsbThread *thread, TransferPool *pool,
+            libusb_device_handle *device)
+      : m_in_buffer(NULL),
+        m_out_buffer(NULL),
+        m_thread(thread),
+        m_pool(pool),
+        m_device(device),
+        m_out_entry(NULL),
+        m_in_entry(NULL),
         m_out_transfer(NULL),
-        m_got_response(false) {
+        m_in_transfer(NULL),
+        m_commands(kCommandQueueSize),
+        m_got_response(false),
+        m_device_lost(false),
+        m_failed(false),
+        m_failed_endpoint(0),
+        m_failed_status(LIBUSB_TRANSFER_COMPLETED),
+        m_pending_transfers(0),
+        m_request_active(false),
+        m_paused(false),
+        m_resend_pending(false),
+        m_termination(ZERO_PACKET_TERMINATION),
+        m_checksums(false),
+        m_verbose(true),
+        m_stream_window(0),
+        m_last_was_stream(false),
+        m_active_callback(NULL),
+        m_active_data(NULL),
+        m_disconnect_callback(NULL),
+        m_disconnect_data(NULL) {
     pthread_mutex_init(&m_mutex, NULL);
     pthread_cond_init(&m_condition, NULL);
 
-    m_in_transfer = libusb_alloc_transfer(0);
-    m_out_transfer = libusb_alloc_transfer(0);
+    m_in_entry = m_pool->Acquire();
+    m_out_entry = m_pool->Acquire();
+    if (!m_in_entry || !m_out_entry) {
+      // Without transfers, the only thing we can do is be destroyed.
+      cerr << "Transfer pool exhausted" << endl;
+      m_device_lost = true;
+      return;
+    }
+    m_in_transfer = m_in_entry->transfer;
+    m_in_buffer = m_in_entry->buffer;
+    m_out_transfer = m_out_entry->transfer;
+    m_out_buffer = m_out_entry->buffer;
+    m_thread->AddWorkHandler(ProcessCommandsHandler, static_cast<void*>(this));
   }
 
   ~UsbSender() {
+    // The transfers can't be released until the libusb thread is done with
+    // them.
+    if (m_out_transfer) {
+      m_thread->RemoveWorkHandler(ProcessCommandsHandler,
+                                  static_cast<void*>(this));
+      CancelTransfers(false);
+    }
+
+    // Nothing on the libusb thread reads the queue now, so we can. Anything
+    // that never started is cancelled.
+    while (QueuedRequest *request = m_commands.Front()) {
+      if (request->callback) {
+        RequestResult result;
+        result.status = REQUEST_CANCELLED;
+        result.data = NULL;
+        result.size = 0;
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        timersub(&now, &request->start, &result.latency);
+        request->callback(request->user_data, result);
+      }
+      m_commands.Pop();
+    }
+
+    m_pool->Release(m_out_entry);
+    m_pool->Release(m_in_entry);
     pthread_mutex_destroy(&m_mutex);
     pthread_cond_destroy(&m_condition);
   }
 
+  /**
+   * @returns false if there weren't enough transfers in the pool.
+   */
+  bool HasTransfers() const { return m_out_transfer != NULL; }
+
+  /**
+   * Set how frames that fill a whole number of packets are terminated. This
+   * starts as ZERO_PACKET_TERMINATION, and falls back to PAD_TERMINATION if
+   * the platform doesn't support zero length packets for this device.
+   */
+  void SetFrameTermination(FrameTermination termination) {
+    m_termination = termination;
+  }
+
+  FrameTermination GetFrameTermination() const { return m_termination; }
+
+  /**
+   * Add a checksum to the frames we send, this is off by default. The widget
+   * must support them.
+   */
+  void SetChecksums(bool checksums) { m_checksums = checksums; }
+
+  /**
+   * Log each transfer, this is on by default.
+   */
+  void SetVerbose(bool verbose) { m_verbose = verbose; }
+
+  void SetDisconnectCallback(DisconnectCallback callback, void *user_data) {
+    m_disconnect_callback = callback;
+    m_disconnect_data = user_data;
+  }
+
+  /**
+   * Send a request, use Wait() to wait for the response.
+   */
   bool SendRequest(uint16_t command, const uint8_t *data, unsigned int size) {
+    pthread_mutex_lock(&m_mutex);
+    m_got_response = false;
+    m_failed = false;
+    pthread_mutex_unlock(&m_mutex);
+    return SendRequest(command, data, size, kTimeout, NULL, NULL);
+  }
+
+  bool SendRequest(uint16_t command, const uint8_t *data, unsigned int size,
+                   ResponseCallback callback, void *user_data) {
+    return SendRequest(command, data, size, kTimeout, callback, user_data);
+  }
+
+  /**
+   * Send a request, and run the callback when it completes.
+   *
+   * This never blocks, the data is copied into the queue and the libusb
+   * thread sends it. If the transfer can't be submitted, the callback runs
+   * with REQUEST_FAILED or REQUEST_DEVICE_LOST.
+   * @param timeout the time in ms to wait for the response, measured from
+   *   now. A queued request that expires before it's started completes with
+   *   REQUEST_TIMED_OUT once it reaches the front of the queue.
+   * @returns false if the device has gone or the queue is full, in which case
+   *   the callback isn't run.
+   */
+  bool SendRequest(uint16_t command, const uint8_t *data, unsigned int size,
+                   unsigned int timeout, ResponseCallback callback,
+                   void *user_data) {
     if (size > MAX_MESSAGE_SIZE) {
       cerr << "Message exceeds max size" << endl;
       return false;
     }
+    return Enqueue(command, data, size, COPIED_FRAME, timeout, callback,
+                   user_data);
+  }
 
-    unsigned int offset = 0;
-    m_out_buffer[0] = SOF_IDENTIFIER;
-    m_out_buffer[1] = static_cast<uint8_t>(command & 0xff);
-    m_out_buffer[2] = static_cast<uint8_t>(command >> 8);
-    m_out_buffer[3] = static_cast<uint8_t>(size & 0xff);
-    m_out_buffer[4] = static_cast<uint8_t>(size >> 8);
-    offset += 5;
-
-    if (size > 0) {
-      memcpy(m_out_buffer + offset, data, size);
-      offset += size;
-    }
-    m_out_buffer[offset++] = EOF_IDENTIFIER;
-
-    if (offset % MAX_PACKET_SIZE == 0)  {
-      // We need to pad the messaeg so that the transfer completes at the PIC
-      // end. We could use LIBUSB_TRANSFER_ADD_ZERO_PACKET instead.
-      m_out_buffer[offset++] = 0;
+  /**
+   * Send a request that may be larger than MAX_MESSAGE_SIZE, as a single
+   * frame.
+   * @param data the payload, this isn't copied so it must remain valid until
+   *   the callback runs.
+   * @returns false if the device has gone, the queue is full or the payload
+   *   is larger than MAX_FRAME_PAYLOAD, in which case the callback isn't run.
+   */
+  bool SendFrame(uint16_t command, const uint8_t *data, unsigned int size,
+                 unsigned int timeout, ResponseCallback callback,
+                 void *user_data) {
+    if (size > MAX_FRAME_PAYLOAD) {
+      cerr << "Frame exceeds max size" << endl;
+      return false;
     }
+    return Enqueue(command, data, size, REFERENCED_FRAME, timeout, callback,
+                   user_data);
+  }
 
-    libusb_fill_bulk_transfer(m_out_transfer, m_device, kOutEndpoint,
-                              m_out_buffer, offset,
-                              OutTransferCompleteHandler,
-                              static_cast<void*>(this),
-                              kTimeout);
-    gettimeofday(&m_send_out_time, NULL);
-    cout << "Sending " << std::dec << offset << " bytes at "
-         << m_send_out_time << endl;
-
-    int r = libusb_submit_transfer(m_out_transfer);
-    if (r) {
-      cerr << "Failed to submit out transfer" << endl;
-    }
-    return r == 0;
+  /**
+   * Send a payload of any size, as a stream of chunks.
+   *
+   * Up to kStreamWindow chunks are in flight at once, and the responses are
+   * reassembled and passed to the callback as one. Other requests wait until
+   * the stream completes.
+   * @param data the payload, this isn't copied so it must remain valid until
+   *   the callback runs.
+   * @param timeout the time in ms for the whole stream.
+   * @returns false if the device has gone or the queue is full, in which case
+   *   the callback isn't run.
+   */
+  bool SendStream(uint16_t command, const uint8_t *data, unsigned int size,
+                  unsigned int timeout, ResponseCallback callback,
+                  void *user_data) {
+    return Enqueue(command, data, size, STREAM, timeout, callback, user_data);
   }
 
+#ifdef __cpp_impl_coroutine
+  /**
+   * Send a request from a coroutine, e.g.
+   *   Response response = co_await sender->Request(ECHO_COMMAND, data, size);
+   */
+  RequestAwaiter Request(uint16_t command, const uint8_t *data,
+                         unsigned int size);
+  RequestAwaiter Request(uint16_t command, const string &payload);
+#endif
+
   void _OutTransferComplete() {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    cout << "Out transfer completed at " << tv << ", status is "
-         << libusb_error_name(m_out_transfer->status) << endl;
+    if (m_verbose) {
+      struct timeval tv;
+      gettimeofday(&tv, NULL);
+      cout << "Out transfer completed at " << tv << ", status is "
+           << TransferStatusName(m_out_transfer->status) << endl;
+    }
+    RequestStatus status = StatusFromTransfer(m_out_transfer->status);
     if (m_out_transfer->status == LIBUSB_TRANSFER_COMPLETED) {
-      cout << "Sent " << m_out_transfer->actual_length << " bytes" << endl;
-      SubmitInTransfer();
+      if (m_verbose) {
+        cout << "Sent " << m_out_transfer->actual_length << " bytes" << endl;
+      }
+      if (!SubmitInTransfer()) {
+        status = DeviceIsLost() ? REQUEST_DEVICE_LOST : REQUEST_FAILED;
+      }
+    } else if (m_out_transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+      DeviceLost();
+    } else {
+      TransferFailed(kOutEndpoint, m_out_transfer->status);
     }
+    if (status != REQUEST_OK) {
+      FinishRequest(status, NULL, 0);
+    }
+    TransferDone();
   }
 
   void _InTransferComplete() {
     struct timeval tv;
     gettimeofday(&tv, NULL);
-    cout << "In transfer completed, at " << tv << ", status is "
-         << libusb_error_name(m_in_transfer->status) << endl;
-    if (m_in_transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+    if (m_verbose) {
+      cout << "In transfer completed, at " << tv << ", status is "
+           << TransferStatusName(m_in_transfer->status) << endl;
+    }
+    if (m_verbose && m_in_transfer->status == LIBUSB_TRANSFER_COMPLETED) {
       cout << "Got " << std::dec << m_in_transfer->actual_length << " bytes"
            << endl;
       cout << "Received: " << std::hex;
-      for (unsigned int i = 0; i < m_in_transfer->actual_length; i++) {
+      for (int i = 0; i < m_in_transfer->actual_length; i++) {
         cout << std::setw(2) << std::setfill('0')
              << static_cast<int>(m_in_transfer->buffer[i]) << " ";
       }
       cout << endl;
     }
-    struct timeval diff;
-    timersub(&tv, &m_send_out_time, &diff);
-    cout << "Total time was " << diff << endl;
+    if (m_in_transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+      DeviceLost();
+      FinishRequest(REQUEST_DEVICE_LOST, NULL, 0);
+      TransferDone();
+      return;
+    } else if (m_in_transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+      TransferFailed(kInEndpoint, m_in_transfer->status);
+      FinishRequest(StatusFromTransfer(m_in_transfer->status), NULL, 0);
+      TransferDone();
+      return;
+    }
+    if (m_verbose) {
+      struct timeval diff;
+      timersub(&tv, &m_send_out_time, &diff);
+      cout << "Total time was " << diff << endl;
+    }
+    if (!m_active_callback) {
+      pthread_mutex_lock(&m_mutex);
+      m_got_response = true;
+      pthread_mutex_unlock(&m_mutex);
+      pthread_cond_signal(&m_condition);
+    }
+    FinishRequest(REQUEST_OK, m_in_buffer, m_in_transfer->actual_length);
+    TransferDone();
+  }
+
+  // A pair of transfers carrying one chunk of a stream. Slot 0 uses the
+  // sender's own transfers, the rest come from the pool.
+  struct StreamSlot {
+    UsbSender *sender;
+    TransferPool::Entry *out_entry;
+    TransferPool::Entry *in_entry;
+    libusb_transfer *out_transfer;
+    libusb_transfer *in_transfer;
+    bool out_pending;
+    bool in_pending;
+  };
+
+  void _StreamOutComplete(StreamSlot *slot) {
+    libusb_transfer *transfer = slot->out_transfer;
+    slot->out_pending = false;
+    m_stream.in_flight--;
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+      StreamTransferFailed(kOutEndpoint, transfer->status);
+    } else if (!slot->in_pending) {
+      SendNextChunk(slot);
+    }
+    MaybeFinishStream();
+    TransferDone();
+  }
+
+  void _StreamInComplete(StreamSlot *slot) {
+    libusb_transfer *transfer = slot->in_transfer;
+    slot->in_pending = false;
+    m_stream.in_flight--;
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+      StreamTransferFailed(kInEndpoint, transfer->status);
+    } else if (!AddStreamResponse(transfer->buffer, transfer->actual_length)) {
+      StreamFailed(REQUEST_FAILED);
+    } else if (!slot->out_pending) {
+      SendNextChunk(slot);
+    }
+    MaybeFinishStream();
+    TransferDone();
+  }
+
+  /**
+   * Wait for a response, a transfer failure, or for the device to be lost.
+   */
+  void Wait() {
     pthread_mutex_lock(&m_mutex);
-    m_got_response = true;
+    while (!m_got_response && !m_device_lost && !m_failed) {
+      pthread_cond_wait(&m_condition, &m_mutex);
+    }
     pthread_mutex_unlock(&m_mutex);
-    pthread_cond_signal(&m_condition);
   }
 
-  void Wait() {
+  /**
+   * Check if the last request failed.
+   * @param endpoint set to the endpoint of the transfer that failed.
+   * @param status set to the status of the failed transfer.
+   * @returns true if the request failed.
+   */
+  bool GetFailure(uint8_t *endpoint, libusb_transfer_status *status) {
     pthread_mutex_lock(&m_mutex);
-    if (m_got_response) {
-      pthread_mutex_unlock(&m_mutex);
-      return;
-    } else {
+    bool failed = m_failed;
+    *endpoint = m_failed_endpoint;
+    *status = m_failed_status;
+    pthread_mutex_unlock(&m_mutex);
+    return failed;
+  }
+
+  /**
+   * Cancel any in flight transfers and wait for them to complete. Must not be
+   * called from the libusb thread.
+   * @param resume false if no more requests should be started at all.
+   */
+  void CancelTransfers(bool resume = true) {
+    pthread_mutex_lock(&m_mutex);
+    m_paused = true;
+    if (m_pending_transfers) {
+      libusb_cancel_transfer(m_out_transfer);
+      libusb_cancel_transfer(m_in_transfer);
+      for (unsigned int i = 1; i < m_stream_window; i++) {
+        libusb_cancel_transfer(m_stream_slots[i].out_transfer);
+        libusb_cancel_transfer(m_stream_slots[i].in_transfer);
+      }
+    }
+    while (m_pending_transfers) {
       pthread_cond_wait(&m_condition, &m_mutex);
+    }
+    m_paused = !resume;
+    pthread_mutex_unlock(&m_mutex);
+    if (resume) {
+      m_thread->Wake();
+    }
+  }
+
+  /**
+   * Send the last request again, after recovering from a failure. This is
+   * only valid if no other request has started since. The libusb thread
+   * sends it ahead of anything queued, use Wait() for the result.
+   */
+  bool Resend() {
+    pthread_mutex_lock(&m_mutex);
+    if (m_request_active) {
       pthread_mutex_unlock(&m_mutex);
+      return false;
     }
+    m_resend_pending = true;
+    m_failed = false;
+    m_got_response = false;
+    pthread_mutex_unlock(&m_mutex);
+    m_thread->Wake();
+    return true;
   }
 
-  enum {
-    ECHO_COMMAND = 0x80,
-    TX_DMX = 0x81
-  };
+  /**
+   * Start queued requests, this is run on the libusb thread.
+   */
+  void _ProcessCommands() {
+    StartQueued();
+  }
 
- private:
-  // Should be a multiple of the endpoint packet size to avoid libusb overflows.
-  enum {
-    IN_BUFFER_SIZE = 1024
-  };
+  bool DeviceIsLost() {
+    pthread_mutex_lock(&m_mutex);
+    bool lost = m_device_lost;
+    pthread_mutex_unlock(&m_mutex);
+    return lost;
+  }
 
   enum {
-    OUT_BUFFER_SIZE = 1024
+    ECHO_COMMAND = 0x80,
+    TX_DMX = 0x81,
+    CHUNK_COMMAND = 0x82,
+    // [port mask lo] [port mask hi] and then 512 slots for each port in the
+    // mask, lowest port first.
+    TX_DMX_MULTI = 0x83,
+    // Sent by the widget on kRxEndpoint, without a request: [port] [status]
+    // [4 byte timestamp in us] [start code] [slots]. The timestamp is when
+    // the widget saw the break, on its own clock.
+    RX_DMX = 0x84,
+    // [port mask lo] [port mask hi], the ports to send RX_DMX for.
+    RX_DMX_ENABLE = 0x85,
+    // [port] [RDM request, from the start code to the checksum]. The
+    // response is [port] [result] [whatever the responders sent], where the
+    // result is 1 if nothing was received.
+    RDM_COMMAND = 0x86
   };
 
-  uint8_t m_in_buffer[IN_BUFFER_SIZE];
-  uint8_t m_out_buffer[OUT_BUFFER_SIZE];
+  // Set in the command of a frame that has a checksum.
+  static const uint16_t CHECKSUM_FLAG = 0x8000;
 
-  libusb_device_handle *m_device;
-  libusb_transfer *m_out_transfer;
-  libusb_transfer *m_in_transfer;
-  std::queue<string> m_messages;
-  pthread_mutex_t m_mutex;
-  pthread_cond_t m_condition;
-  bool m_got_response;
-  struct timeval m_send_out_time;
-  struct timeval m_send_in_time;
+  // The largest payload SendFrame() accepts, allowing for the header,
+  // checksum, EOF and pad byte.
+  static const unsigned int MAX_FRAME_PAYLOAD = TransferPool::BUFFER_SIZE - 11;
 
-  void SubmitInTransfer() {
-    libusb_fill_bulk_transfer(m_in_transfer, m_device, kInEndpoint,
-                                   m_in_buffer, IN_BUFFER_SIZE,
-                                   InTransferCompleteHandler,
-                                   static_cast<void*>(this),
-                                   kTimeout);
-    gettimeofday(&m_send_in_time, NULL);
-    int r = libusb_submit_transfer(m_in_transfer);
-    if (r) {
-      cerr << "Failed to submit input transfer" << endl;
+  /**
+   * Check a frame is complete, and find its payload. If the frame has a
+   * checksum, that must match too.
+   * @param frame_size if not NULL, set to the length of the frame.
+   * @returns false if the frame is malformed, fails its checksum or is for a
+   *   different command.
+   */
+  static bool ParseFrame(const uint8_t *frame, unsigned int length,
+                         uint16_t command, const uint8_t **payload,
+                         unsigned int *payload_size,
+                         unsigned int *frame_size = NULL) {
+    static const unsigned int kHeaderSize = 5;
+    if (length < kHeaderSize + 1 || frame[0] != SOF_IDENTIFIER) {
+      return false;
+    }
+    const uint16_t frame_command = frame[1] | (frame[2] << 8);
+    const unsigned int size = frame[3] | (frame[4] << 8);
+    const unsigned int checksum_size =
+        frame_command & CHECKSUM_FLAG ? CHECKSUM_SIZE : 0;
+    const unsigned int end = kHeaderSize + size + checksum_size;
+    if ((frame_command & ~CHECKSUM_FLAG) != command || length < end + 1 ||
+        frame[end] != EOF_IDENTIFIER) {
+      return false;
+    }
+    if (checksum_size && ReadLittleEndian(frame + kHeaderSize + size) !=
+                         Crc32c(frame + 1, kHeaderSize - 1 + size)) {
+      return false;
+    }
+    *payload = frame + kHeaderSize;
+    *payload_size = size;
+    if (frame_size) {
+      *frame_size = end + 1;
     }
-    cout << "Submitted in transfer at " << m_send_in_time << endl;
+    return true;
   }
 
-  static const uint8_t SOF_IDENTIFIER = 0x5a;
-  static const uint8_t EOF_IDENTIFIER = 0xa5;
-  static const unsigned int MAX_MESSAGE_SIZE = 513;
-  static const unsigned int MAX_PACKET_SIZE = 64;
-};
+  /**
+   * Find where the next frame might start, to resynchronize after a frame
+   * that didn't parse.
+   * @returns the next SOF after the start of the data, or NULL if there
+   *   isn't one.
+   */
+  static const uint8_t *FindNextFrame(const uint8_t *data,
+                                      unsigned int length) {
+    if (length < 2) {
+      return NULL;
+    }
+    return static_cast<const uint8_t*>(
+        memchr(data + 1, SOF_IDENTIFIER, length - 1));
+  }
 
-void InTransferCompleteHandler(struct libusb_transfer *transfer) {
+  static void WriteLittleEndian(uint8_t *buffer, uint32_t value) {
+    for (unsigned int i = 0; i < 4; i++) {
+      buffer[i] = static_cast<uint8_t>(value >> (8 * i));
+    }
+  }
+
+  static uint32_t ReadLittleEndian(const uint8_t *buffer) {
+    return buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) |
+           (static_cast<uint32_t>(buffer[3]) << 24);
+  }
+
+  /**
+   * Frame a message.
+   * @param buffer where to build the frame, this must have room for a
+   *   MAX_FRAME_PAYLOAD payload.
+   * @param header, header_size optional bytes to put before the data.
+   * @param checksum true to add a checksum.
+   * @param termination how to end a frame that fills a whole number of
+   *   packets.
+   * @param zero_packet set to true if the frame needs a zero length packet
+   *   after it.
+   * @returns the length of the frame.
+   */
+  static unsigned int BuildFrame(uint8_t *buffer, uint16_t command,
+                                 const uint8_t *header,
+                                 unsigned int header_size,
+                                 const uint8_t *data, unsigned int size,
+                                 bool checksum, FrameTermination termination,
+                                 bool *zero_packet) {
+    const unsigned int payload_size = header_size + size;
+    unsigned int offset = 0;
+    if (checksum) {
+      command |= CHECKSUM_FLAG;
+    }
+    buffer[0] = SOF_IDENTIFIER;
+    buffer[1] = static_cast<uint8_t>(command & 0xff);
+    buffer[2] = static_cast<uint8_t>(command >> 8);
+    buffer[3] = static_cast<uint8_t>(payload_size & 0xff);
+    buffer[4] = static_cast<uint8_t>(payload_size >> 8);
+    offset += 5;
+
+    if (header_size > 0) {
+      memcpy(buffer + offset, header, header_size);
+      offset += header_size;
+    }
+    if (size > 0) {
+      memcpy(buffer + offset, data, size);
+      offset += size;
+    }
+    if (checksum) {
+      // From the sources rather than the frame, reading back what was just
+      // copied is slower.
+      uint32_t crc = Crc32c(buffer + 1, 4);
+      crc = Crc32c(header, header_size, crc);
+      crc = Crc32c(data, size, crc);
+      WriteLittleEndian(buffer + offset, crc);
+      offset += CHECKSUM_SIZE;
+    }
+    buffer[offset++] = EOF_IDENTIFIER;
+
+    // The transfer only completes at the PIC end on a short packet.
+    *zero_packet = false;
+    if (offset % MAX_PACKET_SIZE == 0)  {
+      if (termination == ZERO_PACKET_TERMINATION) {
+        *zero_packet = true;
+      } else {
+        buffer[offset++] = 0;
+      }
+    }
+    return offset;
+  }
+
+ private:
+  enum {
+    IN_BUFFER_SIZE = TransferPool::BUFFER_SIZE
+  };
+
+  static const uint8_t SOF_IDENTIFIER = 0x5a;
+  static const uint8_t EOF_IDENTIFIER = 0xa5;
+  static const unsigned int MAX_MESSAGE_SIZE = 513;
+  static const unsigned int MAX_PACKET_SIZE = 64;
+  // The CRC-32C, between the payload and the EOF.
+  static const unsigned int CHECKSUM_SIZE = 4;
+  // The chunk header, before the data.
+  static const unsigned int CHUNK_HEADER_SIZE = 10;
+  // The response header, before the data.
+  static const unsigned int CHUNK_RESPONSE_HEADER_SIZE = 8;
+  static const unsigned int MAX_CHUNK_SIZE =
+      MAX_MESSAGE_SIZE - CHUNK_HEADER_SIZE;
+
+  enum RequestKind {
+    // The payload is copied into the queue.
+    COPIED_FRAME,
+    // The payload is the caller's, and sent as a single frame.
+    REFERENCED_FRAME,
+    // The payload is the caller's, and sent as chunks.
+    STREAM
+  };
+
+  // A request waiting to be sent.
+  struct QueuedRequest {
+    RequestKind kind;
+    uint16_t command;
+    unsigned int size;
+    uint8_t payload[MAX_MESSAGE_SIZE];
+    // The caller's data, unless this is a COPIED_FRAME.
+    const uint8_t *external_data;
+    ResponseCallback callback;
+    void *user_data;
+    struct timeval start;
+    struct timeval deadline;
+  };
+
+  /**
+   * A bounded, lock-free queue with many producers and a single consumer.
+   *
+   * The slots are allocated up front, with room for the largest payload, so
+   * adding a request never allocates or takes a lock. Each slot's sequence
+   * number says whether it's free for the producer at that position, or
+   * ready for the consumer.
+   */
+  class CommandQueue {
+   public:
+    struct Slot {
+      QueuedRequest request;
+
+     private:
+      std::atomic<unsigned int> sequence;
+      unsigned int position;
+
+      friend class CommandQueue;
+    };
+
+    explicit CommandQueue(unsigned int capacity)
+        : m_slots(new Slot[capacity]),
+          m_mask(capacity - 1),
+          m_tail(0),
+          m_head(0) {
+      for (unsigned int i = 0; i < capacity; i++) {
+        m_slots[i].sequence.store(i, std::memory_order_relaxed);
+      }
+    }
+
+    ~CommandQueue() {
+      delete[] m_slots;
+    }
+
+    /**
+     * Reserve a slot, any thread can call this.
+     * @returns the slot to fill in and Publish(), or NULL if the queue is
+     *   full.
+     */
+    Slot *Claim() {
+      unsigned int position = m_tail.load(std::memory_order_relaxed);
+      while (true) {
+        Slot *slot = &m_slots[position & m_mask];
+        unsigned int sequence = slot->sequence.load(std::memory_order_acquire);
+        int diff = static_cast<int>(sequence - position);
+        if (diff == 0) {
+          if (m_tail.compare_exchange_weak(position, position + 1,
+                                           std::memory_order_relaxed)) {
+            slot->position = position;
+            return slot;
+          }
+        } else if (diff < 0) {
+          return NULL;
+        } else {
+          position = m_tail.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    void Publish(Slot *slot) {
+      slot->sequence.store(slot->position + 1, std::memory_order_release);
+    }
+
+    /**
+     * @returns the oldest published request, or NULL. Only the consumer may
+     *   call this.
+     */
+    QueuedRequest *Front() {
+      Slot *slot = &m_slots[m_head & m_mask];
+      if (slot->sequence.load(std::memory_order_acquire) != m_head + 1) {
+        return NULL;
+      }
+      return &slot->request;
+    }
+
+    /**
+     * Free the slot returned by Front().
+     */
+    void Pop() {
+      Slot *slot = &m_slots[m_head & m_mask];
+      slot->sequence.store(m_head + m_mask + 1, std::memory_order_release);
+      m_head++;
+    }
+
+   private:
+    Slot *m_slots;
+    const unsigned int m_mask;
+    std::atomic<unsigned int> m_tail;
+    unsigned int m_head;  // Only used by the consumer.
+
+    CommandQueue(const CommandQueue&);
+    CommandQueue& operator=(const CommandQueue&);
+  };
+
+  uint8_t *m_in_buffer;
+  uint8_t *m_out_buffer;
+
+  LibUsbThread *m_thread;
+  TransferPool *m_pool;
+  libusb_device_handle *m_device;
+  TransferPool::Entry *m_out_entry;
+  TransferPool::Entry *m_in_entry;
+  libusb_transfer *m_out_transfer;
+  libusb_transfer *m_in_transfer;
+  // Read by the libusb thread, or by the destructor once it's stopped.
+  CommandQueue m_commands;
+  pthread_mutex_t m_mutex;
+  pthread_cond_t m_condition;
+  bool m_got_response;  // GUARDED_BY(m_mutex)
+  bool m_device_lost;  // GUARDED_BY(m_mutex)
+  bool m_failed;  // GUARDED_BY(m_mutex)
+  uint8_t m_failed_endpoint;  // GUARDED_BY(m_mutex)
+  libusb_transfer_status m_failed_status;  // GUARDED_BY(m_mutex)
+  unsigned int m_pending_transfers;  // GUARDED_BY(m_mutex)
+  bool m_request_active;  // GUARDED_BY(m_mutex)
+  bool m_paused;  // GUARDED_BY(m_mutex)
+  bool m_resend_pending;  // GUARDED_BY(m_mutex)
+  std::atomic<FrameTermination> m_termination;
+  std::atomic<bool> m_checksums;
+  std::atomic<bool> m_verbose;
+
+  // The active stream, only touched by the libusb thread.
+  struct Stream {
+    uint16_t command;
+    const uint8_t *data;
+    unsigned int size;
+    unsigned int chunks;
+    unsigned int chunks_sent;
+    unsigned int in_flight;
+    unsigned int received;
+    RequestStatus status;
+  };
+
+  StreamSlot m_stream_slots[kStreamWindow];
+  unsigned int m_stream_window;  // GUARDED_BY(m_mutex)
+  Stream m_stream;
+  string m_stream_response;
+  bool m_last_was_stream;
+  // Only touched by the libusb thread.
+  ResponseCallback m_active_callback;
+  void *m_active_data;
+  struct timeval m_active_start;
+  struct timeval m_active_deadline;
+  DisconnectCallback m_disconnect_callback;
+  void *m_disconnect_data;
+  struct timeval m_send_out_time;
+  struct timeval m_send_in_time;
+
+  /**
+   * Frame a request and send it.
+   */
+  bool StartRequest(const QueuedRequest &request) {
+    m_active_callback = request.callback;
+    m_active_data = request.user_data;
+    m_active_start = request.start;
+    m_active_deadline = request.deadline;
+    m_last_was_stream = false;
+
+    bool zero_packet;
+    const uint8_t *payload = request.kind == COPIED_FRAME ?
+        request.payload : request.external_data;
+    unsigned int length = BuildFrame(m_out_buffer, request.command, NULL, 0,
+                                     payload, request.size, m_checksums,
+                                     m_termination, &zero_packet);
+    libusb_fill_bulk_transfer(m_out_transfer, m_device, kOutEndpoint,
+                              m_out_buffer, length,
+                              OutTransferCompleteHandler,
+                              static_cast<void*>(this),
+                              RemainingTimeout());
+    m_out_transfer->flags = zero_packet ? LIBUSB_TRANSFER_ADD_ZERO_PACKET : 0;
+    gettimeofday(&m_send_out_time, NULL);
+    if (m_verbose) {
+      cout << "Sending " << std::dec << length << " bytes at "
+           << m_send_out_time << endl;
+    }
+
+    return SubmitTransfer(m_out_transfer);
+  }
+
+  /**
+   * Add a request to the queue, for the libusb thread to send.
+   */
+  bool Enqueue(uint16_t command, const uint8_t *data, unsigned int size,
+               RequestKind kind, unsigned int timeout,
+               ResponseCallback callback, void *user_data) {
+    if (DeviceIsLost()) {
+      return false;
+    }
+
+    CommandQueue::Slot *slot = m_commands.Claim();
+    if (!slot) {
+      cerr << "Command queue is full" << endl;
+      return false;
+    }
+    QueuedRequest *request = &slot->request;
+    request->kind = kind;
+    request->command = command;
+    request->size = size;
+    if (kind == COPIED_FRAME) {
+      request->external_data = NULL;
+      if (size) {
+        memcpy(request->payload, data, size);
+      }
+    } else {
+      request->external_data = data;
+    }
+    request->callback = callback;
+    request->user_data = user_data;
+    gettimeofday(&request->start, NULL);
+    struct timeval delta = {static_cast<time_t>(timeout / 1000),
+                            static_cast<suseconds_t>((timeout % 1000) * 1000)};
+    timeradd(&request->start, &delta, &request->deadline);
+    m_commands.Publish(slot);
+
+    m_thread->Wake();
+    return true;
+  }
+
+  /**
+   * Start sending a stream, using as many transfers as the pool can spare.
+   */
+  bool StartStream(const QueuedRequest &request) {
+    m_active_callback = request.callback;
+    m_active_data = request.user_data;
+    m_active_start = request.start;
+    m_active_deadline = request.deadline;
+    m_last_was_stream = true;
+
+    m_stream.command = request.command;
+    m_stream.data = request.external_data;
+    m_stream.size = request.size;
+    m_stream.chunks = std::max(1u, (request.size + MAX_CHUNK_SIZE - 1) /
+                                   MAX_CHUNK_SIZE);
+    m_stream.chunks_sent = 0;
+    m_stream.in_flight = 0;
+    m_stream.received = 0;
+    m_stream.status = REQUEST_OK;
+    m_stream_response.clear();
+
+    StreamSlot slots[kStreamWindow];
+    unsigned int window = 1;
+    slots[0].out_entry = NULL;
+    slots[0].in_entry = NULL;
+    slots[0].out_transfer = m_out_transfer;
+    slots[0].in_transfer = m_in_transfer;
+    while (window < std::min(kStreamWindow, m_stream.chunks)) {
+      StreamSlot &slot = slots[window];
+      slot.out_entry = m_pool->Acquire();
+      slot.in_entry = m_pool->Acquire();
+      if (!slot.out_entry || !slot.in_entry) {
+        m_pool->Release(slot.out_entry);
+        m_pool->Release(slot.in_entry);
+        break;
+      }
+      slot.out_transfer = slot.out_entry->transfer;
+      slot.in_transfer = slot.in_entry->transfer;
+      window++;
+    }
+    for (unsigned int i = 0; i < window; i++) {
+      slots[i].sender = this;
+      slots[i].out_pending = false;
+      slots[i].in_pending = false;
+    }
+
+    pthread_mutex_lock(&m_mutex);
+    std::copy(slots, slots + window, m_stream_slots);
+    m_stream_window = window;
+    pthread_mutex_unlock(&m_mutex);
+
+    if (m_verbose) {
+      cout << "Streaming " << std::dec << request.size << " bytes as "
+           << m_stream.chunks << " chunks, " << window << " at a time" << endl;
+    }
+    for (unsigned int i = 0; i < window; i++) {
+      SendNextChunk(&m_stream_slots[i]);
+    }
+    if (m_stream.in_flight) {
+      return true;
+    }
+    ReleaseStreamSlots();
+    return false;
+  }
+
+  /**
+   * Send the next chunk of the stream using an idle slot.
+   */
+  void SendNextChunk(StreamSlot *slot) {
+    if (m_stream.status != REQUEST_OK ||
+        m_stream.chunks_sent == m_stream.chunks) {
+      return;
+    }
+
+    const unsigned int offset = m_stream.chunks_sent * MAX_CHUNK_SIZE;
+    const unsigned int remaining = m_stream.size - offset;
+    const unsigned int size =
+        remaining < MAX_CHUNK_SIZE ? remaining : MAX_CHUNK_SIZE;
+    uint8_t header[CHUNK_HEADER_SIZE];
+    header[0] = static_cast<uint8_t>(m_stream.command & 0xff);
+    header[1] = static_cast<uint8_t>(m_stream.command >> 8);
+    WriteLittleEndian(header + 2, offset);
+    WriteLittleEndian(header + 6, m_stream.size);
+
+    bool zero_packet;
+    unsigned int length = BuildFrame(SlotOutBuffer(slot), CHUNK_COMMAND,
+                                     header, CHUNK_HEADER_SIZE,
+                                     m_stream.data + offset, size,
+                                     m_checksums, m_termination,
+                                     &zero_packet);
+    libusb_fill_bulk_transfer(slot->out_transfer, m_device, kOutEndpoint,
+                              SlotOutBuffer(slot), length,
+                              StreamOutCompleteHandler,
+                              static_cast<void*>(slot), RemainingTimeout());
+    slot->out_transfer->flags =
+        zero_packet ? LIBUSB_TRANSFER_ADD_ZERO_PACKET : 0;
+    libusb_fill_bulk_transfer(slot->in_transfer, m_device, kInEndpoint,
+                              SlotInBuffer(slot), IN_BUFFER_SIZE,
+                              StreamInCompleteHandler,
+                              static_cast<void*>(slot), RemainingTimeout());
+
+    // The in transfer goes in right behind the out, so the responses come
+    // back in the order the chunks were sent.
+    if (!SubmitStreamTransfer(slot->out_transfer)) {
+      return;
+    }
+    slot->out_pending = true;
+    m_stream.in_flight++;
+    m_stream.chunks_sent++;
+    if (!SubmitStreamTransfer(slot->in_transfer)) {
+      return;
+    }
+    slot->in_pending = true;
+    m_stream.in_flight++;
+  }
+
+  uint8_t *SlotOutBuffer(StreamSlot *slot) {
+    return slot->out_entry ? slot->out_entry->buffer : m_out_buffer;
+  }
+
+  uint8_t *SlotInBuffer(StreamSlot *slot) {
+    return slot->in_entry ? slot->in_entry->buffer : m_in_buffer;
+  }
+
+  bool SubmitStreamTransfer(libusb_transfer *transfer) {
+    pthread_mutex_lock(&m_mutex);
+    // CancelTransfers() may be waiting for the stream to stop.
+    bool paused = m_paused;
+    pthread_mutex_unlock(&m_mutex);
+    if (paused) {
+      StreamFailed(REQUEST_CANCELLED);
+      return false;
+    }
+    if (!SubmitTransfer(transfer)) {
+      StreamFailed(DeviceIsLost() ? REQUEST_DEVICE_LOST : REQUEST_FAILED);
+      return false;
+    }
+    return true;
+  }
+
+  void StreamTransferFailed(uint8_t endpoint, libusb_transfer_status status) {
+    if (status == LIBUSB_TRANSFER_NO_DEVICE) {
+      DeviceLost();
+    } else {
+      TransferFailed(endpoint, status);
+    }
+    StreamFailed(StatusFromTransfer(status));
+  }
+
+  /**
+   * Stop the stream, and cancel any chunks still in flight.
+   */
+  void StreamFailed(RequestStatus status) {
+    if (m_stream.status != REQUEST_OK) {
+      return;
+    }
+    m_stream.status = status;
+    for (unsigned int i = 0; i < m_stream_window; i++) {
+      if (m_stream_slots[i].out_pending) {
+        libusb_cancel_transfer(m_stream_slots[i].out_transfer);
+      }
+      if (m_stream_slots[i].in_pending) {
+        libusb_cancel_transfer(m_stream_slots[i].in_transfer);
+      }
+    }
+  }
+
+  /**
+   * Copy one chunk of the response into place.
+   * @returns false if the response was malformed.
+   */
+  bool AddStreamResponse(const uint8_t *frame, unsigned int length) {
+    const uint8_t *payload;
+    unsigned int payload_size;
+    if (!ParseFrame(frame, length, CHUNK_COMMAND, &payload, &payload_size) ||
+        payload_size < CHUNK_RESPONSE_HEADER_SIZE) {
+      cerr << "Malformed chunk response" << endl;
+      return false;
+    }
+    const uint32_t offset = ReadLittleEndian(payload);
+    const uint32_t total = ReadLittleEndian(payload + 4);
+    const unsigned int size = payload_size - CHUNK_RESPONSE_HEADER_SIZE;
+    if (total > kMaxStreamResponse || offset > total || size > total - offset) {
+      cerr << "Chunk response of " << size << " bytes at " << offset
+           << " is outside the " << total << " byte response" << endl;
+      return false;
+    }
+    if (m_stream_response.empty()) {
+      m_stream_response.resize(total);
+    } else if (m_stream_response.size() != total) {
+      cerr << "Chunk responses disagree about the total size" << endl;
+      return false;
+    }
+    memcpy(&m_stream_response[offset],
+           payload + CHUNK_RESPONSE_HEADER_SIZE, size);
+    m_stream.received += size;
+    return true;
+  }
+
+  /**
+   * Complete the stream, once nothing is in flight.
+   */
+  void MaybeFinishStream() {
+    if (m_stream.in_flight) {
+      return;
+    }
+    if (m_stream.status == REQUEST_OK &&
+        m_stream.chunks_sent < m_stream.chunks) {
+      // Can't happen, every idle slot sends the next chunk.
+      m_stream.status = REQUEST_FAILED;
+    }
+    if (m_stream.status == REQUEST_OK &&
+        m_stream.received != m_stream_response.size()) {
+      cerr << "Received " << m_stream.received << " of "
+           << m_stream_response.size() << " response bytes" << endl;
+      m_stream.status = REQUEST_FAILED;
+    }
+
+    ReleaseStreamSlots();
+    if (m_verbose) {
+      cout << "Stream complete, " << RequestStatusName(m_stream.status)
+           << endl;
+    }
+    if (m_stream.status == REQUEST_OK) {
+      FinishRequest(REQUEST_OK,
+                    reinterpret_cast<const uint8_t*>(m_stream_response.data()),
+                    m_stream_response.size());
+    } else {
+      FinishRequest(m_stream.status, NULL, 0);
+    }
+  }
+
+  void ReleaseStreamSlots() {
+    pthread_mutex_lock(&m_mutex);
+    for (unsigned int i = 1; i < m_stream_window; i++) {
+      m_pool->Release(m_stream_slots[i].out_entry);
+      m_pool->Release(m_stream_slots[i].in_entry);
+    }
+    m_stream_window = 0;
+    pthread_mutex_unlock(&m_mutex);
+  }
+
+  /**
+   * @returns the time left before the active request's deadline, in ms.
+   */
+  unsigned int RemainingTimeout() const {
+    struct timeval now, remaining;
+    gettimeofday(&now, NULL);
+    if (!timercmp(&now, &m_active_deadline, <)) {
+      // A timeout of 0 means wait forever, so use the smallest one we can.
+      return 1;
+    }
+    timersub(&m_active_deadline, &now, &remaining);
+    return std::max<unsigned int>(
+        1, remaining.tv_sec * 1000 + (remaining.tv_usec + 999) / 1000);
+  }
+
+  /**
+   * Complete the active request, and start the next queued one.
+   */
+  void FinishRequest(RequestStatus status, const uint8_t *data,
+                     unsigned int size) {
+    CompleteRequest(status, data, size);
+    StartQueued();
+  }
+
+  /**
+   * Run the active request's callback, without starting another.
+   */
+  void CompleteRequest(RequestStatus status, const uint8_t *data,
+                       unsigned int size) {
+    ResponseCallback callback = m_active_callback;
+    void *user_data = m_active_data;
+    m_active_callback = NULL;
+
+    RequestResult result;
+    result.status = status;
+    result.data = data;
+    result.size = size;
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    timersub(&now, &m_active_start, &result.latency);
+
+    pthread_mutex_lock(&m_mutex);
+    m_request_active = false;
+    pthread_mutex_unlock(&m_mutex);
+
+    // The next request can't start until we return, so the response buffer
+    // is safe to use from the callback.
+    if (callback) {
+      callback(user_data, result);
+    }
+  }
+
+  /**
+   * Start the next request, unless one is already active.
+   */
+  void StartQueued() {
+    while (true) {
+      pthread_mutex_lock(&m_mutex);
+      if (m_request_active || m_paused) {
+        pthread_mutex_unlock(&m_mutex);
+        return;
+      }
+      const bool resend = m_resend_pending;
+      m_resend_pending = false;
+      QueuedRequest *request = resend ? NULL : m_commands.Front();
+      if (!resend && !request) {
+        pthread_mutex_unlock(&m_mutex);
+        return;
+      }
+      m_request_active = true;
+      pthread_mutex_unlock(&m_mutex);
+
+      bool ok;
+      if (resend) {
+        ok = StartResend();
+      } else {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        if (!timercmp(&now, &request->deadline, <)) {
+          // It expired while it was queued.
+          m_active_callback = request->callback;
+          m_active_data = request->user_data;
+          m_active_start = request->start;
+          m_commands.Pop();
+          if (!m_active_callback) {
+            // There's no transfer to wake up Wait(), so report it here.
+            TransferFailed(kOutEndpoint, LIBUSB_TRANSFER_TIMED_OUT);
+          }
+          CompleteRequest(REQUEST_TIMED_OUT, NULL, 0);
+          continue;
+        }
+        // This copies the request into the out buffer, so the slot is free
+        // once it returns.
+        ok = request->kind == STREAM ? StartStream(*request) :
+             StartRequest(*request);
+        m_commands.Pop();
+      }
+      if (ok) {
+        return;
+      }
+
+      // Wake up Wait(), since there's no transfer to report the failure.
+      RequestStatus status = REQUEST_DEVICE_LOST;
+      if (!DeviceIsLost()) {
+        TransferFailed(kOutEndpoint, LIBUSB_TRANSFER_ERROR);
+        status = REQUEST_FAILED;
+      }
+      CompleteRequest(status, NULL, 0);
+    }
+  }
+
+  /**
+   * Submit the last frame again.
+   */
+  bool StartResend() {
+    if (m_last_was_stream) {
+      // The out transfer holds a chunk of the stream, not a request.
+      return false;
+    }
+    // The out transfer still points at the last frame.
+    m_active_callback = NULL;
+    m_active_data = NULL;
+    gettimeofday(&m_send_out_time, NULL);
+    m_active_start = m_send_out_time;
+    struct timeval delta = {kTimeout / 1000, (kTimeout % 1000) * 1000};
+    timeradd(&m_active_start, &delta, &m_active_deadline);
+    m_out_transfer->timeout = kTimeout;
+    if (m_verbose) {
+      cout << "Resending " << std::dec << m_out_transfer->length
+           << " bytes at " << m_send_out_time << endl;
+    }
+    return SubmitTransfer(m_out_transfer);
+  }
+
+  bool SubmitInTransfer() {
+    libusb_fill_bulk_transfer(m_in_transfer, m_device, kInEndpoint,
+                                   m_in_buffer, IN_BUFFER_SIZE,
+                                   InTransferCompleteHandler,
+                                   static_cast<void*>(this),
+                                   RemainingTimeout());
+    gettimeofday(&m_send_in_time, NULL);
+    if (!SubmitTransfer(m_in_transfer)) {
+      return false;
+    }
+    if (m_verbose) {
+      cout << "Submitted in transfer at " << m_send_in_time << endl;
+    }
+    return true;
+  }
+
+  bool SubmitTransfer(libusb_transfer *transfer) {
+    pthread_mutex_lock(&m_mutex);
+    int r = libusb_submit_transfer(transfer);
+    if (r == LIBUSB_ERROR_NOT_SUPPORTED &&
+        (transfer->flags & LIBUSB_TRANSFER_ADD_ZERO_PACKET)) {
+      // Only some platforms can send zero length packets, pad the frame and
+      // do that from now on.
+      cerr << "Zero length packets aren't supported for " << m_device
+           << ", padding frames instead" << endl;
+      m_termination = PAD_TERMINATION;
+      transfer->flags &= ~LIBUSB_TRANSFER_ADD_ZERO_PACKET;
+      transfer->buffer[transfer->length++] = 0;
+      r = libusb_submit_transfer(transfer);
+    }
+    if (r == 0) {
+      m_pending_transfers++;
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    if (r == LIBUSB_ERROR_NO_DEVICE) {
+      DeviceLost();
+    } else if (r) {
+      cerr << "Failed to submit "
+           << (transfer == m_out_transfer ? "out" : "input") << " transfer: "
+           << libusb_error_name(r) << endl;
+    }
+    return r == 0;
+  }
+
+  void TransferDone() {
+    // Signal with the lock held, the destructor may be waiting on this.
+    pthread_mutex_lock(&m_mutex);
+    m_pending_transfers--;
+    pthread_cond_broadcast(&m_condition);
+    pthread_mutex_unlock(&m_mutex);
+  }
+
+  void TransferFailed(uint8_t endpoint, libusb_transfer_status status) {
+    // Cancellation is something we asked for, not a failure.
+    if (status == LIBUSB_TRANSFER_CANCELLED) {
+      return;
+    }
+    pthread_mutex_lock(&m_mutex);
+    m_failed = true;
+    m_failed_endpoint = endpoint;
+    m_failed_status = status;
+    pthread_mutex_unlock(&m_mutex);
+    pthread_cond_broadcast(&m_condition);
+  }
+
+  void DeviceLost() {
+    pthread_mutex_lock(&m_mutex);
+    bool already_lost = m_device_lost;
+    m_device_lost = true;
+    pthread_mutex_unlock(&m_mutex);
+    pthread_cond_broadcast(&m_condition);
+
+    if (!already_lost) {
+      cerr << "Device " << m_device << " has gone away" << endl;
+      if (m_disconnect_callback) {
+        m_disconnect_callback(m_disconnect_data);
+      }
+    }
+  }
+
+  UsbSender(const UsbSender&);
+  UsbSender& operator=(const UsbSender&);
+};
+
+void InTransferCompleteHandler(struct libusb_transfer *transfer) {
   UsbSender *sender = static_cast<UsbSender*>(transfer->user_data);
   return sender->_InTransferComplete();
 }
 
-void OutTransferCompleteHandler(struct libusb_transfer *transfer) {
-  UsbSender *sender = static_cast<UsbSender*>(transfer->user_data);
-  return sender->_OutTransferComplete();
+void OutTransferCompleteHandler(struct libusb_transfer *transfer) {
+  UsbSender *sender = static_cast<UsbSender*>(transfer->user_data);
+  return sender->_OutTransferComplete();
+}
+
+void StreamInCompleteHandler(struct libusb_transfer *transfer) {
+  UsbSender::StreamSlot *slot =
+      static_cast<UsbSender::StreamSlot*>(transfer->user_data);
+  return slot->sender->_StreamInComplete(slot);
+}
+
+void StreamOutCompleteHandler(struct libusb_transfer *transfer) {
+  UsbSender::StreamSlot *slot =
+      static_cast<UsbSender::StreamSlot*>(transfer->user_data);
+  return slot->sender->_StreamOutComplete(slot);
+}
+
+void ProcessCommandsHandler(void *user_data) {
+  UsbSender *sender = static_cast<UsbSender*>(user_data);
+  return sender->_ProcessCommands();
+}
+
+/**
+ * A completed request, with its own copy of the response.
+ *
+ * The sender itself doesn't allocate, but Set() copies the payload into a
+ * string, which allocates whenever the payload doesn't fit in its current
+ * capacity. A Response that's reused, e.g. in a CompletionQueue::Entry, only
+ * allocates the first time, or never if data.reserve() was called up front.
+ */
+struct Response {
+  Response() : status(REQUEST_FAILED) { timerclear(&latency); }
+
+  RequestStatus status;
+  string data;
+  struct timeval latency;
+
+  void Set(const RequestResult &result) {
+    status = result.status;
+    data.assign(reinterpret_cast<const char*>(result.data), result.size);
+    latency = result.latency;
+  }
+};
+
+/**
+ * A file descriptor that becomes readable when Notify() is called.
+ *
+ * This is an eventfd on Linux and a pipe elsewhere. Notifications coalesce,
+ * so one Drain() clears any number of Notify() calls.
+ */
+class EventNotifier {
+ public:
+  EventNotifier()
+      : m_read_fd(-1),
+        m_write_fd(-1) {
+#ifdef __linux__
+    m_read_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    m_write_fd = m_read_fd;
+#else
+    int fds[2];
+    if (pipe(fds) == 0) {
+      for (unsigned int i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+      }
+      m_read_fd = fds[0];
+      m_write_fd = fds[1];
+    }
+#endif
+    if (m_read_fd < 0) {
+      cerr << "Failed to create notifier: " << strerror(errno) << endl;
+    }
+  }
+
+  ~EventNotifier() {
+    if (m_write_fd >= 0 && m_write_fd != m_read_fd) {
+      close(m_write_fd);
+    }
+    if (m_read_fd >= 0) {
+      close(m_read_fd);
+    }
+  }
+
+  /**
+   * The descriptor to poll / epoll for readability.
+   */
+  int Fd() const { return m_read_fd; }
+
+  void Notify() {
+#ifdef __linux__
+    uint64_t value = 1;
+#else
+    uint8_t value = 1;
+#endif
+    // A full pipe or counter is already readable, so failure is harmless.
+    ssize_t r = write(m_write_fd, &value, sizeof(value));
+    (void) r;
+  }
+
+  void Drain() {
+    uint8_t buffer[64];
+    while (read(m_read_fd, buffer, sizeof(buffer)) > 0) {
+#ifdef __linux__
+      // An eventfd is cleared by a single read.
+      break;
+#endif
+    }
+  }
+
+  /**
+   * Block until the descriptor is readable.
+   * @param timeout the time to wait in ms, or -1 to wait forever.
+   * @returns false if the timeout expired.
+   */
+  bool WaitFor(int timeout) {
+    struct pollfd poll_fd;
+    poll_fd.fd = m_read_fd;
+    poll_fd.events = POLLIN;
+    poll_fd.revents = 0;
+    int r;
+    do {
+      r = poll(&poll_fd, 1, timeout);
+    } while (r < 0 && errno == EINTR);
+    return r > 0;
+  }
+
+ private:
+  int m_read_fd;
+  int m_write_fd;
+
+  EventNotifier(const EventNotifier&);
+  EventNotifier& operator=(const EventNotifier&);
+};
+
+/**
+ * Collects completed requests from the libusb thread for a consumer thread.
+ *
+ * The eventfd is only written when the queue goes from empty to non-empty,
+ * so a burst of completions costs a single wakeup. Next() spins briefly
+ * before sleeping, since a response is often only microseconds away. To
+ * use the queue from an event loop instead, add Fd() to poll / epoll and
+ * when it's readable call Drain() and then TryNext() until it returns NULL.
+ *
+ *   CompletionQueue queue;
+ *   CompletionQueue::Entry entries[2];
+ *   queue.Send(sender, &entries[0], UsbSender::ECHO_COMMAND, data, size,
+ *              kTimeout);
+ *   queue.Send(sender, &entries[1], UsbSender::ECHO_COMMAND, data, size,
+ *              kTimeout);
+ *   CompletionQueue::Entry *entry = queue.Next(-1);
+ */
+class CompletionQueue {
+ public:
+  /**
+   * A request tracked by the queue, this must outlive the request.
+   */
+  struct Entry {
+    Entry() : tag(NULL), queue(NULL), next(NULL) {}
+
+    // For the caller's use.
+    void *tag;
+    Response response;
+
+   private:
+    CompletionQueue *queue;
+    Entry *next;
+
+    friend class CompletionQueue;
+  };
+
+  CompletionQueue()
+      : m_head(NULL),
+        m_tail(NULL),
+        m_size(0) {
+    pthread_mutex_init(&m_mutex, NULL);
+  }
+
+  ~CompletionQueue() {
+    pthread_mutex_destroy(&m_mutex);
+  }
+
+  int Fd() const { return m_notifier.Fd(); }
+
+  void Drain() { m_notifier.Drain(); }
+
+  /**
+   * Send a request, the entry is added to the queue when it completes.
+   * @returns false if the request couldn't be sent.
+   */
+  bool Send(UsbSender *sender, Entry *entry, uint16_t command,
+            const uint8_t *data, unsigned int size, unsigned int timeout) {
+    entry->queue = this;
+    entry->next = NULL;
+    return sender->SendRequest(command, data, size, timeout, CompleteHandler,
+                               static_cast<void*>(entry));
+  }
+
+  /**
+   * @returns the next completed entry, or NULL if there aren't any.
+   */
+  Entry *TryNext() {
+    if (m_size.load(std::memory_order_acquire) == 0) {
+      return NULL;
+    }
+    pthread_mutex_lock(&m_mutex);
+    Entry *entry = m_head;
+    if (entry) {
+      m_head = entry->next;
+      if (!m_head) {
+        m_tail = NULL;
+      }
+      m_size.fetch_sub(1, std::memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&m_mutex);
+    return entry;
+  }
+
+  /**
+   * Wait for the next completed entry.
+   * @param timeout the time to wait in ms, or -1 to wait forever.
+   * @returns the entry, or NULL if the timeout expired.
+   */
+  Entry *Next(int timeout) {
+    for (unsigned int i = 0; i < kCompletionSpins; i++) {
+      Entry *entry = TryNext();
+      if (entry) {
+        return entry;
+      }
+    }
+
+    // Draining before checking the list means a completion that arrives in
+    // between leaves the descriptor readable, rather than being missed.
+    while (true) {
+      m_notifier.Drain();
+      Entry *entry = TryNext();
+      if (entry) {
+        return entry;
+      }
+      if (!m_notifier.WaitFor(timeout)) {
+        return NULL;
+      }
+    }
+  }
+
+ private:
+  EventNotifier m_notifier;
+  pthread_mutex_t m_mutex;
+  Entry *m_head;  // GUARDED_BY(m_mutex)
+  Entry *m_tail;  // GUARDED_BY(m_mutex)
+  std::atomic<unsigned int> m_size;
+
+  void Push(Entry *entry) {
+    pthread_mutex_lock(&m_mutex);
+    if (m_tail) {
+      m_tail->next = entry;
+    } else {
+      m_head = entry;
+    }
+    m_tail = entry;
+    bool was_empty = m_size.fetch_add(1, std::memory_order_release) == 0;
+    pthread_mutex_unlock(&m_mutex);
+
+    if (was_empty) {
+      m_notifier.Notify();
+    }
+  }
+
+  static void CompleteHandler(void *user_data, const RequestResult &result) {
+    Entry *entry = static_cast<Entry*>(user_data);
+    entry->response.Set(result);
+    entry->queue->Push(entry);
+  }
+
+  CompletionQueue(const CompletionQueue&);
+  CompletionQueue& operator=(const CompletionQueue&);
+};
+
+/**
+ * A handle to a single outstanding request, which can be waited on.
+ *
+ * Unlike UsbSender::Wait(), each RequestFuture tracks exactly one request,
+ * so many can be outstanding at once. The future must outlive the request.
+ *
+ * Get() spins briefly before sleeping, and the libusb thread only takes the
+ * lock to signal if a waiter has gone to sleep.
+ *
+ *   RequestFuture future;
+ *   if (future.Send(sender, UsbSender::ECHO_COMMAND, data, size, 100)) {
+ *     const Response &response = future.Get();
+ *   }
+ */
+class RequestFuture {
+ public:
+  RequestFuture()
+      : m_state(PENDING),
+        m_signalled(false) {
+    pthread_mutex_init(&m_mutex, NULL);
+    pthread_cond_init(&m_condition, NULL);
+  }
+
+  ~RequestFuture() {
+    pthread_mutex_destroy(&m_mutex);
+    pthread_cond_destroy(&m_condition);
+  }
+
+  /**
+   * Send a request, this future then tracks it.
+   * @param timeout the time in ms to wait for the response.
+   * @returns false if the request couldn't be sent.
+   */
+  bool Send(UsbSender *sender, uint16_t command, const uint8_t *data,
+            unsigned int size, unsigned int timeout) {
+    m_state = PENDING;
+    m_signalled = false;
+    return sender->SendRequest(command, data, size, timeout, CompleteHandler,
+                               static_cast<void*>(this));
+  }
+
+  /**
+   * Send a stream, see UsbSender::SendStream().
+   */
+  bool SendStream(UsbSender *sender, uint16_t command, const uint8_t *data,
+                  unsigned int size, unsigned int timeout) {
+    m_state = PENDING;
+    m_signalled = false;
+    return sender->SendStream(command, data, size, timeout, CompleteHandler,
+                              static_cast<void*>(this));
+  }
+
+  bool IsDone() const {
+    return m_state == DONE;
+  }
+
+  /**
+   * Wait for the request to complete.
+   */
+  const Response& Get() {
+    for (unsigned int i = 0; i < kCompletionSpins; i++) {
+      if (m_state == DONE) {
+        return m_response;
+      }
+    }
+
+    int expected = PENDING;
+    if (!m_state.compare_exchange_strong(expected, SLEEPING)) {
+      return m_response;
+    }
+    pthread_mutex_lock(&m_mutex);
+    while (!m_signalled) {
+      pthread_cond_wait(&m_condition, &m_mutex);
+    }
+    pthread_mutex_unlock(&m_mutex);
+    return m_response;
+  }
+
+ private:
+  pthread_mutex_t m_mutex;
+  pthread_cond_t m_condition;
+  enum { PENDING, SLEEPING, DONE };
+
+  std::atomic<int> m_state;
+  // Once a waiter is asleep it only returns after this is set, so the
+  // future can't be destroyed while the libusb thread is still using it.
+  bool m_signalled;  // GUARDED_BY(m_mutex)
+  Response m_response;
+
+  static void CompleteHandler(void *user_data, const RequestResult &result) {
+    RequestFuture *future = static_cast<RequestFuture*>(user_data);
+    future->m_response.Set(result);
+    if (future->m_state.exchange(DONE) != SLEEPING) {
+      // Don't touch the future after this, the waiter may have returned.
+      return;
+    }
+    pthread_mutex_lock(&future->m_mutex);
+    future->m_signalled = true;
+    pthread_cond_signal(&future->m_condition);
+    pthread_mutex_unlock(&future->m_mutex);
+  }
+
+  RequestFuture(const RequestFuture&);
+  RequestFuture& operator=(const RequestFuture&);
+};
+
+#ifdef __cpp_impl_coroutine
+/**
+ * Awaits the response to a request, see UsbSender::Request().
+ *
+ * The coroutine is resumed directly from the libusb completion callback, so
+ * it continues on the libusb thread. There is no thread or condition
+ * variable per request, so many requests can be outstanding at once.
+ */
+class RequestAwaiter {
+ public:
+  RequestAwaiter(UsbSender *sender, uint16_t command, const uint8_t *data,
+                 unsigned int size)
+      : m_sender(sender),
+        m_command(command),
+        m_data(data),
+        m_size(size) {
+  }
+
+  bool await_ready() const { return false; }
+
+  bool await_suspend(std::coroutine_handle<> handle) {
+    m_handle = handle;
+    // Once the request is sent, the callback may resume the coroutine on
+    // the libusb thread at any time, so nothing can be touched after this.
+    return m_sender->SendRequest(m_command, m_data, m_size, ResponseHandler,
+                                 static_cast<void*>(this));
+  }
+
+  Response await_resume() { return m_response; }
+
+ private:
+  UsbSender *m_sender;
+  uint16_t m_command;
+  const uint8_t *m_data;
+  unsigned int m_size;
+  std::coroutine_handle<> m_handle;
+  Response m_response;
+
+  static void ResponseHandler(void *user_data, const RequestResult &result) {
+    RequestAwaiter *awaiter = static_cast<RequestAwaiter*>(user_data);
+    awaiter->m_response.Set(result);
+    awaiter->m_handle.resume();
+  }
+};
+
+RequestAwaiter UsbSender::Request(uint16_t command, const uint8_t *data,
+                                  unsigned int size) {
+  return RequestAwaiter(this, command, data, size);
+}
+
+RequestAwaiter UsbSender::Request(uint16_t command, const string &payload) {
+  return RequestAwaiter(this, command,
+                        reinterpret_cast<const uint8_t*>(payload.data()),
+                        payload.size());
+}
+
+/**
+ * A coroutine that runs to completion without anyone waiting on it.
+ */
+struct DetachedTask {
+  struct promise_type {
+    DetachedTask get_return_object() { return DetachedTask(); }
+    std::suspend_never initial_suspend() { return std::suspend_never(); }
+    std::suspend_never final_suspend() noexcept {
+      return std::suspend_never();
+    }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+/**
+ * Counts down as the echo tasks finish.
+ */
+struct EchoCounter {
+  pthread_mutex_t mutex;
+  pthread_cond_t condition;
+  unsigned int remaining;  // GUARDED_BY(mutex)
+  unsigned int matched;  // GUARDED_BY(mutex)
+};
+
+/**
+ * Send an echo request and check the response contains our payload.
+ */
+DetachedTask EchoTask(UsbSender *sender, unsigned int id,
+                      EchoCounter *counter) {
+  std::ostringstream str;
+  str << "echo " << id;
+  const string payload = str.str();
+
+  Response response = co_await sender->Request(UsbSender::ECHO_COMMAND,
+                                               payload);
+
+  pthread_mutex_lock(&counter->mutex);
+  if (response.status == REQUEST_OK &&
+      response.data.find(payload) != string::npos) {
+    counter->matched++;
+  }
+  counter->remaining--;
+  pthread_cond_signal(&counter->condition);
+  pthread_mutex_unlock(&counter->mutex);
+}
+
+/**
+ * Run a number of echo requests concurrently.
+ * @returns the number that were echoed back correctly.
+ */
+unsigned int RunEchoTasks(UsbSender *sender, unsigned int count) {
+  EchoCounter counter;
+  pthread_mutex_init(&counter.mutex, NULL);
+  pthread_cond_init(&counter.condition, NULL);
+  counter.remaining = count;
+  counter.matched = 0;
+
+  for (unsigned int i = 0; i < count; i++) {
+    EchoTask(sender, i, &counter);
+  }
+
+  pthread_mutex_lock(&counter.mutex);
+  while (counter.remaining) {
+    pthread_cond_wait(&counter.condition, &counter.mutex);
+  }
+  unsigned int matched = counter.matched;
+  pthread_mutex_unlock(&counter.mutex);
+
+  pthread_mutex_destroy(&counter.mutex);
+  pthread_cond_destroy(&counter.condition);
+  return matched;
+}
+#endif
+
+void *StartThread(void *d) {
+  LibUsbThread *thread = static_cast<LibUsbThread*>(d);
+  return thread->_InternalRun();
+}
+
+bool IsInteresting(libusb_device *device) {
+  struct libusb_device_descriptor device_descriptor;
+  libusb_get_device_descriptor(device, &device_descriptor);
+
+  cout << "Checking vendor 0x" << std::hex << std::setw(4) << std::setfill('0')
+       << device_descriptor.idVendor << ", product 0x" << std::setw(4)
+       << device_descriptor.idProduct << endl;
+
+  return device_descriptor.idVendor == kVendorId &&
+         device_descriptor.idProduct == kProductId;
+}
+
+/**
+ * @returns the bus & port path of a device, e.g. 1-2.3
+ */
+string GetPortPath(libusb_device *device) {
+  // USB 3.0 allows up to 7 levels of ports.
+  uint8_t ports[7];
+  int count = libusb_get_port_numbers(device, ports, arraysize(ports));
+  std::ostringstream str;
+  str << static_cast<int>(libusb_get_bus_number(device));
+  for (int i = 0; i < count; i++) {
+    str << (i ? "." : "-") << static_cast<int>(ports[i]);
+  }
+  return str.str();
+}
+
+/**
+ * @returns the device's serial number, or the empty string if it doesn't have
+ *   one.
+ */
+string ReadSerialNumber(libusb_device_handle *handle) {
+  struct libusb_device_descriptor device_descriptor;
+  libusb_get_device_descriptor(libusb_get_device(handle), &device_descriptor);
+  if (!device_descriptor.iSerialNumber) {
+    return "";
+  }
+
+  unsigned char serial[256];
+  int r = libusb_get_string_descriptor_ascii(
+      handle, device_descriptor.iSerialNumber, serial, sizeof(serial));
+  if (r < 0) {
+    cerr << "Failed to read serial number: " << libusb_error_name(r) << endl;
+    return "";
+  }
+  return string(reinterpret_cast<char*>(serial), r);
+}
+
+/**
+ * Counters for the recovery path.
+ */
+struct RecoveryMetrics {
+  RecoveryMetrics()
+      : halts_cleared(0),
+        resets(0),
+        recoveries(0),
+        failed_recoveries(0) {
+    timerclear(&last_latency);
+    timerclear(&max_latency);
+    timerclear(&total_latency);
+  }
+
+  unsigned int halts_cleared;
+  unsigned int resets;
+  unsigned int recoveries;
+  unsigned int failed_recoveries;
+  struct timeval last_latency;
+  struct timeval max_latency;
+  struct timeval total_latency;
+
+  void RecordLatency(const struct timeval &start) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    timersub(&now, &start, &last_latency);
+    timeradd(&total_latency, &last_latency, &total_latency);
+    if (timercmp(&last_latency, &max_latency, >)) {
+      max_latency = last_latency;
+    }
+  }
+};
+
+ostream& operator<<(std::ostream &out, const RecoveryMetrics &metrics) {
+  return out << "Recoveries: " << std::dec << metrics.recoveries
+             << ", failed: " << metrics.failed_recoveries
+             << ", halts cleared: " << metrics.halts_cleared
+             << ", resets: " << metrics.resets
+             << ", last latency: " << metrics.last_latency
+             << ", max latency: " << metrics.max_latency;
+}
+
+/**
+ * A frame of DMX received by the widget.
+ */
+struct DmxSnapshot {
+  // The widget's port the frame arrived on.
+  uint8_t port;
+  // The widget's receive status, 0 if the frame was good.
+  uint8_t status;
+  // When the widget saw the break, in us on the widget's clock. This wraps.
+  uint32_t device_time;
+  // When the transfer carrying the frame completed.
+  struct timeval arrival;
+  // Counts every frame received, on any port, from 1.
+  uint64_t sequence;
+  // True if this is the first frame on the port, or the data differs from
+  // the frame before.
+  bool changed;
+  // The start code and the slots.
+  unsigned int size;
+  uint8_t data[kDmxUniverseSize + 1];
+};
+
+/**
+ * Holds the DMX a widget receives.
+ *
+ * Frames are added from the libusb thread, to a ring of the last kRxRingSize
+ * frames across all ports, and the latest frame for each port is kept as
+ * well. Readers follow the ring with their own cursor, so any number of them
+ * can, and a reader that falls behind is told how many frames it missed.
+ * Subscribers are called when the data on a port changes.
+ */
+class DmxInput {
+ public:
+  // Called, from the libusb thread, when the data on a port changes.
+  typedef void (*ChangeCallback)(void *user_data,
+                                 const DmxSnapshot &snapshot);
+
+  DmxInput()
+      : m_ring(new DmxSnapshot[kRxRingSize]),
+        m_next_sequence(1),
+        m_changes(0) {
+    pthread_mutex_init(&m_mutex, NULL);
+    pthread_mutex_init(&m_subscriber_mutex, NULL);
+    for (unsigned int port = 0; port < kMaxDmxPorts; port++) {
+      m_latest[port].sequence = 0;
+    }
+  }
+
+  ~DmxInput() {
+    delete[] m_ring;
+    pthread_mutex_destroy(&m_subscriber_mutex);
+    pthread_mutex_destroy(&m_mutex);
+  }
+
+  void Subscribe(ChangeCallback callback, void *user_data) {
+    Subscriber subscriber = {callback, user_data};
+    pthread_mutex_lock(&m_subscriber_mutex);
+    m_subscribers.push_back(subscriber);
+    pthread_mutex_unlock(&m_subscriber_mutex);
+  }
+
+  /**
+   * Once this returns the callback isn't running and won't be run again.
+   * Must not be called from a ChangeCallback.
+   */
+  void Unsubscribe(ChangeCallback callback, void *user_data) {
+    pthread_mutex_lock(&m_subscriber_mutex);
+    for (std::vector<Subscriber>::iterator iter = m_subscribers.begin();
+         iter != m_subscribers.end(); ++iter) {
+      if (iter->callback == callback && iter->user_data == user_data) {
+        m_subscribers.erase(iter);
+        break;
+      }
+    }
+    pthread_mutex_unlock(&m_subscriber_mutex);
+  }
+
+  /**
+   * Copy the next frame after the cursor.
+   * @param cursor the sequence number of the last frame read, start with 0.
+   *   This is advanced past the frame returned.
+   * @param missed if not NULL, set to the number of frames that were
+   *   overwritten before they were read.
+   * @returns false if there are no new frames.
+   */
+  bool Read(uint64_t *cursor, DmxSnapshot *snapshot, uint64_t *missed) {
+    pthread_mutex_lock(&m_mutex);
+    const uint64_t oldest = m_next_sequence > kRxRingSize ?
+        m_next_sequence - kRxRingSize : 1;
+    const uint64_t next = std::max(*cursor + 1, oldest);
+    if (missed) {
+      *missed = next - (*cursor + 1);
+    }
+    if (next >= m_next_sequence) {
+      pthread_mutex_unlock(&m_mutex);
+      return false;
+    }
+    *snapshot = m_ring[next % kRxRingSize];
+    *cursor = next;
+    pthread_mutex_unlock(&m_mutex);
+    return true;
+  }
+
+  /**
+   * Copy the last frame received on a port.
+   * @returns false if nothing has been received on the port.
+   */
+  bool Latest(uint8_t port, DmxSnapshot *snapshot) {
+    if (port >= kMaxDmxPorts) {
+      return false;
+    }
+    pthread_mutex_lock(&m_mutex);
+    const bool received = m_latest[port].sequence != 0;
+    if (received) {
+      *snapshot = m_latest[port];
+    }
+    pthread_mutex_unlock(&m_mutex);
+    return received;
+  }
+
+  uint64_t Frames() {
+    pthread_mutex_lock(&m_mutex);
+    uint64_t frames = m_next_sequence - 1;
+    pthread_mutex_unlock(&m_mutex);
+    return frames;
+  }
+
+  uint64_t Changes() {
+    pthread_mutex_lock(&m_mutex);
+    uint64_t changes = m_changes;
+    pthread_mutex_unlock(&m_mutex);
+    return changes;
+  }
+
+  /**
+   * Add a frame, this is run on the libusb thread.
+   */
+  void _AddFrame(uint8_t port, uint8_t status, uint32_t device_time,
+                 const struct timeval &arrival, const uint8_t *data,
+                 unsigned int size) {
+    pthread_mutex_lock(&m_mutex);
+    DmxSnapshot *snapshot = &m_ring[m_next_sequence % kRxRingSize];
+    snapshot->port = port;
+    snapshot->status = status;
+    snapshot->device_time = device_time;
+    snapshot->arrival = arrival;
+    snapshot->sequence = m_next_sequence++;
+    snapshot->size = size;
+    memcpy(snapshot->data, data, size);
+
+    DmxSnapshot *latest = &m_latest[port];
+    snapshot->changed = latest->sequence == 0 || latest->size != size ||
+                        memcmp(latest->data, data, size) != 0;
+    if (snapshot->changed) {
+      m_changes++;
+    }
+    *latest = *snapshot;
+    pthread_mutex_unlock(&m_mutex);
+
+    if (latest->changed) {
+      // Only this thread writes m_latest, so it's safe to use unlocked.
+      pthread_mutex_lock(&m_subscriber_mutex);
+      for (unsigned int i = 0; i < m_subscribers.size(); i++) {
+        m_subscribers[i].callback(m_subscribers[i].user_data, *latest);
+      }
+      pthread_mutex_unlock(&m_subscriber_mutex);
+    }
+  }
+
+ private:
+  struct Subscriber {
+    ChangeCallback callback;
+    void *user_data;
+  };
+
+  pthread_mutex_t m_mutex;
+  DmxSnapshot *m_ring;  // GUARDED_BY(m_mutex)
+  DmxSnapshot m_latest[kMaxDmxPorts];  // GUARDED_BY(m_mutex)
+  uint64_t m_next_sequence;  // GUARDED_BY(m_mutex)
+  uint64_t m_changes;  // GUARDED_BY(m_mutex)
+  // Held while the subscribers run, so they can be removed safely.
+  pthread_mutex_t m_subscriber_mutex;
+  std::vector<Subscriber> m_subscribers;  // GUARDED_BY(m_subscriber_mutex)
+
+  DmxInput(const DmxInput&);
+  DmxInput& operator=(const DmxInput&);
+};
+
+void RxTransferCompleteHandler(struct libusb_transfer *transfer);
+
+/**
+ * Keeps IN transfers queued on a widget's RX endpoint, and adds the frames
+ * they carry to a DmxInput.
+ *
+ * With kRxTransfers queued there's always one waiting while the last is
+ * decoded, so the widget never has to hold a frame back. Each frame is
+ * timestamped when its transfer completes, alongside the widget's own
+ * timestamp.
+ *
+ * A transfer that fails is resubmitted, until kMaxRxFailures fail in a row.
+ * A stall, or that many failures, stops the receiver and Failed() returns
+ * true. Clearing a halt is synchronous, so it can't be done from the libusb
+ * thread, and ReconnectManager::EnableRx() starts a new receiver instead.
+ */
+class DmxReceiver {
+ public:
+  DmxReceiver(TransferPool *pool, libusb_device_handle *device,
+              DmxInput *input)
+      : m_pool(pool),
+        m_device(device),
+        m_input(input),
+        m_running(false),
+        m_failed(false),
+        m_pending(0),
+        m_malformed(0),
+        m_failures(0) {
+    pthread_mutex_init(&m_mutex, NULL);
+    pthread_cond_init(&m_condition, NULL);
+    for (unsigned int i = 0; i < kRxTransfers; i++) {
+      m_entries[i] = m_pool->Acquire();
+    }
+  }
+
+  ~DmxReceiver() {
+    Stop();
+    for (unsigned int i = 0; i < kRxTransfers; i++) {
+      m_pool->Release(m_entries[i]);
+    }
+    pthread_mutex_destroy(&m_mutex);
+    pthread_cond_destroy(&m_condition);
+  }
+
+  /**
+   * Submit the IN transfers.
+   * @returns false if there weren't enough transfers in the pool, or none
+   *   could be submitted.
+   */
+  bool Start() {
+    for (unsigned int i = 0; i < kRxTransfers; i++) {
+      if (!m_entries[i]) {
+        cerr << "Transfer pool exhausted" << endl;
+        return false;
+      }
+    }
+
+    pthread_mutex_lock(&m_mutex);
+    m_running = true;
+    for (unsigned int i = 0; i < kRxTransfers; i++) {
+      // No timeout, the transfer waits for as long as it takes.
+      libusb_fill_bulk_transfer(m_entries[i]->transfer, m_device,
+                                kRxEndpoint, m_entries[i]->buffer,
+                                TransferPool::BUFFER_SIZE,
+                                RxTransferCompleteHandler,
+                                static_cast<void*>(this), 0);
+      int r = libusb_submit_transfer(m_entries[i]->transfer);
+      if (r) {
+        cerr << "Failed to submit RX transfer: " << libusb_error_name(r)
+             << endl;
+        continue;
+      }
+      m_pending++;
+    }
+    m_running = m_pending != 0;
+    const bool running = m_running;
+    pthread_mutex_unlock(&m_mutex);
+    return running;
+  }
+
+  /**
+   * Cancel the transfers and wait for them to complete. Must not be called
+   * from the libusb thread.
+   */
+  void Stop() {
+    pthread_mutex_lock(&m_mutex);
+    m_running = false;
+    if (m_pending) {
+      for (unsigned int i = 0; i < kRxTransfers; i++) {
+        if (m_entries[i]) {
+          libusb_cancel_transfer(m_entries[i]->transfer);
+        }
+      }
+    }
+    while (m_pending) {
+      pthread_cond_wait(&m_condition, &m_mutex);
+    }
+    pthread_mutex_unlock(&m_mutex);
+  }
+
+  // The number of times a transfer had something other than a well formed
+  // RX_DMX frame where one should start.
+  unsigned int Malformed() const { return m_malformed; }
+
+  /**
+   * @returns true if the transfers stopped because they failed, rather than
+   *   because of Stop().
+   */
+  bool Failed() {
+    pthread_mutex_lock(&m_mutex);
+    const bool failed = m_failed;
+    pthread_mutex_unlock(&m_mutex);
+    return failed;
+  }
+
+  /**
+   * Add each of the frames in a transfer to the input. The widget may pack
+   * several frames into one transfer.
+   * @returns the number of times something other than a well formed RX_DMX
+   *   frame was found where one should start.
+   */
+  static unsigned int Decode(DmxInput *input, const uint8_t *data,
+                             unsigned int length,
+                             const struct timeval &arrival) {
+    unsigned int malformed = 0;
+    bool resynchronizing = false;
+    while (length) {
+      const uint8_t *payload;
+      unsigned int size;
+      unsigned int frame_size;
+      if (!UsbSender::ParseFrame(data, length, UsbSender::RX_DMX, &payload,
+                                 &size, &frame_size) ||
+          size < RX_HEADER_SIZE ||
+          size > RX_HEADER_SIZE + kDmxUniverseSize + 1 ||
+          payload[0] >= kMaxDmxPorts) {
+        // A corrupt length leaves us in the middle of a frame, so skip to
+        // the next SOF and try again from there. The slots may contain SOFs
+        // too, which won't parse, so only the first miss is counted.
+        if (!resynchronizing) {
+          malformed++;
+          resynchronizing = true;
+        }
+        const uint8_t *next = UsbSender::FindNextFrame(data, length);
+        if (!next) {
+          return malformed;
+        }
+        length -= next - data;
+        data = next;
+        continue;
+      }
+      resynchronizing = false;
+      input->_AddFrame(payload[0], payload[1],
+                       UsbSender::ReadLittleEndian(payload + 2), arrival,
+                       payload + RX_HEADER_SIZE, size - RX_HEADER_SIZE);
+
+      data += frame_size;
+      length -= frame_size;
+      // A frame that fills a whole number of packets may be padded.
+      if (length && data[0] == 0) {
+        data++;
+        length--;
+      }
+    }
+    return malformed;
+  }
+
+  void _TransferComplete(struct libusb_transfer *transfer) {
+    struct timeval arrival;
+    gettimeofday(&arrival, NULL);
+
+    bool resubmit = true;
+    bool failed = false;
+    switch (transfer->status) {
+      case LIBUSB_TRANSFER_COMPLETED:
+        m_malformed += Decode(m_input, transfer->buffer,
+                              transfer->actual_length, arrival);
+        m_failures = 0;
+        break;
+      case LIBUSB_TRANSFER_CANCELLED:
+      case LIBUSB_TRANSFER_NO_DEVICE:
+        resubmit = false;
+        break;
+      case LIBUSB_TRANSFER_STALL:
+        // This fails again until the halt is cleared.
+        cerr << "RX endpoint stalled" << endl;
+        resubmit = false;
+        failed = true;
+        break;
+      default:
+        // Timeouts and errors may be transient.
+        cerr << "RX transfer failed: " << TransferStatusName(transfer->status)
+             << endl;
+        m_failures++;
+        failed = m_failures >= kMaxRxFailures;
+        resubmit = !failed;
+    }
+
+    // The buffer has been decoded, so it can go straight back to the widget.
+    pthread_mutex_lock(&m_mutex);
+    if (failed && m_running) {
+      cerr << "RX stopped, EnableRx() restarts it" << endl;
+      m_running = false;
+      m_failed = true;
+    }
+    if (m_running && resubmit && libusb_submit_transfer(transfer) == 0) {
+      pthread_mutex_unlock(&m_mutex);
+      return;
+    }
+    // Signal with the lock held, Stop() may be waiting on this.
+    m_pending--;
+    pthread_cond_broadcast(&m_condition);
+    pthread_mutex_unlock(&m_mutex);
+  }
+
+ private:
+  // The port, status and timestamp, before the start code.
+  static const unsigned int RX_HEADER_SIZE = 6;
+  TransferPool *m_pool;
+  libusb_device_handle *m_device;
+  DmxInput *m_input;
+  TransferPool::Entry *m_entries[kRxTransfers];
+  pthread_mutex_t m_mutex;
+  pthread_cond_t m_condition;
+  bool m_running;  // GUARDED_BY(m_mutex)
+  bool m_failed;  // GUARDED_BY(m_mutex)
+  unsigned int m_pending;  // GUARDED_BY(m_mutex)
+  // Counted on the libusb thread, and read by Malformed() from any thread.
+  std::atomic<unsigned int> m_malformed;
+  // Failed transfers in a row, only used on the libusb thread.
+  unsigned int m_failures;
+
+  DmxReceiver(const DmxReceiver&);
+  DmxReceiver& operator=(const DmxReceiver&);
+};
+
+void RxTransferCompleteHandler(struct libusb_transfer *transfer) {
+  DmxReceiver *receiver = static_cast<DmxReceiver*>(transfer->user_data);
+  receiver->_TransferComplete(transfer);
+}
+
+/**
+ * An RDM UID, the manufacturer ID is in the top 16 of the 48 bits.
+ */
+typedef uint64_t RdmUid;
+
+string RdmUidToString(RdmUid uid) {
+  std::ostringstream str;
+  str << std::hex << std::setfill('0') << std::setw(4) << (uid >> 32) << ":"
+      << std::setw(8) << (uid & 0xffffffff);
+  return str.str();
+}
+
+enum RdmStatus {
+  RDM_ACK,
+  // The responder will have the answer later, the data is the delay.
+  RDM_ACK_TIMER,
+  // The data is the NACK reason.
+  RDM_NACK,
+  // No response, which is what broadcasts get.
+  RDM_NO_RESPONSE,
+  // A response that failed its checksum or didn't match the request.
+  RDM_INVALID_RESPONSE,
+  // The request didn't make it to the widget and back.
+  RDM_FAILED
+};
+
+const char *RdmStatusName(RdmStatus status) {
+  switch (status) {
+    case RDM_ACK:
+      return "ack";
+    case RDM_ACK_TIMER:
+      return "ack timer";
+    case RDM_NACK:
+      return "nack";
+    case RDM_NO_RESPONSE:
+      return "no response";
+    case RDM_INVALID_RESPONSE:
+      return "invalid response";
+    case RDM_FAILED:
+      return "failed";
+  }
+  return "unknown";
+}
+
+struct RdmResult {
+  RdmStatus status;
+  uint8_t port;
+  RdmUid uid;
+  uint16_t sub_device;
+  uint16_t pid;
+  // The parameter data, only valid while the callback runs.
+  const uint8_t *data;
+  unsigned int size;
+};
+
+class RdmController;
+
+void RdmRequestCompleteHandler(void *user_data, const RequestResult &result);
+
+/**
+ * Sends RDM (ANSI E1.20) requests through a widget, and discovers the
+ * responders on its ports.
+ *
+ * Requests are queued on the UsbSender without waiting for the ones before,
+ * so the widget goes straight from one to the next. The widget still handles
+ * one request at a time, so each one waits out the RDM round trip of those
+ * ahead of it, whichever port they're for. Discovery can be started on
+ * several ports, and their requests are interleaved in the queue. Each
+ * port's binary search takes its next step from the completion of the last,
+ * on the libusb thread, so there's no round trip through another thread
+ * between the thousands of requests it makes.
+ *
+ * SetRequestHook() replaces the UsbSender, so the controller can be driven
+ * by emulated responders.
+ *
+ * The responses to GETs of parameters that only change when they're SET are
+ * cached, see Lookup(). A SET clears what's cached for the responder.
+ */
+class RdmController {
+ public:
+  // Called, from the libusb thread, when a request completes.
+  typedef void (*RdmCallback)(void *user_data, const RdmResult &result);
+
+  // Sends the payload of an RDM_COMMAND in place of the UsbSender. The
+  // response is delivered by calling RdmRequestCompleteHandler(request, ...)
+  // with the response frame, but not from within the hook.
+  typedef bool (*RequestHook)(void *hook_data, const uint8_t *message,
+                              unsigned int size, void *request);
+
+  enum {
+    DISC_UNIQUE_BRANCH = 0x0001,
+    DISC_MUTE = 0x0002,
+    DISC_UN_MUTE = 0x0003,
+    SUPPORTED_PARAMETERS = 0x0050,
+    DEVICE_INFO = 0x0060,
+    DEVICE_MODEL_DESCRIPTION = 0x0080,
+    MANUFACTURER_LABEL = 0x0081,
+    DEVICE_LABEL = 0x0082,
+    SOFTWARE_VERSION_LABEL = 0x00c0,
+    DMX_PERSONALITY = 0x00e0,
+    DMX_START_ADDRESS = 0x00f0
+  };
+
+  static const RdmUid BROADCAST_UID = 0xffffffffffffull;
+  static const unsigned int MAX_PARAMETER_DATA = 231;
+
+  // An RDM request on its way to the widget, public for the handler.
+  struct Transaction {
+    RdmController *controller;
+    bool discovery;
+    uint8_t port;
+    RdmUid uid;
+    uint16_t sub_device;
+    uint8_t command_class;
+    uint16_t pid;
+    uint8_t transaction_number;
+    // The parameter data, kept to ask for the rest of an ACK_OVERFLOW.
+    uint8_t data[MAX_PARAMETER_DATA];
+    unsigned int size;
+    RdmCallback callback;
+    void *user_data;
+    // The data from ACK_OVERFLOW responses so far.
+    string overflow;
+  };
+
+  explicit RdmController(UsbSender *sender)
+      : m_sender(sender),
+        m_hook(NULL),
+        m_hook_data(NULL),
+        m_next_transaction(0),
+        m_stopping(false),
+        m_discovering(0),
+        m_discovery_requests(0) {
+    pthread_mutex_init(&m_mutex, NULL);
+    pthread_cond_init(&m_condition, NULL);
+    pthread_mutex_init(&m_transaction_mutex, NULL);
+    pthread_cond_init(&m_transaction_condition, NULL);
+    for (unsigned int i = 0; i < kRdmTransactions; i++) {
+      m_transactions[i].controller = this;
+      m_free_transactions.push_back(&m_transactions[i]);
+    }
+  }
+
+  /**
+   * Waits for the outstanding requests, and stops discovery.
+   */
+  ~RdmController() {
+    Stop();
+    // Discovery is done with m_mutex once the port finishes, and with the
+    // transaction once it's released.
+    pthread_mutex_lock(&m_mutex);
+    while (m_discovering) {
+      pthread_cond_wait(&m_condition, &m_mutex);
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    pthread_mutex_lock(&m_transaction_mutex);
+    while (m_free_transactions.size() != kRdmTransactions) {
+      pthread_cond_wait(&m_transaction_condition, &m_transaction_mutex);
+    }
+    pthread_mutex_unlock(&m_transaction_mutex);
+
+    pthread_cond_destroy(&m_transaction_condition);
+    pthread_mutex_destroy(&m_transaction_mutex);
+    pthread_cond_destroy(&m_condition);
+    pthread_mutex_destroy(&m_mutex);
+  }
+
+  /**
+   * Stop discovery once the requests it has outstanding complete, and don't
+   * allow it to start again. This doesn't wait, see WaitForDiscovery().
+   */
+  void Stop() {
+    pthread_mutex_lock(&m_mutex);
+    m_stopping = true;
+    pthread_mutex_unlock(&m_mutex);
+  }
+
+  /**
+   * Send requests with the hook rather than the UsbSender, this must be set
+   * before any are sent.
+   */
+  void SetRequestHook(RequestHook hook, void *hook_data) {
+    m_hook = hook;
+    m_hook_data = hook_data;
+  }
+
+  /**
+   * Send a GET, and run the callback with the response.
+   * @returns false if the request couldn't be queued, e.g. there are already
+   *   kRdmTransactions outstanding, in which case the callback isn't run.
+   */
+  bool Get(uint8_t port, RdmUid uid, uint16_t sub_device, uint16_t pid,
+           const uint8_t *data, unsigned int size, RdmCallback callback,
+           void *user_data) {
+    return SendCommand(port, uid, sub_device, GET_COMMAND, pid, data, size,
+                       callback, user_data);
+  }
+
+  bool Set(uint8_t port, RdmUid uid, uint16_t sub_device, uint16_t pid,
+           const uint8_t *data, unsigned int size, RdmCallback callback,
+           void *user_data) {
+    return SendCommand(port, uid, sub_device, SET_COMMAND, pid, data, size,
+                       callback, user_data);
+  }
+
+  /**
+   * Find a parameter in the cache.
+   * @returns false if it's not there, in which case Get() it.
+   */
+  bool Lookup(RdmUid uid, uint16_t sub_device, uint16_t pid, string *data) {
+    pthread_mutex_lock(&m_mutex);
+    ParameterCache::const_iterator iter = m_cache.find(
+        MakeCacheKey(uid, sub_device, pid));
+    const bool found = iter != m_cache.end();
+    if (found) {
+      *data = iter->second;
+    }
+    pthread_mutex_unlock(&m_mutex);
+    return found;
+  }
+
+  /**
+   * Start discovery on each of the ports in the mask, see
+   * WaitForDiscovery().
+   * @returns false if discovery is already running, or couldn't start on any
+   *   port.
+   */
+  bool Discover(uint16_t ports) {
+    pthread_mutex_lock(&m_mutex);
+    if (m_discovering || m_stopping) {
+      pthread_mutex_unlock(&m_mutex);
+      return false;
+    }
+    for (unsigned int port = 0; port < kMaxDmxPorts; port++) {
+      if (!(ports & (1 << port))) {
+        continue;
+      }
+      PortDiscovery *discovery = &m_discovery[port];
+      discovery->branches.clear();
+      discovery->found.clear();
+      discovery->complete = false;
+      m_discovering++;
+      // Everything has to answer the first branch, so unmute them all.
+      if (!SendDiscovery(port, BROADCAST_UID, DISC_UN_MUTE, NULL, 0)) {
+        FinishDiscovery(port, false);
+      }
+    }
+    const bool started = m_discovering != 0;
+    pthread_mutex_unlock(&m_mutex);
+    return started;
+  }
+
+  /**
+   * Wait for discovery to finish on every port.
+   */
+  void WaitForDiscovery() {
+    pthread_mutex_lock(&m_mutex);
+    while (m_discovering) {
+      pthread_cond_wait(&m_condition, &m_mutex);
+    }
+    pthread_mutex_unlock(&m_mutex);
+  }
+
+  /**
+   * @param complete set to false if discovery on the port was cut short, may
+   *   be NULL.
+   * @returns the responders found on a port by the last discovery.
+   */
+  std::vector<RdmUid> Responders(uint8_t port, bool *complete) {
+    std::vector<RdmUid> responders;
+    if (port >= kMaxDmxPorts) {
+      return responders;
+    }
+    pthread_mutex_lock(&m_mutex);
+    responders = m_discovery[port].found;
+    if (complete) {
+      *complete = m_discovery[port].complete;
+    }
+    pthread_mutex_unlock(&m_mutex);
+    return responders;
+  }
+
+  // The number of requests discovery has made, on all ports.
+  unsigned int DiscoveryRequests() {
+    pthread_mutex_lock(&m_mutex);
+    unsigned int requests = m_discovery_requests;
+    pthread_mutex_unlock(&m_mutex);
+    return requests;
+  }
+
+  void _RequestComplete(Transaction *transaction,
+                        const RequestResult &result) {
+    // The widget replies with [port] [result] [response].
+    RdmStatus status = StatusFromRequest(result.status);
+    const uint8_t *payload = NULL;
+    unsigned int payload_size = 0;
+    const uint8_t *response = NULL;
+    unsigned int response_size = 0;
+    if (result.status == REQUEST_OK) {
+      if (!UsbSender::ParseFrame(result.data, result.size,
+                                 UsbSender::RDM_COMMAND, &payload,
+                                 &payload_size) ||
+          payload_size < 2 || payload[0] != transaction->port) {
+        status = RDM_INVALID_RESPONSE;
+      } else if (payload[1] == RESULT_NO_RESPONSE) {
+        status = RDM_NO_RESPONSE;
+      } else {
+        response = payload + 2;
+        response_size = payload_size - 2;
+      }
+    }
+
+    if (transaction->discovery) {
+      if (transaction->pid == DISC_MUTE && response) {
+        // Anything but an ACK means it didn't mute.
+        uint8_t response_type;
+        const uint8_t *data;
+        unsigned int data_size;
+        if (ParseResponse(*transaction, response, response_size,
+                          &response_type, &data, &data_size) != RDM_ACK) {
+          status = RDM_NO_RESPONSE;
+        }
+      }
+      // The destructor waits for the transaction, so it's only released
+      // once DiscoveryStep() is done with m_mutex.
+      DiscoveryStep(transaction->port, transaction->pid, status, response,
+                    response_size);
+      ReleaseTransaction(transaction);
+      return;
+    }
+
+    RdmResult rdm = {status, transaction->port, transaction->uid,
+                     transaction->sub_device, transaction->pid, NULL, 0};
+    uint8_t response_type = 0;
+    if (response) {
+      rdm.status = ParseResponse(*transaction, response, response_size,
+                                 &response_type, &rdm.data, &rdm.size);
+    }
+
+    if (rdm.status == RDM_ACK && response_type == ACK_OVERFLOW) {
+      // There's more to come, ask for it.
+      transaction->overflow.append(reinterpret_cast<const char*>(rdm.data),
+                                   rdm.size);
+      if (SendTransaction(transaction)) {
+        return;
+      }
+      rdm.status = RDM_FAILED;
+    }
+    if (rdm.status == RDM_ACK && !transaction->overflow.empty()) {
+      transaction->overflow.append(reinterpret_cast<const char*>(rdm.data),
+                                   rdm.size);
+      rdm.data = reinterpret_cast<const uint8_t*>(
+          transaction->overflow.data());
+      rdm.size = transaction->overflow.size();
+    }
+    if (rdm.status == RDM_ACK) {
+      UpdateCache(*transaction, rdm.data, rdm.size);
+    }
+
+    if (transaction->callback) {
+      transaction->callback(transaction->user_data, rdm);
+    }
+    ReleaseTransaction(transaction);
+  }
+
+ private:
+  enum {
+    DISCOVERY_COMMAND = 0x10,
+    GET_COMMAND = 0x20,
+    SET_COMMAND = 0x30
+  };
+
+  enum {
+    ACK = 0x00,
+    ACK_TIMER = 0x01,
+    NACK_REASON = 0x02,
+    ACK_OVERFLOW = 0x03
+  };
+
+  // The widget's result byte.
+  enum {
+    RESULT_RESPONSE = 0x00,
+    RESULT_NO_RESPONSE = 0x01
+  };
+
+  static const uint8_t START_CODE = 0xcc;
+  static const uint8_t SUB_START_CODE = 0x01;
+  // The message, up to the parameter data.
+  static const unsigned int HEADER_SIZE = 24;
+  static const unsigned int CHECKSUM_SIZE = 2;
+  static const uint8_t DUB_PREAMBLE = 0xfe;
+  static const uint8_t DUB_SEPARATOR = 0xaa;
+  static const unsigned int MAX_DUB_PREAMBLE = 7;
+  // The UID and checksum, with each byte sent twice.
+  static const unsigned int DUB_ENCODED_SIZE = 16;
+
+  // A range of UIDs still to search.
+  struct Branch {
+    RdmUid lower;
+    RdmUid upper;
+  };
+
+  struct PortDiscovery {
+    PortDiscovery() : muting(0), complete(false) {}
+
+    std::vector<Branch> branches;
+    Branch current;
+    RdmUid muting;
+    std::vector<RdmUid> found;
+    bool complete;
+  };
+
+  // The UID, then the sub device and PID.
+  typedef std::pair<RdmUid, uint32_t> CacheKey;
+  typedef std::map<CacheKey, string> ParameterCache;
+
+  UsbSender *m_sender;
+  RequestHook m_hook;
+  void *m_hook_data;
+  std::atomic<uint8_t> m_next_transaction;
+
+  pthread_mutex_t m_mutex;
+  // Signalled when discovery finishes on a port.
+  pthread_cond_t m_condition;
+  bool m_stopping;  // GUARDED_BY(m_mutex)
+  unsigned int m_discovering;  // GUARDED_BY(m_mutex)
+  unsigned int m_discovery_requests;  // GUARDED_BY(m_mutex)
+  PortDiscovery m_discovery[kMaxDmxPorts];  // GUARDED_BY(m_mutex)
+  ParameterCache m_cache;  // GUARDED_BY(m_mutex)
+
+  // Taken after m_mutex, if both are needed.
+  pthread_mutex_t m_transaction_mutex;
+  // Signalled when a transaction is released.
+  pthread_cond_t m_transaction_condition;
+  Transaction m_transactions[kRdmTransactions];
+  // GUARDED_BY(m_transaction_mutex)
+  std::vector<Transaction*> m_free_transactions;
+
+  static CacheKey MakeCacheKey(RdmUid uid, uint16_t sub_device,
+                               uint16_t pid) {
+    return CacheKey(uid, (static_cast<uint32_t>(sub_device) << 16) | pid);
+  }
+
+  /**
+   * @returns true if the parameter only changes when it's SET.
+   */
+  static bool IsCacheable(uint16_t pid) {
+    switch (pid) {
+      case SUPPORTED_PARAMETERS:
+      case DEVICE_INFO:
+      case DEVICE_MODEL_DESCRIPTION:
+      case MANUFACTURER_LABEL:
+      case DEVICE_LABEL:
+      case SOFTWARE_VERSION_LABEL:
+      case DMX_PERSONALITY:
+      case DMX_START_ADDRESS:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  static RdmStatus StatusFromRequest(RequestStatus status) {
+    return status == REQUEST_OK ? RDM_ACK : RDM_FAILED;
+  }
+
+  static void WriteUid(uint8_t *buffer, RdmUid uid) {
+    for (unsigned int i = 0; i < 6; i++) {
+      buffer[i] = static_cast<uint8_t>(uid >> (8 * (5 - i)));
+    }
+  }
+
+  static RdmUid ReadUid(const uint8_t *buffer) {
+    RdmUid uid = 0;
+    for (unsigned int i = 0; i < 6; i++) {
+      uid = (uid << 8) | buffer[i];
+    }
+    return uid;
+  }
+
+  static uint16_t Checksum(const uint8_t *data, unsigned int size) {
+    uint16_t checksum = 0;
+    for (unsigned int i = 0; i < size; i++) {
+      checksum += data[i];
+    }
+    return checksum;
+  }
+
+  /**
+   * Build an RDM request, RDM is big endian.
+   * @returns the size of the message.
+   */
+  static unsigned int BuildRequest(uint8_t *buffer, RdmUid destination,
+                                   uint8_t transaction, uint8_t port,
+                                   uint16_t sub_device, uint8_t command_class,
+                                   uint16_t pid, const uint8_t *data,
+                                   unsigned int size) {
+    buffer[0] = START_CODE;
+    buffer[1] = SUB_START_CODE;
+    buffer[2] = static_cast<uint8_t>(HEADER_SIZE + size);
+    WriteUid(buffer + 3, destination);
+    WriteUid(buffer + 9, kRdmControllerUid);
+    buffer[15] = transaction;
+    // Port IDs start at 1.
+    buffer[16] = port + 1;
+    buffer[17] = 0;
+    buffer[18] = static_cast<uint8_t>(sub_device >> 8);
+    buffer[19] = static_cast<uint8_t>(sub_device & 0xff);
+    buffer[20] = command_class;
+    buffer[21] = static_cast<uint8_t>(pid >> 8);
+    buffer[22] = static_cast<uint8_t>(pid & 0xff);
+    buffer[23] = static_cast<uint8_t>(size);
+    if (size) {
+      memcpy(buffer + HEADER_SIZE, data, size);
+    }
+    const unsigned int length = HEADER_SIZE + size;
+    const uint16_t checksum = Checksum(buffer, length);
+    buffer[length] = static_cast<uint8_t>(checksum >> 8);
+    buffer[length + 1] = static_cast<uint8_t>(checksum & 0xff);
+    return length + CHECKSUM_SIZE;
+  }
+
+  /**
+   * Check a response matches the request, and find its parameter data.
+   */
+  static RdmStatus ParseResponse(const Transaction &transaction,
+                                 const uint8_t *response, unsigned int size,
+                                 uint8_t *response_type,
+                                 const uint8_t **data,
+                                 unsigned int *data_size) {
+    if (size < HEADER_SIZE + CHECKSUM_SIZE || response[0] != START_CODE ||
+        response[1] != SUB_START_CODE) {
+      return RDM_INVALID_RESPONSE;
+    }
+    const unsigned int length = response[2];
+    if (length < HEADER_SIZE || size < length + CHECKSUM_SIZE ||
+        HEADER_SIZE + response[23] != length) {
+      return RDM_INVALID_RESPONSE;
+    }
+    const uint16_t checksum = (response[length] << 8) | response[length + 1];
+    if (checksum != Checksum(response, length)) {
+      return RDM_INVALID_RESPONSE;
+    }
+    const uint16_t pid = (response[21] << 8) | response[22];
+    if (ReadUid(response + 3) != kRdmControllerUid ||
+        ReadUid(response + 9) != transaction.uid ||
+        response[15] != transaction.transaction_number ||
+        response[20] != transaction.command_class + 1 ||
+        pid != transaction.pid) {
+      return RDM_INVALID_RESPONSE;
+    }
+
+    *response_type = response[16];
+    *data = response + HEADER_SIZE;
+    *data_size = response[23];
+    switch (*response_type) {
+      case ACK:
+      case ACK_OVERFLOW:
+        return RDM_ACK;
+      case ACK_TIMER:
+        return RDM_ACK_TIMER;
+      case NACK_REASON:
+        return RDM_NACK;
+      default:
+        return RDM_INVALID_RESPONSE;
+    }
+  }
+
+  /**
+   * Decode the response to a DISC_UNIQUE_BRANCH.
+   * @returns false if there was more than one responder, so the response is
+   *   garbled.
+   */
+  static bool DecodeDiscoveryResponse(const uint8_t *response,
+                                      unsigned int size, RdmUid *uid) {
+    unsigned int offset = 0;
+    while (offset < size && offset < MAX_DUB_PREAMBLE &&
+           response[offset] == DUB_PREAMBLE) {
+      offset++;
+    }
+    if (offset >= size || response[offset] != DUB_SEPARATOR ||
+        size - offset - 1 < DUB_ENCODED_SIZE) {
+      return false;
+    }
+    const uint8_t *encoded = response + offset + 1;
+    uint16_t checksum = 0;
+    uint8_t decoded[6];
+    for (unsigned int i = 0; i < 6; i++) {
+      checksum += encoded[2 * i] + encoded[2 * i + 1];
+      decoded[i] = encoded[2 * i] & encoded[2 * i + 1];
+    }
+    const uint16_t expected = ((encoded[12] & encoded[13]) << 8) |
+                              (encoded[14] & encoded[15]);
+    if (checksum != expected) {
+      return false;
+    }
+    *uid = ReadUid(decoded);
+    return true;
+  }
+
+  Transaction *AcquireTransaction() {
+    pthread_mutex_lock(&m_transaction_mutex);
+    Transaction *transaction = NULL;
+    if (!m_free_transactions.empty()) {
+      transaction = m_free_transactions.back();
+      m_free_transactions.pop_back();
+    }
+    pthread_mutex_unlock(&m_transaction_mutex);
+    if (transaction) {
+      transaction->overflow.clear();
+    }
+    return transaction;
+  }
+
+  void ReleaseTransaction(Transaction *transaction) {
+    // Signal with the lock held, the destructor may be waiting on this.
+    pthread_mutex_lock(&m_transaction_mutex);
+    m_free_transactions.push_back(transaction);
+    pthread_cond_broadcast(&m_transaction_condition);
+    pthread_mutex_unlock(&m_transaction_mutex);
+  }
+
+  bool SendCommand(uint8_t port, RdmUid uid, uint16_t sub_device,
+                   uint8_t command_class, uint16_t pid, const uint8_t *data,
+                   unsigned int size, RdmCallback callback, void *user_data) {
+    if (port >= kMaxDmxPorts || size > MAX_PARAMETER_DATA) {
+      return false;
+    }
+    Transaction *transaction = AcquireTransaction();
+    if (!transaction) {
+      return false;
+    }
+    transaction->discovery = false;
+    transaction->port = port;
+    transaction->uid = uid;
+    transaction->sub_device = sub_device;
+    transaction->command_class = command_class;
+    transaction->pid = pid;
+    transaction->callback = callback;
+    transaction->user_data = user_data;
+    if (size) {
+      memcpy(transaction->data, data, size);
+    }
+    transaction->size = size;
+    if (!SendTransaction(transaction)) {
+      ReleaseTransaction(transaction);
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * Send a discovery request, called with m_mutex held.
+   */
+  bool SendDiscovery(uint8_t port, RdmUid uid, uint16_t pid,
+                     const uint8_t *data, unsigned int size) {
+    if (size > MAX_PARAMETER_DATA) {
+      return false;
+    }
+    Transaction *transaction = AcquireTransaction();
+    if (!transaction) {
+      return false;
+    }
+    transaction->discovery = true;
+    transaction->port = port;
+    transaction->uid = uid;
+    transaction->sub_device = 0;
+    transaction->command_class = DISCOVERY_COMMAND;
+    transaction->pid = pid;
+    transaction->callback = NULL;
+    transaction->user_data = NULL;
+    if (size) {
+      memcpy(transaction->data, data, size);
+    }
+    transaction->size = size;
+    if (!SendTransaction(transaction)) {
+      ReleaseTransaction(transaction);
+      return false;
+    }
+    m_discovery_requests++;
+    return true;
+  }
+
+  /**
+   * Send a transaction's request, or send it again with a new transaction
+   * number.
+   */
+  bool SendTransaction(Transaction *transaction) {
+    uint8_t message[1 + HEADER_SIZE + MAX_PARAMETER_DATA + CHECKSUM_SIZE];
+    transaction->transaction_number = m_next_transaction++;
+    message[0] = transaction->port;
+    const unsigned int length = 1 + BuildRequest(
+        message + 1, transaction->uid, transaction->transaction_number,
+        transaction->port, transaction->sub_device,
+        transaction->command_class, transaction->pid, transaction->data,
+        transaction->size);
+    if (m_hook) {
+      return m_hook(m_hook_data, message, length,
+                    static_cast<void*>(transaction));
+    }
+    return m_sender->SendRequest(UsbSender::RDM_COMMAND, message, length,
+                                 kTimeout, RdmRequestCompleteHandler,
+                                 static_cast<void*>(transaction));
+  }
+
+  void UpdateCache(const Transaction &transaction, const uint8_t *data,
+                   unsigned int size) {
+    pthread_mutex_lock(&m_mutex);
+    if (transaction.command_class == SET_COMMAND) {
+      // A SET can change other parameters too, e.g. DMX_START_ADDRESS is
+      // part of DEVICE_INFO.
+      m_cache.erase(m_cache.lower_bound(CacheKey(transaction.uid, 0)),
+                    m_cache.lower_bound(CacheKey(transaction.uid + 1, 0)));
+    } else if (IsCacheable(transaction.pid)) {
+      m_cache[MakeCacheKey(transaction.uid, transaction.sub_device,
+                           transaction.pid)].assign(
+          reinterpret_cast<const char*>(data), size);
+    }
+    pthread_mutex_unlock(&m_mutex);
+  }
+
+  /**
+   * Take the next step of a port's discovery, after a discovery request
+   * completes.
+   */
+  void DiscoveryStep(uint8_t port, uint16_t pid, RdmStatus status,
+                     const uint8_t *response, unsigned int size) {
+    pthread_mutex_lock(&m_mutex);
+    PortDiscovery *discovery = &m_discovery[port];
+    // Responses that don't parse are part of discovery, but a request that
+    // didn't make it to the widget means it's gone.
+    if (status == RDM_FAILED || status == RDM_INVALID_RESPONSE) {
+      FinishDiscovery(port, false);
+      pthread_mutex_unlock(&m_mutex);
+      return;
+    }
+
+    switch (pid) {
+      case DISC_UN_MUTE: {
+        Branch all = {0, BROADCAST_UID - 1};
+        discovery->branches.push_back(all);
+        break;
+      }
+      case DISC_UNIQUE_BRANCH: {
+        RdmUid uid;
+        if (status == RDM_NO_RESPONSE) {
+          // Nothing unmuted in this branch.
+          break;
+        }
+        if (DecodeDiscoveryResponse(response, size, &uid) &&
+            uid >= discovery->current.lower &&
+            uid <= discovery->current.upper &&
+            std::find(discovery->found.begin(), discovery->found.end(),
+                      uid) == discovery->found.end()) {
+          discovery->muting = uid;
+          if (SendDiscovery(port, uid, DISC_MUTE, NULL, 0)) {
+            pthread_mutex_unlock(&m_mutex);
+            return;
+          }
+          FinishDiscovery(port, false);
+          pthread_mutex_unlock(&m_mutex);
+          return;
+        }
+        // More than one responder, or one that didn't stay muted.
+        SplitBranch(discovery);
+        break;
+      }
+      case DISC_MUTE:
+        if (status == RDM_NO_RESPONSE) {
+          // It answered the branch but won't mute, so narrow it down until
+          // it's on its own, and then give up on it.
+          SplitBranch(discovery);
+        } else {
+          discovery->found.push_back(discovery->muting);
+          // There may be more in the same branch.
+          discovery->branches.push_back(discovery->current);
+        }
+        break;
+    }
+    NextBranch(port);
+    pthread_mutex_unlock(&m_mutex);
+  }
+
+  /**
+   * Replace the current branch with its two halves, lower half first. A
+   * branch of a single UID is dropped.
+   */
+  void SplitBranch(PortDiscovery *discovery) {
+    const Branch &current = discovery->current;
+    if (current.lower == current.upper) {
+      cerr << "Responder " << RdmUidToString(current.lower)
+           << " won't mute" << endl;
+      return;
+    }
+    const RdmUid middle = current.lower + (current.upper - current.lower) / 2;
+    Branch upper = {middle + 1, current.upper};
+    Branch lower = {current.lower, middle};
+    discovery->branches.push_back(upper);
+    discovery->branches.push_back(lower);
+  }
+
+  /**
+   * Search the next branch, or finish if there aren't any, called with
+   * m_mutex held.
+   */
+  void NextBranch(uint8_t port) {
+    PortDiscovery *discovery = &m_discovery[port];
+    if (m_stopping) {
+      FinishDiscovery(port, false);
+      return;
+    }
+    if (discovery->branches.empty()) {
+      FinishDiscovery(port, true);
+      return;
+    }
+    discovery->current = discovery->branches.back();
+    discovery->branches.pop_back();
+    uint8_t data[12];
+    WriteUid(data, discovery->current.lower);
+    WriteUid(data + 6, discovery->current.upper);
+    if (!SendDiscovery(port, BROADCAST_UID, DISC_UNIQUE_BRANCH, data,
+                       arraysize(data))) {
+      FinishDiscovery(port, false);
+    }
+  }
+
+  /**
+   * Called with m_mutex held.
+   */
+  void FinishDiscovery(uint8_t port, bool complete) {
+    m_discovery[port].complete = complete;
+    m_discovery[port].branches.clear();
+    m_discovering--;
+    pthread_cond_broadcast(&m_condition);
+  }
+
+  RdmController(const RdmController&);
+  RdmController& operator=(const RdmController&);
+};
+
+void RdmRequestCompleteHandler(void *user_data, const RequestResult &result) {
+  RdmController::Transaction *transaction =
+      static_cast<RdmController::Transaction*>(user_data);
+  transaction->controller->_RequestComplete(transaction, result);
+}
+
+void *StartRecorderThread(void *d);
+
+/**
+ * Records the DMX sent to the widgets, for debugging shows.
+ *
+ * Frames are appended as fixed size records to a series of segment files,
+ * <prefix>.<segment>.dmxlog, each preallocated to hold records_per_segment
+ * records and mapped into memory. Recording a frame is a copy into the
+ * mapping, and the kernel writes it out in its own time.
+ *
+ * Opening, sizing and mapping the next segment, and unmapping the last, are
+ * done on the recorder's own thread, so Record() never waits on the file
+ * system. If the next segment isn't ready when it's needed, frames are
+ * dropped, and counted, rather than holding up the output.
+ *
+ * Each segment starts with a SegmentHeader, whose record count is updated
+ * after each record, so a segment that's still being written can be read.
+ * Finished segments are truncated to the records they hold.
+ *
+ * Only the frames ReconnectManager::FlushDmx() sends are recorded, under the
+ * universes they were staged for. Two kinds of frame reach the widget
+ * without being recorded:
+ * - the last frame, which is sent again when the widget reattaches. It was
+ *   recorded when it was first flushed.
+ * - frames sent with ReconnectManager::SendRequest(TX_DMX, ...), which have
+ *   no universe to record them under.
+ */
+class DmxRecorder {
+ public:
+  // At the start of each segment, in host byte order.
+  struct SegmentHeader {
+    char magic[8];
+    uint32_t header_size;
+    uint32_t record_size;
+    uint32_t segment;
+    uint32_t capacity;
+    uint64_t records;
+    uint8_t reserved[32];
+  };
+
+  struct FrameRecord {
+    // CLOCK_MONOTONIC, in ns.
+    uint64_t timestamp;
+    uint16_t universe;
+    // The number of slots sent, the rest of data is 0.
+    uint16_t size;
+    uint32_t reserved;
+    uint8_t data[kDmxUniverseSize];
+  };
+
+  explicit DmxRecorder(const string &prefix,
+                       unsigned int records_per_segment =
+                           kRecorderSegmentRecords)
+      : m_prefix(prefix),
+        m_capacity(records_per_segment),
+        m_current(NULL),
+        m_thread_id(),
+        m_started(false),
+        m_running(false),
+        m_spare(NULL),
+        m_next_segment(0),
+        m_open_failed(false),
+        m_recorded(0),
+        m_dropped(0) {
+    pthread_mutex_init(&m_mutex, NULL);
+    pthread_cond_init(&m_condition, NULL);
+  }
+
+  ~DmxRecorder() {
+    Stop();
+    pthread_cond_destroy(&m_condition);
+    pthread_mutex_destroy(&m_mutex);
+  }
+
+  /**
+   * Open the first segment, and start the thread that prepares the rest.
+   * @returns false if the first segment couldn't be opened.
+   */
+  bool Start() {
+    m_current = OpenSegment(0);
+    if (!m_current) {
+      return false;
+    }
+    m_next_segment = 1;
+    m_running = true;
+    if (pthread_create(&m_thread_id, NULL, StartRecorderThread,
+                       static_cast<void*>(this))) {
+      cerr << "Failed to start recorder thread" << endl;
+      m_running = false;
+      CloseSegment(m_current);
+      m_current = NULL;
+      return false;
+    }
+    m_started = true;
+    return true;
+  }
+
+  /**
+   * Finish the current segment and stop the thread.
+   */
+  void Stop() {
+    if (!m_started) {
+      return;
+    }
+    pthread_mutex_lock(&m_mutex);
+    m_running = false;
+    pthread_cond_signal(&m_condition);
+    pthread_mutex_unlock(&m_mutex);
+    pthread_join(m_thread_id, NULL);
+    m_started = false;
+
+    CloseSegment(m_current);
+    m_current = NULL;
+    // The spare was never written to.
+    CloseSegment(m_spare);
+    m_spare = NULL;
+  }
+
+  /**
+   * Append a frame. This must only be called from one thread at a time.
+   * @returns false if the frame was dropped.
+   */
+  bool Record(uint16_t universe, const uint8_t *data, unsigned int size) {
+    if (!m_current) {
+      m_dropped++;
+      return false;
+    }
+    if (m_current->header->records == m_capacity && !NextSegment()) {
+      m_dropped++;
+      return false;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    size = std::min(size, kDmxUniverseSize);
+    // The segment is fresh, so the unused slots are already 0.
+    FrameRecord *record = &m_current->records[m_current->header->records];
+    record->timestamp = now.tv_sec * 1000000000ull + now.tv_nsec;
+    record->universe = universe;
+    record->size = static_cast<uint16_t>(size);
+    memcpy(record->data, data, size);
+    m_current->header->records++;
+    m_recorded++;
+    return true;
+  }
+
+  uint64_t Recorded() const { return m_recorded; }
+  uint64_t Dropped() const { return m_dropped; }
+
+  void *_Run() {
+    pthread_mutex_lock(&m_mutex);
+    while (true) {
+      while (m_running && (m_spare || m_open_failed) && m_retired.empty()) {
+        pthread_cond_wait(&m_condition, &m_mutex);
+      }
+      std::vector<Segment*> retired;
+      retired.swap(m_retired);
+      const bool need_spare = m_running && !m_spare && !m_open_failed;
+      const unsigned int index = m_next_segment;
+      const bool running = m_running;
+      pthread_mutex_unlock(&m_mutex);
+
+      for (unsigned int i = 0; i < retired.size(); i++) {
+        CloseSegment(retired[i]);
+      }
+      Segment *spare = need_spare ? OpenSegment(index) : NULL;
+
+      pthread_mutex_lock(&m_mutex);
+      if (need_spare) {
+        if (spare) {
+          m_spare = spare;
+          m_next_segment++;
+        } else {
+          // Most likely the disk is full, recording stops when the current
+          // segment is.
+          m_open_failed = true;
+        }
+      }
+      if (!running && m_retired.empty()) {
+        break;
+      }
+    }
+    pthread_mutex_unlock(&m_mutex);
+    return NULL;
+  }
+
+ private:
+  struct Segment {
+    int fd;
+    uint8_t *base;
+    size_t length;
+    SegmentHeader *header;
+    FrameRecord *records;
+  };
+
+  const string m_prefix;
+  const unsigned int m_capacity;
+  // Only used by the thread calling Record().
+  Segment *m_current;
+  pthread_t m_thread_id;
+  bool m_started;
+
+  pthread_mutex_t m_mutex;
+  pthread_cond_t m_condition;
+  bool m_running;  // GUARDED_BY(m_mutex)
+  Segment *m_spare;  // GUARDED_BY(m_mutex)
+  std::vector<Segment*> m_retired;  // GUARDED_BY(m_mutex)
+  unsigned int m_next_segment;  // GUARDED_BY(m_mutex)
+  bool m_open_failed;  // GUARDED_BY(m_mutex)
+
+  std::atomic<uint64_t> m_recorded;
+  std::atomic<uint64_t> m_dropped;
+
+  /**
+   * Swap the full segment for the spare, and have the thread close it.
+   * @returns false if the spare isn't ready.
+   */
+  bool NextSegment() {
+    pthread_mutex_lock(&m_mutex);
+    Segment *spare = m_spare;
+    if (spare) {
+      m_spare = NULL;
+      m_retired.push_back(m_current);
+      m_current = spare;
+      pthread_cond_signal(&m_condition);
+    }
+    pthread_mutex_unlock(&m_mutex);
+    return spare != NULL;
+  }
+
+  string SegmentPath(unsigned int index) const {
+    std::ostringstream path;
+    path << m_prefix << "." << std::setw(4) << std::setfill('0') << index
+         << ".dmxlog";
+    return path.str();
+  }
+
+  Segment *OpenSegment(unsigned int index) {
+    const string path = SegmentPath(index);
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      cerr << "Failed to open " << path << ": " << strerror(errno) << endl;
+      return NULL;
+    }
+
+    // Allocate the blocks now, so a full disk is an error here rather than
+    // a SIGBUS when the mapping is written to.
+    const size_t length = sizeof(SegmentHeader) + m_capacity * sizeof(FrameRecord);
+    int r = posix_fallocate(fd, 0, length);
+    if (r) {
+      cerr << "Failed to allocate " << path << ": " << strerror(r) << endl;
+      close(fd);
+      unlink(path.c_str());
+      return NULL;
+    }
+
+    int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    // Fault the pages in now, rather than on the output path.
+    flags |= MAP_POPULATE;
+#endif
+    void *base = mmap(NULL, length, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if (base == MAP_FAILED) {
+      cerr << "Failed to map " << path << ": " << strerror(errno) << endl;
+      close(fd);
+      unlink(path.c_str());
+      return NULL;
+    }
+
+    Segment *segment = new Segment();
+    segment->fd = fd;
+    segment->base = static_cast<uint8_t*>(base);
+    segment->length = length;
+    segment->header = reinterpret_cast<SegmentHeader*>(segment->base);
+    segment->records = reinterpret_cast<FrameRecord*>(
+        segment->base + sizeof(SegmentHeader));
+    memcpy(segment->header->magic, "DMXLOG1", 8);
+    segment->header->header_size = sizeof(SegmentHeader);
+    segment->header->record_size = sizeof(FrameRecord);
+    segment->header->segment = index;
+    segment->header->capacity = m_capacity;
+    segment->header->records = 0;
+    return segment;
+  }
+
+  /**
+   * Unmap a segment, and truncate it to the records written.
+   */
+  void CloseSegment(Segment *segment) {
+    if (!segment) {
+      return;
+    }
+    const uint64_t records = segment->header->records;
+    const unsigned int index = segment->header->segment;
+    munmap(segment->base, segment->length);
+    if (records) {
+      if (ftruncate(segment->fd, sizeof(SegmentHeader) +
+                                     records * sizeof(FrameRecord))) {
+        cerr << "Failed to truncate segment " << index << ": "
+             << strerror(errno) << endl;
+      }
+      close(segment->fd);
+    } else {
+      close(segment->fd);
+      unlink(SegmentPath(index).c_str());
+    }
+    delete segment;
+  }
+
+  DmxRecorder(const DmxRecorder&);
+  DmxRecorder& operator=(const DmxRecorder&);
+};
+
+void *StartRecorderThread(void *d) {
+  DmxRecorder *recorder = static_cast<DmxRecorder*>(d);
+  return recorder->_Run();
+}
+
+void DeviceLostHandler(void *user_data);
+void DmxSentHandler(void *user_data, const RequestResult &result);
+int HotplugHandler(libusb_context *context, libusb_device *device,
+                   libusb_hotplug_event event, void *user_data);
+
+/**
+ * Keeps a widget connected across resets & glitches.
+ *
+ * The widget is remembered by serial number, or by bus & port path if it
+ * doesn't have one. When the UsbSender reports the device has gone away,
+ * WaitForReconnect() re-enumerates until a matching device appears, claims it
+ * with the same configuration and resends the last DMX frame, so the output
+ * resumes where it left off. If DMX input was enabled, it's enabled again.
+ *
+ * Where libusb supports hotplug we only re-enumerate when a device arrives,
+ * otherwise we rescan every kRescanInterval ms.
+ *
+ * Transient failures are handled without giving up the device. A failed
+ * request has its transfers cancelled, the endpoint halt cleared, and is then
+ * resent. After reset_threshold consecutive failures we escalate to
+ * libusb_reset_device(), and if that doesn't help, we treat the device as
+ * lost and re-enumerate.
+ */
+class ReconnectManager {
+ public:
+  ReconnectManager(libusb_context *context, LibUsbThread *thread,
+                   TransferPool *pool,
+                   unsigned int reset_threshold = kResetThreshold)
+      : m_context(context),
+        m_thread(thread),
+        m_pool(pool),
+        m_handle(NULL),
+        m_sender(NULL),
+        m_reset_threshold(reset_threshold),
+        m_consecutive_failures(0),
+        m_have_identity(false),
+        m_last_dmx_command(UsbSender::TX_DMX),
+        m_staged_ports(0),
+        m_recorder(NULL),
+        m_dmx_in_flight(false),
+        m_checksums(false),
+        m_input(NULL),
+        m_receiver(NULL),
+        m_rx_ports(0),
+        m_connected(false),
+        m_device_arrived(true),
+        m_hotplug_handle(),
+        m_hotplug_registered(false) {
+    pthread_mutex_init(&m_mutex, NULL);
+
+    if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+      int r = libusb_hotplug_register_callback(
+          m_context, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+          LIBUSB_HOTPLUG_NO_FLAGS, kVendorId, kProductId,
+          LIBUSB_HOTPLUG_MATCH_ANY, HotplugHandler, static_cast<void*>(this),
+          &m_hotplug_handle);
+      m_hotplug_registered = r == LIBUSB_SUCCESS;
+    }
+  }
+
+  ~ReconnectManager() {
+    Detach();
+    delete m_input;
+    if (m_hotplug_registered) {
+      libusb_hotplug_deregister_callback(m_context, m_hotplug_handle);
+    }
+    pthread_mutex_destroy(&m_mutex);
+  }
+
+  /**
+   * Attach to the first widget we find.
+   * @returns true if a widget was found.
+   */
+  bool Attach() {
+    return Scan();
+  }
+
+  /**
+   * Attach to a specific device.
+   * @returns true if the device was attached.
+   */
+  bool Attach(libusb_device *device) {
+    return AttachDevice(device);
+  }
+
+  // The serial number is read once, when the device is first attached.
+  const string& Serial() const { return m_serial; }
+  const string& PortPath() const { return m_port_path; }
+
+  bool IsConnected() {
+    pthread_mutex_lock(&m_mutex);
+    bool connected = m_connected;
+    pthread_mutex_unlock(&m_mutex);
+    return connected;
+  }
+
+  /**
+   * Send a request to the widget.
+   *
+   * The last TX_DMX frame is remembered, even if the widget isn't connected,
+   * so it can be restored on reconnect.
+   * @returns false if the request couldn't be sent.
+   */
+  bool SendRequest(uint16_t command, const uint8_t *data, unsigned int size) {
+    if (command == UsbSender::TX_DMX) {
+      m_last_dmx_command = command;
+      m_last_dmx.assign(reinterpret_cast<const char*>(data), size);
+    }
+    if (!IsConnected()) {
+      return false;
+    }
+    return m_sender->SendRequest(command, data, size);
+  }
+
+  /**
+   * Wait for the response to the last request, recovering from failures as
+   * we go.
+   */
+  void Wait() {
+    while (m_sender) {
+      m_sender->Wait();
+
+      uint8_t endpoint;
+      libusb_transfer_status status;
+      if (!m_sender->GetFailure(&endpoint, &status)) {
+        m_consecutive_failures = 0;
+        return;
+      }
+      if (!Recover(endpoint, status)) {
+        return;
+      }
+    }
+  }
+
+  /**
+   * Stage a frame of DMX for one of the widget's ports, see FlushDmx().
+   * @param universe what the frame is recorded as, see SetRecorder().
+   * @returns false if the widget doesn't have the port.
+   */
+  bool StageDmx(uint8_t port, const uint8_t *data, unsigned int size,
+                uint16_t universe = 0) {
+    if (port >= kMaxDmxPorts) {
+      return false;
+    }
+    size = std::min(size, kDmxUniverseSize);
+    memcpy(m_staged[port], data, size);
+    // Ports are always sent as whole universes in TX_DMX_MULTI.
+    memset(m_staged[port] + size, 0, kDmxUniverseSize - size);
+    m_staged_sizes[port] = size;
+    m_staged_universes[port] = universe;
+    m_staged_ports |= 1 << port;
+    return true;
+  }
+
+  /**
+   * Record each frame FlushDmx() sends, NULL to stop. Frames that are
+   * replaced before they're sent aren't recorded, and nor are the frames
+   * that bypass FlushDmx(), see DmxRecorder.
+   */
+  void SetRecorder(DmxRecorder *recorder) { m_recorder = recorder; }
+
+  /**
+   * Have the sender add checksums to its frames, this carries over when the
+   * widget reattaches.
+   */
+  void SetChecksums(bool checksums) {
+    m_checksums = checksums;
+    if (IsConnected()) {
+      m_sender->SetChecksums(checksums);
+    }
+  }
+
+  /**
+   * Send the staged DMX in a single transfer: TX_DMX if it's only for port 0,
+   * and TX_DMX_MULTI otherwise. If the previous transfer hasn't completed
+   * yet, the frames stay staged for the next tick, and newer frames replace
+   * them.
+   * @returns true if a transfer was sent.
+   */
+  bool FlushDmx() {
+    if (!m_staged_ports || m_dmx_in_flight || !IsConnected()) {
+      return false;
+    }
+
+    uint16_t command;
+    unsigned int size = 0;
+    if (m_staged_ports == 1) {
+      command = UsbSender::TX_DMX;
+      size = m_staged_sizes[0];
+      memcpy(m_dmx_frame, m_staged[0], size);
+    } else {
+      command = UsbSender::TX_DMX_MULTI;
+      m_dmx_frame[size++] = static_cast<uint8_t>(m_staged_ports & 0xff);
+      m_dmx_frame[size++] = static_cast<uint8_t>(m_staged_ports >> 8);
+      for (unsigned int port = 0; port < kMaxDmxPorts; port++) {
+        if (m_staged_ports & (1 << port)) {
+          memcpy(m_dmx_frame + size, m_staged[port], kDmxUniverseSize);
+          size += kDmxUniverseSize;
+        }
+      }
+    }
+
+    m_dmx_in_flight = true;
+    if (!m_sender->SendFrame(command, m_dmx_frame, size, kTimeout,
+                             DmxSentHandler, static_cast<void*>(this))) {
+      m_dmx_in_flight = false;
+      return false;
+    }
+    if (m_recorder) {
+      for (unsigned int port = 0; port < kMaxDmxPorts; port++) {
+        if (m_staged_ports & (1 << port)) {
+          m_recorder->Record(m_staged_universes[port], m_staged[port],
+                             m_staged_sizes[port]);
+        }
+      }
+    }
+    m_staged_ports = 0;
+    m_last_dmx_command = command;
+    m_last_dmx.assign(reinterpret_cast<const char*>(m_dmx_frame), size);
+    return true;
+  }
+
+  /**
+   * Have the widget send the DMX it receives on the ports in the mask, 0 to
+   * stop. The mask is remembered, and restored when the widget reconnects.
+   * Calling this again restarts reception that stopped because the RX
+   * transfers failed.
+   * @returns false if the widget isn't connected, or the request couldn't be
+   *   sent.
+   */
+  bool EnableRx(uint16_t ports) {
+    m_rx_ports = ports;
+    if (ports && !m_input) {
+      m_input = new DmxInput();
+    }
+    if (!IsConnected()) {
+      return false;
+    }
+    return StartRx();
+  }
+
+  /**
+   * @returns what the widget has received, or NULL if EnableRx() hasn't been
+   *   called. This outlives reconnects.
+   */
+  DmxInput* Input() { return m_input; }
+
+  const RecoveryMetrics& Metrics() const { return m_metrics; }
+
+  /**
+   * @returns the sender for the current device, or NULL if not connected.
+   */
+  UsbSender* Sender() { return IsConnected() ? m_sender : NULL; }
+
+  /**
+   * Wait for the widget to come back.
+   * @param timeout the time to wait in ms.
+   * @returns true if the widget is connected.
+   */
+  bool WaitForReconnect(unsigned int timeout) {
+    if (IsConnected()) {
+      return true;
+    }
+
+    // Tear down the old device first, this stops the libusb thread if it was
+    // the last device, so we deliver events ourselves below.
+    Detach();
+
+    struct timeval now, deadline;
+    gettimeofday(&deadline, NULL);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_usec += (timeout % 1000) * 1000;
+    if (deadline.tv_usec >= 1000000) {
+      deadline.tv_sec++;
+      deadline.tv_usec -= 1000000;
+    }
+
+    do {
+      pthread_mutex_lock(&m_mutex);
+      bool rescan = m_device_arrived || !m_hotplug_registered;
+      m_device_arrived = false;
+      pthread_mutex_unlock(&m_mutex);
+
+      if (rescan && Scan()) {
+        return true;
+      }
+      struct timeval tv = {0, kRescanInterval * 1000};
+      libusb_handle_events_timeout(m_context, &tv);
+      gettimeofday(&now, NULL);
+    } while (timercmp(&now, &deadline, <));
+    return false;
+  }
+
+  void _DeviceLost() {
+    pthread_mutex_lock(&m_mutex);
+    m_connected = false;
+    pthread_mutex_unlock(&m_mutex);
+  }
+
+  void _DeviceArrived() {
+    pthread_mutex_lock(&m_mutex);
+    m_device_arrived = true;
+    pthread_mutex_unlock(&m_mutex);
+  }
+
+  void _DmxSent(const RequestResult &result) {
+    if (result.status != REQUEST_OK) {
+      cerr << "DMX frame failed: " << RequestStatusName(result.status) << endl;
+    }
+    m_dmx_in_flight = false;
+  }
+
+ private:
+  libusb_context *m_context;
+  LibUsbThread *m_thread;
+  TransferPool *m_pool;
+  libusb_device_handle *m_handle;
+  UsbSender *m_sender;
+  const unsigned int m_reset_threshold;
+  unsigned int m_consecutive_failures;
+  RecoveryMetrics m_metrics;
+  // What we know about the widget we're attached to.
+  bool m_have_identity;
+  string m_serial;
+  string m_port_path;
+  string m_last_dmx;
+  uint16_t m_last_dmx_command;
+  // Sent when the widget reattaches. This is only changed by AttachDevice(),
+  // so it outlives the request.
+  string m_restore_dmx;
+
+  // DMX waiting for the next FlushDmx().
+  uint8_t m_staged[kMaxDmxPorts][kDmxUniverseSize];
+  unsigned int m_staged_sizes[kMaxDmxPorts];
+  uint16_t m_staged_universes[kMaxDmxPorts];
+  uint16_t m_staged_ports;
+  // Records what FlushDmx() sends, if set.
+  DmxRecorder *m_recorder;
+  // The frame being sent, this must not change until it completes.
+  uint8_t m_dmx_frame[2 + kMaxDmxPorts * kDmxUniverseSize];
+  std::atomic<bool> m_dmx_in_flight;
+  bool m_checksums;
+
+  // What the widget receives. The receiver only lasts as long as the
+  // device, the input as long as we do.
+  DmxInput *m_input;
+  DmxReceiver *m_receiver;
+  uint16_t m_rx_ports;
+
+  pthread_mutex_t m_mutex;
+  bool m_connected;  // GUARDED_BY(m_mutex)
+  bool m_device_arrived;  // GUARDED_BY(m_mutex)
+
+  libusb_hotplug_callback_handle m_hotplug_handle;
+  bool m_hotplug_registered;
+
+  /**
+   * Look for our widget, and attach to it if it's there.
+   */
+  bool Scan() {
+    libusb_device **list;
+    ssize_t count = libusb_get_device_list(m_context, &list);
+    if (count < 0) {
+      cerr << "libusb_get_device_list failed" << endl;
+      return false;
+    }
+
+    bool attached = false;
+    for (ssize_t i = 0; i < count && !attached; i++) {
+      if (IsInteresting(list[i])) {
+        attached = AttachDevice(list[i]);
+      }
+    }
+    libusb_free_device_list(list, 1);
+    return attached;
+  }
+
+  /**
+   * Recover from a failed transfer and resend the request.
+   * @returns true if the request was resent, false if the device is lost.
+   */
+  bool Recover(uint8_t endpoint, libusb_transfer_status status) {
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    m_consecutive_failures++;
+    cerr << "Transfer on endpoint 0x" << std::hex << static_cast<int>(endpoint)
+         << " failed: " << TransferStatusName(status)
+         << ", attempting recovery " << std::dec << m_consecutive_failures
+         << endl;
+
+    m_sender->CancelTransfers();
+
+    int r = LIBUSB_SUCCESS;
+    if (m_consecutive_failures > m_reset_threshold) {
+      // The reset didn't help.
+      r = LIBUSB_ERROR_OTHER;
+    } else if (m_consecutive_failures == m_reset_threshold) {
+      m_metrics.resets++;
+      r = libusb_reset_device(m_handle);
+    } else if (status == LIBUSB_TRANSFER_STALL) {
+      r = libusb_clear_halt(m_handle, endpoint);
+      if (r == LIBUSB_SUCCESS) {
+        m_metrics.halts_cleared++;
+      }
+    }
+
+    if (r != LIBUSB_SUCCESS || !m_sender->Resend()) {
+      // This includes LIBUSB_ERROR_NOT_FOUND from the reset, which means the
+      // device re-enumerated and needs to be found again.
+      cerr << "Recovery failed: " << libusb_error_name(r) << endl;
+      m_metrics.failed_recoveries++;
+      m_consecutive_failures = 0;
+      _DeviceLost();
+      return false;
+    }
+    m_metrics.recoveries++;
+    m_metrics.RecordLatency(start);
+    return true;
+  }
+
+  bool AttachDevice(libusb_device *device) {
+    const string port_path = GetPortPath(device);
+    // Without a serial number, all we have to go on is where it's plugged in.
+    if (m_have_identity && m_serial.empty() && port_path != m_port_path) {
+      return false;
+    }
+
+    libusb_device_handle *handle = NULL;
+    if (m_thread->OpenDevice(device, &handle)) {
+      cerr << "libusb_open failed" << endl;
+      return false;
+    }
+
+    const string serial = ReadSerialNumber(handle);
+    if (m_have_identity && !m_serial.empty() && serial != m_serial) {
+      m_thread->CloseDevice(handle);
+      return false;
+    }
+
+    int r = libusb_claim_interface(handle, 0);
+    if (r) {
+      cerr << "Failed to claim interface 0: " << libusb_error_name(r) << endl;
+      m_thread->CloseDevice(handle);
+      return false;
+    }
+
+    if (!m_have_identity) {
+      m_have_identity = true;
+      m_serial = serial;
+    }
+    m_port_path = port_path;
+
+    UsbSender *sender = new UsbSender(m_thread, m_pool, handle);
+    if (!sender->HasTransfers()) {
+      delete sender;
+      libusb_release_interface(handle, 0);
+      m_thread->CloseDevice(handle);
+      return false;
+    }
+    cout << "Attached to widget " << (serial.empty() ? "<no serial>" : serial)
+         << " at " << port_path << endl;
+    m_handle = handle;
+    m_sender = sender;
+    m_sender->SetChecksums(m_checksums);
+    m_sender->SetDisconnectCallback(DeviceLostHandler,
+                                    static_cast<void*>(this));
+    pthread_mutex_lock(&m_mutex);
+    m_connected = true;
+    pthread_mutex_unlock(&m_mutex);
+
+    if (!m_last_dmx.empty()) {
+      // This goes through the queue like any other frame, so requests made
+      // from now on are sent after it. It needs a callback, otherwise its
+      // response would wake up Wait() in place of the caller's request, and
+      // FlushDmx() holds off until it's done.
+      m_restore_dmx = m_last_dmx;
+      m_dmx_in_flight = true;
+      if (!m_sender->SendFrame(
+              m_last_dmx_command,
+              reinterpret_cast<const uint8_t*>(m_restore_dmx.data()),
+              m_restore_dmx.size(), kTimeout, DmxSentHandler,
+              static_cast<void*>(this))) {
+        m_dmx_in_flight = false;
+      }
+    }
+    if (m_rx_ports) {
+      StartRx();
+    }
+    return true;
+  }
+
+  /**
+   * Queue the RX transfers, if they aren't already or they've failed, and
+   * tell the widget which ports to send.
+   */
+  bool StartRx() {
+    if (m_receiver && m_receiver->Failed()) {
+      // The transfers have stopped, so start again with a clear endpoint.
+      delete m_receiver;
+      m_receiver = NULL;
+      const int r = libusb_clear_halt(m_handle, kRxEndpoint);
+      if (r) {
+        cerr << "Failed to clear RX halt: " << libusb_error_name(r) << endl;
+      }
+    }
+    if (m_rx_ports && !m_receiver) {
+      m_receiver = new DmxReceiver(m_pool, m_handle, m_input);
+      if (!m_receiver->Start()) {
+        delete m_receiver;
+        m_receiver = NULL;
+        return false;
+      }
+    }
+    const uint8_t mask[] = {static_cast<uint8_t>(m_rx_ports & 0xff),
+                            static_cast<uint8_t>(m_rx_ports >> 8)};
+    const bool sent = m_sender->SendRequest(UsbSender::RX_DMX_ENABLE, mask,
+                                            arraysize(mask), kTimeout, NULL,
+                                            NULL);
+    if (!m_rx_ports) {
+      delete m_receiver;
+      m_receiver = NULL;
+    }
+    return sent;
+  }
+
+  void Detach() {
+    if (!m_handle) {
+      return;
+    }
+    // The receiver needs the libusb thread to cancel its transfers, which
+    // stops once the last device is closed.
+    delete m_receiver;
+    m_receiver = NULL;
+    delete m_sender;
+    m_sender = NULL;
+    // This fails if the device has gone, which is fine.
+    libusb_release_interface(m_handle, 0);
+    m_thread->CloseDevice(m_handle);
+    m_handle = NULL;
+    pthread_mutex_lock(&m_mutex);
+    m_connected = false;
+    pthread_mutex_unlock(&m_mutex);
+  }
+
+  ReconnectManager(const ReconnectManager&);
+  ReconnectManager& operator=(const ReconnectManager&);
+};
+
+/**
+ * Maps universes to widgets.
+ *
+ * This is a flat, open addressed hash table with linear probing, so routing a
+ * universe is a single multiply and, almost always, a single probe.
+ */
+class UniverseTable {
+ public:
+  UniverseTable()
+      : m_entries(kInitialSize),
+        m_size(0) {
+  }
+
+  /**
+   * Add or replace the widget, and the port on it, for a universe.
+   */
+  void Insert(uint16_t universe, ReconnectManager *widget, uint8_t port = 0) {
+    // Keep the load factor below 1/2.
+    if (2 * (m_size + 1) > m_entries.size()) {
+      Grow();
+    }
+    Entry *entry = FindSlot(universe);
+    if (!entry->widget) {
+      m_size++;
+    }
+    entry->universe = universe;
+    entry->widget = widget;
+    entry->port = port;
+  }
+
+  /**
+   * @param port if not NULL, set to the widget's port for the universe.
+   * @returns the widget for the universe, or NULL if there isn't one.
+   */
+  ReconnectManager* Lookup(uint16_t universe, uint8_t *port = NULL) const {
+    const Entry *entry = FindSlot(universe);
+    if (port) {
+      *port = entry->port;
+    }
+    return entry->widget;
+  }
+
+ private:
+  struct Entry {
+    Entry() : universe(0), widget(NULL), port(0) {}
+
+    uint16_t universe;
+    ReconnectManager *widget;  // NULL if the slot is empty
+    uint8_t port;
+  };
+
+  // Must be a power of two.
+  static const unsigned int kInitialSize = 64;
+
+  std::vector<Entry> m_entries;
+  unsigned int m_size;
+
+  Entry* FindSlot(uint16_t universe) {
+    return const_cast<Entry*>(
+        static_cast<const UniverseTable*>(this)->FindSlot(universe));
+  }
+
+  const Entry* FindSlot(uint16_t universe) const {
+    const unsigned int mask = m_entries.size() - 1;
+    // Fibonacci hashing spreads consecutive universes across the table.
+    unsigned int index = (universe * 2654435769u) >> 16 & mask;
+    while (m_entries[index].widget && m_entries[index].universe != universe) {
+      index = (index + 1) & mask;
+    }
+    return &m_entries[index];
+  }
+
+  void Grow() {
+    std::vector<Entry> old_entries(m_entries.size() * 2);
+    old_entries.swap(m_entries);
+    m_size = 0;
+    for (std::vector<Entry>::const_iterator iter = old_entries.begin();
+         iter != old_entries.end(); ++iter) {
+      if (iter->widget) {
+        Insert(iter->universe, iter->widget, iter->port);
+      }
+    }
+  }
+};
+
+/**
+ * Tracks all the attached widgets by serial number, and the universes each
+ * one outputs.
+ *
+ * Each widget is looked up once, at attach time, and gets its own
+ * ReconnectManager. Routing a universe to its widget is then a constant time
+ * lookup in the UniverseTable, however many widgets there are.
+ */
+class WidgetRegistry {
+ public:
+  WidgetRegistry(libusb_context *context, LibUsbThread *thread,
+                 TransferPool *pool)
+      : m_context(context),
+        m_thread(thread),
+        m_pool(pool),
+        m_recorder(NULL),
+        m_checksums(false) {
+  }
+
+  ~WidgetRegistry() {
+    for (std::vector<ReconnectManager*>::iterator iter = m_widgets.begin();
+         iter != m_widgets.end(); ++iter) {
+      delete *iter;
+    }
+  }
+
+  /**
+   * Attach to every widget that isn't already attached.
+   * @returns the number of widgets attached.
+   */
+  unsigned int AttachAll() {
+    libusb_device **list;
+    ssize_t count = libusb_get_device_list(m_context, &list);
+    if (count < 0) {
+      cerr << "libusb_get_device_list failed" << endl;
+      return 0;
+    }
+
+    unsigned int attached = 0;
+    for (ssize_t i = 0; i < count; i++) {
+      if (!IsInteresting(list[i]) || IsAttached(GetPortPath(list[i]))) {
+        continue;
+      }
+
+      ReconnectManager *widget = new ReconnectManager(m_context, m_thread,
+                                                      m_pool);
+      if (!widget->Attach(list[i])) {
+        delete widget;
+        continue;
+      }
+      const string key = Key(widget);
+      if (m_serials.find(key) != m_serials.end()) {
+        cerr << "Duplicate widget serial number " << key << endl;
+        delete widget;
+        continue;
+      }
+      widget->SetRecorder(m_recorder);
+      widget->SetChecksums(m_checksums);
+      m_widgets.push_back(widget);
+      m_serials[key] = widget;
+      attached++;
+    }
+    libusb_free_device_list(list, 1);
+    return attached;
+  }
+
+  /**
+   * @returns the serial numbers of the attached widgets. Widgets without a
+   *   serial number are identified by their port path.
+   */
+  std::vector<string> Serials() const {
+    std::vector<string> serials;
+    for (std::vector<ReconnectManager*>::const_iterator iter =
+           m_widgets.begin();
+         iter != m_widgets.end(); ++iter) {
+      serials.push_back(Key(*iter));
+    }
+    return serials;
+  }
+
+  ReconnectManager* LookupSerial(const string &serial) const {
+    SerialMap::const_iterator iter = m_serials.find(serial);
+    return iter == m_serials.end() ? NULL : iter->second;
+  }
+
+  /**
+   * Output a universe on a port of the widget with the given serial number.
+   * @returns false if there is no such widget or port.
+   */
+  bool AssignUniverse(uint16_t universe, const string &serial,
+                      uint8_t port = 0) {
+    ReconnectManager *widget = LookupSerial(serial);
+    if (!widget || port >= kMaxDmxPorts) {
+      return false;
+    }
+    m_universes.Insert(universe, widget, port);
+    return true;
+  }
+
+  /**
+   * Stage a frame of DMX for a universe, it's sent by the next Flush().
+   * @returns false if the universe isn't assigned.
+   */
+  bool SendDmx(uint16_t universe, const uint8_t *data, unsigned int size) {
+    uint8_t port;
+    ReconnectManager *widget = m_universes.Lookup(universe, &port);
+    if (!widget) {
+      return false;
+    }
+    return widget->StageDmx(port, data, size, universe);
+  }
+
+  /**
+   * Record the frames sent to every widget, NULL to stop. This must be
+   * called from the thread that calls Flush().
+   */
+  void SetRecorder(DmxRecorder *recorder) {
+    m_recorder = recorder;
+    for (std::vector<ReconnectManager*>::iterator iter = m_widgets.begin();
+         iter != m_widgets.end(); ++iter) {
+      (*iter)->SetRecorder(recorder);
+    }
+  }
+
+  /**
+   * Add checksums to the frames sent to every widget.
+   */
+  void SetChecksums(bool checksums) {
+    m_checksums = checksums;
+    for (std::vector<ReconnectManager*>::iterator iter = m_widgets.begin();
+         iter != m_widgets.end(); ++iter) {
+      (*iter)->SetChecksums(checksums);
+    }
+  }
+
+  /**
+   * Send everything staged since the last Flush(), with one transfer per
+   * widget however many of its ports have new data. Call this once per tick.
+   * @returns the number of transfers sent.
+   */
+  unsigned int Flush() {
+    unsigned int sent = 0;
+    for (std::vector<ReconnectManager*>::iterator iter = m_widgets.begin();
+         iter != m_widgets.end(); ++iter) {
+      if ((*iter)->FlushDmx()) {
+        sent++;
+      }
+    }
+    return sent;
+  }
+
+  /**
+   * @returns the widget for a universe, or NULL if it isn't assigned.
+   */
+  ReconnectManager* Route(uint16_t universe) const {
+    return m_universes.Lookup(universe);
+  }
+
+ private:
+  typedef std::map<string, ReconnectManager*> SerialMap;
+
+  libusb_context *m_context;
+  LibUsbThread *m_thread;
+  TransferPool *m_pool;
+  std::vector<ReconnectManager*> m_widgets;
+  SerialMap m_serials;
+  UniverseTable m_universes;
+  DmxRecorder *m_recorder;
+  bool m_checksums;
+
+  static string Key(const ReconnectManager *widget) {
+    return widget->Serial().empty() ? widget->PortPath() : widget->Serial();
+  }
+
+  bool IsAttached(const string &port_path) const {
+    for (std::vector<ReconnectManager*>::const_iterator iter =
+           m_widgets.begin();
+         iter != m_widgets.end(); ++iter) {
+      if ((*iter)->PortPath() == port_path) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  WidgetRegistry(const WidgetRegistry&);
+  WidgetRegistry& operator=(const WidgetRegistry&);
+};
+
+/**
+ * Plays back what a DmxRecorder recorded, with the original timing.
+ *
+ * Only the segment being played is mapped, plus the next one once we're
+ * near the end of it. Pages ahead of the playhead are prefetched with
+ * MADV_WILLNEED, and the pages behind it are dropped. Memory use doesn't
+ * depend on the length of the show, and playback doesn't wait on the disk.
+ *
+ * Each frame is due at an absolute CLOCK_MONOTONIC deadline, measured from
+ * when playback started, so timing errors don't accumulate. We sleep until
+ * kPlaybackSpin before the deadline and spin the rest of the way. Frames
+ * recorded within kPlaybackGroupWindow of each other are sent by one Flush(),
+ * as they were recorded.
+ *
+ * Seeking uses a sparse index with the first and last timestamps of each
+ * segment, then a binary search of the records in the segment.
+ */
+class DmxPlayer {
+ public:
+  typedef DmxRecorder::SegmentHeader SegmentHeader;
+  typedef DmxRecorder::FrameRecord FrameRecord;
+
+  explicit DmxPlayer(const string &prefix)
+      : m_prefix(prefix),
+        m_segment(0),
+        m_record(0),
+        m_prefetched(0),
+        m_stopping(false),
+        m_max_lateness(0) {
+    m_current.base = NULL;
+    m_next.base = NULL;
+  }
+
+  ~DmxPlayer() {
+    Unmap(&m_current);
+    Unmap(&m_next);
+  }
+
+  /**
+   * Find the segments, and index them.
+   * @returns false if there's nothing to play.
+   */
+  bool Open() {
+    for (unsigned int index = 0; ; index++) {
+      const string path = SegmentPath(index);
+      int fd = open(path.c_str(), O_RDONLY);
+      if (fd < 0) {
+        break;
+      }
+      SegmentIndex entry;
+      entry.path = path;
+      const bool valid = ReadIndex(fd, &entry);
+      close(fd);
+      if (!valid) {
+        cerr << path << " isn't a DMX recording" << endl;
+        return false;
+      }
+      if (entry.records) {
+        m_index.push_back(entry);
+      }
+    }
+    if (m_index.empty()) {
+      cerr << "No recording at " << m_prefix << endl;
+      return false;
+    }
+    return Seek(0);
+  }
+
+  /**
+   * @returns the length of the recording, in ns.
+   */
+  uint64_t Duration() const {
+    return m_index.empty() ? 0 :
+        m_index.back().last_timestamp - m_index.front().first_timestamp;
+  }
+
+  /**
+   * Move the playhead to the first frame at or after a position.
+   * @param position the time from the start of the recording, in ns.
+   */
+  bool Seek(uint64_t position) {
+    if (m_index.empty()) {
+      return false;
+    }
+    const uint64_t target = m_index.front().first_timestamp + position;
+    unsigned int segment = 0;
+    unsigned int count = m_index.size();
+    // The last segment that starts at or before the target.
+    while (count > 1) {
+      const unsigned int half = count / 2;
+      if (m_index[segment + half].first_timestamp <= target) {
+        segment += half;
+        count -= half;
+      } else {
+        count = half;
+      }
+    }
+
+    Unmap(&m_next);
+    if (!Map(segment, &m_current)) {
+      return false;
+    }
+    m_segment = segment;
+    const FrameRecord *end = m_current.records + m_current.count;
+    const FrameRecord *record = std::lower_bound(
+        m_current.records, end, target,
+        [](const FrameRecord &record, uint64_t timestamp) {
+          return record.timestamp < timestamp;
+        });
+    m_record = record - m_current.records;
+    m_prefetched = 0;
+    return true;
+  }
+
+  /**
+   * Send the frames from the playhead to the end, or until Stop() is
+   * called, with the timing they were recorded with.
+   * @param output anything with SendDmx() and Flush(), like a WidgetRegistry.
+   * @returns the number of frames sent.
+   */
+  template <typename Output>
+  uint64_t Play(Output *output) {
+    m_stopping = false;
+    m_max_lateness = 0;
+    const FrameRecord *record = Current();
+    if (!record) {
+      return 0;
+    }
+    const uint64_t start = MonotonicNow();
+    const uint64_t first_timestamp = record->timestamp;
+
+    uint64_t sent = 0;
+    while (record && !m_stopping) {
+      Prefetch();
+      if (!WaitUntil(start + record->timestamp - first_timestamp)) {
+        break;
+      }
+      const uint64_t group_end = record->timestamp + kPlaybackGroupWindow;
+      while (record && record->timestamp < group_end) {
+        output->SendDmx(record->universe, record->data, record->size);
+        sent++;
+        m_record++;
+        record = Current();
+      }
+      output->Flush();
+    }
+    return sent;
+  }
+
+  /**
+   * Stop Play(), from another thread.
+   */
+  void Stop() { m_stopping = true; }
+
+  // The latest a frame was sent by the last Play(), in ns after it was due.
+  uint64_t MaxLateness() const { return m_max_lateness; }
+
+ private:
+  struct SegmentIndex {
+    string path;
+    uint64_t records;
+    uint64_t first_timestamp;
+    uint64_t last_timestamp;
+  };
+
+  struct MappedSegment {
+    unsigned int index;
+    uint8_t *base;
+    size_t length;
+    const FrameRecord *records;
+    uint64_t count;
+  };
+
+  const string m_prefix;
+  std::vector<SegmentIndex> m_index;
+  MappedSegment m_current;
+  // Mapped ahead of time, once we're near the end of m_current.
+  MappedSegment m_next;
+  // The playhead.
+  unsigned int m_segment;
+  uint64_t m_record;
+  // How far into m_current has been prefetched.
+  size_t m_prefetched;
+  std::atomic<bool> m_stopping;
+  uint64_t m_max_lateness;
+
+  string SegmentPath(unsigned int index) const {
+    std::ostringstream path;
+    path << m_prefix << "." << std::setw(4) << std::setfill('0') << index
+         << ".dmxlog";
+    return path.str();
+  }
+
+  static uint64_t MonotonicNow() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+  }
+
+  /**
+   * Check the header, and read the first and last timestamps.
+   */
+  static bool ReadIndex(int fd, SegmentIndex *entry) {
+    SegmentHeader header;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, "DMXLOG1", 8) != 0 ||
+        header.header_size != sizeof(SegmentHeader) ||
+        header.record_size != sizeof(FrameRecord)) {
+      return false;
+    }
+    // A segment that was still being written may be longer than its header
+    // says, but never shorter.
+    const off_t size = lseek(fd, 0, SEEK_END);
+    const uint64_t complete = size < static_cast<off_t>(sizeof(header)) ? 0 :
+        (size - sizeof(header)) / sizeof(FrameRecord);
+    entry->records = std::min<uint64_t>(header.records, complete);
+    if (!entry->records) {
+      return true;
+    }
+    const off_t last = sizeof(header) +
+                       (entry->records - 1) * sizeof(FrameRecord);
+    return pread(fd, &entry->first_timestamp, sizeof(uint64_t),
+                 sizeof(header)) == sizeof(uint64_t) &&
+           pread(fd, &entry->last_timestamp, sizeof(uint64_t), last) ==
+               sizeof(uint64_t);
+  }
+
+  bool Map(unsigned int index, MappedSegment *segment) {
+    Unmap(segment);
+    const SegmentIndex &entry = m_index[index];
+    int fd = open(entry.path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      cerr << "Failed to open " << entry.path << ": " << strerror(errno)
+           << endl;
+      return false;
+    }
+    const size_t length = sizeof(SegmentHeader) +
+                          entry.records * sizeof(FrameRecord);
+    void *base = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping keeps the file open.
+    close(fd);
+    if (base == MAP_FAILED) {
+      cerr << "Failed to map " << entry.path << ": " << strerror(errno)
+           << endl;
+      return false;
+    }
+    madvise(base, length, MADV_SEQUENTIAL);
+    segment->index = index;
+    segment->base = static_cast<uint8_t*>(base);
+    segment->length = length;
+    segment->records = reinterpret_cast<const FrameRecord*>(
+        segment->base + sizeof(SegmentHeader));
+    segment->count = entry.records;
+    return true;
+  }
+
+  static void Unmap(MappedSegment *segment) {
+    if (segment->base) {
+      munmap(segment->base, segment->length);
+      segment->base = NULL;
+    }
+  }
+
+  /**
+   * @returns the record at the playhead, moving on to the next segment if
+   *   need be, or NULL at the end.
+   */
+  const FrameRecord *Current() {
+    while (m_record >= m_current.count) {
+      if (m_segment + 1 >= m_index.size()) {
+        return NULL;
+      }
+      m_segment++;
+      if (m_next.base && m_next.index == m_segment) {
+        Unmap(&m_current);
+        m_current = m_next;
+        m_next.base = NULL;
+      } else {
+        // Whatever's in m_next isn't the segment we're moving to.
+        Unmap(&m_next);
+        if (!Map(m_segment, &m_current)) {
+          return NULL;
+        }
+      }
+      m_record = 0;
+      m_prefetched = 0;
+    }
+    return &m_current.records[m_record];
+  }
+
+  /**
+   * Keep kPlaybackPrefetch bytes ahead of the playhead on their way in, and
+   * drop the pages we've played.
+   */
+  void Prefetch() {
+    static const size_t kPageSize = sysconf(_SC_PAGESIZE);
+    const size_t offset = reinterpret_cast<const uint8_t*>(
+        &m_current.records[m_record]) - m_current.base;
+    // Only every half window, to keep the system calls down.
+    if (m_prefetched && offset + kPlaybackPrefetch / 2 < m_prefetched) {
+      return;
+    }
+
+    const size_t played = offset & ~(kPageSize - 1);
+    if (played) {
+      madvise(m_current.base, played, MADV_DONTNEED);
+    }
+    const size_t from = std::max(played, m_prefetched & ~(kPageSize - 1));
+    const size_t to = std::min(m_current.length, offset + kPlaybackPrefetch);
+    if (to > from) {
+      madvise(m_current.base + from, to - from, MADV_WILLNEED);
+    }
+    m_prefetched = to;
+
+    if (to == m_current.length && !m_next.base &&
+        m_segment + 1 < m_index.size() && Map(m_segment + 1, &m_next)) {
+      madvise(m_next.base, std::min(m_next.length, kPlaybackPrefetch),
+              MADV_WILLNEED);
+    }
+  }
+
+  /**
+   * Sleep until just before the deadline, then spin.
+   * @returns false if we were stopped first.
+   */
+  bool WaitUntil(uint64_t deadline) {
+    uint64_t now = MonotonicNow();
+    while (now + kPlaybackSpin < deadline) {
+      if (m_stopping) {
+        return false;
+      }
+      // Wake up now and again, to check if we've been stopped.
+      const uint64_t wake = std::min(deadline - kPlaybackSpin,
+                                     now + kPlaybackMaxSleep);
+      struct timespec ts = {static_cast<time_t>(wake / 1000000000),
+                            static_cast<long>(wake % 1000000000)};
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+      now = MonotonicNow();
+    }
+    while (now < deadline) {
+      now = MonotonicNow();
+    }
+    m_max_lateness = std::max(m_max_lateness, now - deadline);
+    return true;
+  }
+
+  DmxPlayer(const DmxPlayer&);
+  DmxPlayer& operator=(const DmxPlayer&);
+};
+
+void DeviceLostHandler(void *user_data) {
+  ReconnectManager *manager = static_cast<ReconnectManager*>(user_data);
+  manager->_DeviceLost();
+}
+
+void DmxSentHandler(void *user_data, const RequestResult &result) {
+  ReconnectManager *manager = static_cast<ReconnectManager*>(user_data);
+  manager->_DmxSent(result);
 }
 
-void *StartThread(void *d) {
-  LibUsbThread *thread = static_cast<LibUsbThread*>(d);
-  return thread->_InternalRun();
+int HotplugHandler(libusb_context*, libusb_device*, libusb_hotplug_event,
+                   void *user_data) {
+  ReconnectManager *manager = static_cast<ReconnectManager*>(user_data);
+  manager->_DeviceArrived();
+  return 0;
 }
 
-bool IsInteresting(libusb_device *device) {
-  struct libusb_device_descriptor device_descriptor;
-  libusb_get_device_descriptor(device, &device_descriptor);
+/**
+ * Send a DMX frame, then exercise each of the ways of making requests.
+ */
+void RunExamples(ReconnectManager *manager) {
+  while (1) {
+    uint8_t request[] = {1, 2, 3};
 
-  cout << "Checking vendor 0x" << std::hex << std::setw(4) << std::setfill('0')
-       << device_descriptor.idVendor << ", product 0x" << std::setw(4)
-       << device_descriptor.idProduct << endl;
+    if (!manager->WaitForReconnect(kReconnectTimeout)) {
+      cerr << "Widget didn't come back" << endl;
+      break;
+    }
+    if (!manager->SendRequest(UsbSender::TX_DMX, request,
+                             arraysize(request))) {
+      if (manager->IsConnected()) {
+        break;
+      }
+      continue;
+    }
+    manager->Wait();
+    if (!manager->IsConnected()) {
+      continue;
+    }
+    sleep(1);
+    break;
+  }
 
-  return device_descriptor.idVendor == kVendorId &&
-         device_descriptor.idProduct == kProductId;
+#ifdef __cpp_impl_coroutine
+  if (manager->Sender()) {
+    unsigned int matched = RunEchoTasks(manager->Sender(), kEchoTasks);
+    cout << matched << " / " << kEchoTasks << " echo requests matched"
+         << endl;
+  }
+#endif
+  if (manager->Sender()) {
+    // Two requests in flight at once, each with its own timeout.
+    const uint8_t payload[] = {'f', 'u', 't', 'u', 'r', 'e'};
+    // A future that wasn't sent never completes, so don't wait on it.
+    RequestFuture fast, slow;
+    const bool fast_sent = fast.Send(manager->Sender(),
+                                     UsbSender::ECHO_COMMAND, payload,
+                                     arraysize(payload), 10);
+    const bool slow_sent = slow.Send(manager->Sender(),
+                                     UsbSender::ECHO_COMMAND, payload,
+                                     arraysize(payload), kTimeout);
+    if (fast_sent) {
+      const Response &response = fast.Get();
+      cout << "10ms request: " << RequestStatusName(response.status) << " in "
+           << response.latency << endl;
+    } else {
+      cerr << "Failed to send the 10ms request" << endl;
+    }
+    if (slow_sent) {
+      const Response &response = slow.Get();
+      cout << kTimeout << "ms request: " << RequestStatusName(response.status)
+           << " in " << response.latency << endl;
+    } else {
+      cerr << "Failed to send the " << kTimeout << "ms request" << endl;
+    }
+  }
+  if (manager->Sender()) {
+    CompletionQueue queue;
+    std::vector<CompletionQueue::Entry> entries(kEchoTasks);
+    const uint8_t payload[] = {'q', 'u', 'e', 'u', 'e'};
+    unsigned int sent = 0;
+    for (unsigned int i = 0; i < entries.size(); i++) {
+      if (queue.Send(manager->Sender(), &entries[i], UsbSender::ECHO_COMMAND,
+                     payload, arraysize(payload), kTimeout)) {
+        sent++;
+      }
+    }
+    unsigned int ok = 0;
+    for (unsigned int i = 0; i < sent; i++) {
+      CompletionQueue::Entry *entry = queue.Next(-1);
+      if (entry->response.status == REQUEST_OK) {
+        ok++;
+      }
+    }
+    cout << ok << " / " << sent << " queued requests completed" << endl;
+  }
+  if (manager->Sender()) {
+    // More than fits in a single frame.
+    std::vector<uint8_t> payload(4096);
+    for (unsigned int i = 0; i < payload.size(); i++) {
+      payload[i] = static_cast<uint8_t>(i * 7);
+    }
+    RequestFuture future;
+    if (future.SendStream(manager->Sender(), UsbSender::ECHO_COMMAND,
+                          &payload[0], payload.size(), kTimeout)) {
+      const Response &response = future.Get();
+      const bool matched = response.data.size() == payload.size() &&
+          memcmp(response.data.data(), &payload[0], payload.size()) == 0;
+      cout << "Streamed " << payload.size() << " bytes: "
+           << RequestStatusName(response.status) << " in "
+           << response.latency << ", response "
+           << (matched ? "matched" : "didn't match") << endl;
+    } else {
+      cerr << "Failed to send the stream" << endl;
+    }
+  }
 }
 
-libusb_device_handle* LocateDevice(LibUsbThread *thread,
-                                   libusb_context *context) {
-  libusb_device **list;
-  libusb_device_handle *handle = NULL;
-  ssize_t cnt = libusb_get_device_list(context, &list);
-  if (cnt < 0) {
-    cerr << "libusb_free_device_list failed" << endl;
-    return NULL;
+/**
+ * Compare the two ways of terminating frames, across payload sizes.
+ *
+ * Only frames that fill a whole number of packets are affected: padding sends
+ * one more byte, and a zero length packet one more, empty, packet. The sizes
+ * either side of those are there for comparison.
+ */
+void RunTerminationBenchmark(UsbSender *sender) {
+  static const unsigned int kFrameOverhead = 6;
+  static const unsigned int kPacketSize = 64;
+  static const unsigned int kMaxPackets = 8;
+  const FrameTermination modes[] = {PAD_TERMINATION, ZERO_PACKET_TERMINATION};
+  const FrameTermination original = sender->GetFrameTermination();
+
+  uint8_t payload[kMaxPackets * kPacketSize];
+  for (unsigned int i = 0; i < arraysize(payload); i++) {
+    payload[i] = static_cast<uint8_t>(i);
   }
 
-  int err = 0;
-  libusb_device *found = NULL;
-  for (int i = 0; i < cnt; i++) {
-    libusb_device *device = list[i];
-    if (IsInteresting(device)) {
-      found = device;
-      break;
+  sender->SetVerbose(false);
+  cout << "payload  frame  termination         wire bytes  mean us  min us"
+       << "  max us  failed" << endl;
+  for (unsigned int packets = 1; packets <= kMaxPackets; packets++) {
+    for (int offset = -1; offset <= 1; offset++) {
+      const unsigned int size = packets * kPacketSize - kFrameOverhead + offset;
+      const unsigned int frame_size = size + kFrameOverhead;
+      for (unsigned int m = 0; m < arraysize(modes); m++) {
+        sender->SetFrameTermination(modes[m]);
+        uint64_t total = 0, min = UINT64_MAX, max = 0;
+        unsigned int failed = 0;
+        for (unsigned int i = 0; i < kBenchmarkRequests; i++) {
+          RequestFuture future;
+          if (!future.Send(sender, UsbSender::ECHO_COMMAND, payload, size,
+                           kTimeout)) {
+            failed++;
+            continue;
+          }
+          const Response &response = future.Get();
+          if (response.status != REQUEST_OK) {
+            failed++;
+            continue;
+          }
+          uint64_t us = response.latency.tv_sec * 1000000ull +
+                        response.latency.tv_usec;
+          total += us;
+          min = std::min(min, us);
+          max = std::max(max, us);
+        }
+
+        // The sender falls back to padding if it has to.
+        const FrameTermination used = sender->GetFrameTermination();
+        const bool padded = used == PAD_TERMINATION &&
+                            frame_size % kPacketSize == 0;
+        const unsigned int ok = kBenchmarkRequests - failed;
+        cout << std::dec << std::setfill(' ') << setw(7) << size << "  "
+             << setw(5) << frame_size << "  " << std::left << setw(18)
+             << FrameTerminationName(used) << std::right << "  "
+             << setw(10) << frame_size + (padded ? 1 : 0) << "  "
+             << setw(7) << (ok ? total / ok : 0) << "  "
+             << setw(6) << (ok ? min : 0) << "  " << setw(6) << max << "  "
+             << setw(6) << failed << endl;
+      }
     }
   }
+  sender->SetFrameTermination(original);
+  sender->SetVerbose(true);
+}
 
-  if (found) {
-    err = thread->OpenDevice(found, &handle);
-    if (err) {
-      cerr << "libusb_open failed" << endl;
+/**
+ * Measure the cost of building DMX frames with BuildFrame(), with and without
+ * checksums. This doesn't need a widget.
+ */
+void RunEncodeBenchmark() {
+  struct EncodeCase {
+    const char *name;
+    uint16_t command;
+    unsigned int size;
+  };
+  const EncodeCase cases[] = {
+    {"TX_DMX", UsbSender::TX_DMX, kDmxUniverseSize},
+    {"TX_DMX_MULTI, 2 ports", UsbSender::TX_DMX_MULTI,
+     2 + 2 * kDmxUniverseSize},
+    {"TX_DMX_MULTI, 4 ports", UsbSender::TX_DMX_MULTI,
+     2 + 4 * kDmxUniverseSize},
+  };
+  enum { PLAIN, CHECKSUM, ENCODINGS };
+
+  std::vector<uint8_t> payload(UsbSender::MAX_FRAME_PAYLOAD);
+  std::vector<uint8_t> frame(TransferPool::BUFFER_SIZE);
+  for (unsigned int i = 0; i < payload.size(); i++) {
+    payload[i] = static_cast<uint8_t>(i);
+  }
+
+  cout << "command                payload  frame ns  checksum ns" << endl;
+  for (unsigned int c = 0; c < arraysize(cases); c++) {
+    const EncodeCase &encode = cases[c];
+    uint64_t elapsed[ENCODINGS];
+    for (unsigned int encoding = 0; encoding < ENCODINGS; encoding++) {
+      // Stops the compiler from discarding the frames.
+      unsigned int sum = 0;
+      struct timespec start, end;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      for (unsigned int i = 0; i < kEncodeBenchmarkFrames; i++) {
+        payload[0] = static_cast<uint8_t>(i);
+        bool zero_packet;
+        const unsigned int length = UsbSender::BuildFrame(
+            &frame[0], encode.command, NULL, 0, &payload[0], encode.size,
+            encoding == CHECKSUM, ZERO_PACKET_TERMINATION, &zero_packet);
+        sum += frame[length - 2] + length + zero_packet;
+      }
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      elapsed[encoding] = (end.tv_sec - start.tv_sec) * 1000000000ull +
+                          end.tv_nsec - start.tv_nsec;
+      volatile unsigned int sink = sum;
+      (void) sink;
+    }
+    cout << std::dec << std::setfill(' ') << std::left << setw(21)
+         << encode.name << std::right << "  " << setw(7) << encode.size
+         << std::fixed << std::setprecision(1);
+    const unsigned int widths[] = {8, 11};
+    for (unsigned int encoding = 0; encoding < ENCODINGS; encoding++) {
+      cout << "  " << setw(widths[encoding])
+           << static_cast<double>(elapsed[encoding]) / kEncodeBenchmarkFrames;
+    }
+    cout << endl;
+  }
+}
+
+struct RxCounter {
+  RxCounter() : changes(0) {}
+
+  unsigned int changes;
+};
+
+void RxChangedHandler(void *user_data, const DmxSnapshot&) {
+  RxCounter *counter = static_cast<RxCounter*>(user_data);
+  counter->changes++;
+}
+
+/**
+ * Listen to the DMX the widget receives on its first two ports for a while,
+ * then read back what arrived.
+ */
+void RunDmxInput(ReconnectManager *manager) {
+  RxCounter counter;
+  if (!manager->EnableRx(0x3)) {
+    cerr << "Failed to enable DMX input" << endl;
+    return;
+  }
+  DmxInput *input = manager->Input();
+  input->Subscribe(RxChangedHandler, &counter);
+  usleep(kRxListenTime);
+  input->Unsubscribe(RxChangedHandler, &counter);
+  manager->EnableRx(0);
+
+  uint64_t cursor = 0, missed = 0, read = 0;
+  uint64_t total_missed = 0;
+  DmxSnapshot snapshot;
+  struct timeval first, last;
+  timerclear(&first);
+  timerclear(&last);
+  while (input->Read(&cursor, &snapshot, &missed)) {
+    total_missed += missed;
+    if (!read++) {
+      first = snapshot.arrival;
+    }
+    last = snapshot.arrival;
+  }
+
+  struct timeval span;
+  timersub(&last, &first, &span);
+  const uint64_t span_us = span.tv_sec * 1000000ull + span.tv_usec;
+  cout << "Received " << std::dec << read << " DMX frames, "
+       << counter.changes << " changes, " << total_missed
+       << " overwritten before they were read, "
+       << (span_us ? (read - 1) * 1000000 / span_us : 0) << " frames/s"
+       << endl;
+}
+
+/**
+ * Counts RDM responses, so we can wait for a batch of requests.
+ */
+class RdmTally {
+ public:
+  RdmTally() : m_outstanding(0), m_acked(0) {
+    pthread_mutex_init(&m_mutex, NULL);
+    pthread_cond_init(&m_condition, NULL);
+  }
+
+  ~RdmTally() {
+    pthread_cond_destroy(&m_condition);
+    pthread_mutex_destroy(&m_mutex);
+  }
+
+  void Add() {
+    pthread_mutex_lock(&m_mutex);
+    m_outstanding++;
+    pthread_mutex_unlock(&m_mutex);
+  }
+
+  /**
+   * Wait for the responses.
+   * @returns the number that were ACKed.
+   */
+  unsigned int Wait() {
+    pthread_mutex_lock(&m_mutex);
+    while (m_outstanding) {
+      pthread_cond_wait(&m_condition, &m_mutex);
+    }
+    unsigned int acked = m_acked;
+    pthread_mutex_unlock(&m_mutex);
+    return acked;
+  }
+
+  void _Complete(const RdmResult &result) {
+    pthread_mutex_lock(&m_mutex);
+    m_outstanding--;
+    if (result.status == RDM_ACK) {
+      m_acked++;
+    }
+    pthread_cond_broadcast(&m_condition);
+    pthread_mutex_unlock(&m_mutex);
+  }
+
+ private:
+  pthread_mutex_t m_mutex;
+  pthread_cond_t m_condition;
+  unsigned int m_outstanding;  // GUARDED_BY(m_mutex)
+  unsigned int m_acked;  // GUARDED_BY(m_mutex)
+
+  RdmTally(const RdmTally&);
+  RdmTally& operator=(const RdmTally&);
+};
+
+void RdmTallyHandler(void *user_data, const RdmResult &result) {
+  RdmTally *tally = static_cast<RdmTally*>(user_data);
+  tally->_Complete(result);
+}
+
+/**
+ * Discover the responders on every port, then queue a GET of DEVICE_INFO
+ * for each of them without waiting for the responses in between.
+ */
+void RunRdm(UsbSender *sender) {
+  RdmController rdm(sender);
+  sender->SetVerbose(false);
+
+  struct timeval start, end, elapsed;
+  gettimeofday(&start, NULL);
+  if (!rdm.Discover((1 << kMaxDmxPorts) - 1)) {
+    cerr << "Failed to start RDM discovery" << endl;
+    sender->SetVerbose(true);
+    return;
+  }
+  rdm.WaitForDiscovery();
+  gettimeofday(&end, NULL);
+  timersub(&end, &start, &elapsed);
+
+  std::vector<std::pair<uint8_t, RdmUid> > responders;
+  for (unsigned int port = 0; port < kMaxDmxPorts; port++) {
+    bool complete = false;
+    const std::vector<RdmUid> uids = rdm.Responders(port, &complete);
+    cout << "Port " << port << ": " << uids.size() << " responders"
+         << (complete ? "" : ", discovery incomplete") << endl;
+    for (unsigned int i = 0; i < uids.size(); i++) {
+      responders.push_back(std::make_pair(port, uids[i]));
+    }
+  }
+  cout << "Discovered " << responders.size() << " responders with "
+       << rdm.DiscoveryRequests() << " requests in " << elapsed << endl;
+
+  RdmTally tally;
+  gettimeofday(&start, NULL);
+  for (unsigned int i = 0; i < responders.size(); i++) {
+    tally.Add();
+    while (!rdm.Get(responders[i].first, responders[i].second, 0,
+                    RdmController::DEVICE_INFO, NULL, 0, RdmTallyHandler,
+                    &tally)) {
+      // Too many outstanding, give the widget a moment to catch up.
+      usleep(1000);
+    }
+  }
+  const unsigned int acked = tally.Wait();
+  gettimeofday(&end, NULL);
+  timersub(&end, &start, &elapsed);
+
+  unsigned int cached = 0;
+  string device_info;
+  for (unsigned int i = 0; i < responders.size(); i++) {
+    if (rdm.Lookup(responders[i].second, 0, RdmController::DEVICE_INFO,
+                   &device_info)) {
+      cached++;
+    }
+  }
+  cout << "DEVICE_INFO: " << acked << " / " << responders.size()
+       << " acked in " << elapsed << ", " << cached << " cached" << endl;
+  sender->SetVerbose(true);
+}
+
+/**
+ * Output each of the assigned universes for a few ticks.
+ */
+void RunDmxTicks(WidgetRegistry *registry, unsigned int universes) {
+  uint8_t frame[kDmxUniverseSize];
+  for (unsigned int tick = 0; tick < kDmxTicks; tick++) {
+    for (unsigned int universe = 0; universe < universes; universe++) {
+      memset(frame, tick * 16 + universe, sizeof(frame));
+      registry->SendDmx(universe, frame, sizeof(frame));
     }
+    unsigned int transfers = registry->Flush();
+    cout << "Tick " << tick << ": " << universes << " universes in "
+         << transfers << " transfers" << endl;
+    usleep(kDmxTickInterval);
   }
-  libusb_free_device_list(list, 1);
-  return handle;
 }
 
+// The tests include this file, and have their own main().
+#ifndef VENDOR_DEVICE_NO_MAIN
 int main(int argc, char **argv) {
   libusb_context *context = NULL;
 
+  if (argc > 1 && string(argv[1]) == "--encode-benchmark") {
+    RunEncodeBenchmark();
+    return 0;
+  }
+
   int r = libusb_init(&context);
   if (r < 0) {
     cerr << "libusb_init() failed: " << libusb_error_name(r) << endl;
@@ -354,36 +5754,80 @@ int main(int argc, char **argv) {
 
   LibUsbThread thread(context);
 
-  // Look for a specific device and open it.
-  struct libusb_device_handle *device = LocateDevice(&thread, context);
-  if (!device) {
-    libusb_exit(context);
-    exit(1);
-  }
-
-
-  r = libusb_claim_interface(device, 0);
-  if (r) {
-    cerr << "Failed to claim interface: 0" << endl;
-    exit(1);
-  }
+  {
+    // Each widget needs an in and an out transfer, plus a pair for each
+    // extra chunk of a stream in flight, and the RX transfers for the widget
+    // we listen to.
+    TransferPool pool(2 * (kMaxWidgets + kStreamWindow - 1) + kRxTransfers);
+    WidgetRegistry registry(context, &thread, &pool);
+    if (!registry.AttachAll()) {
+      libusb_exit(context);
+      exit(1);
+    }
 
-  UsbSender sender(device);
+    // Output a universe on each of the first kExamplePorts ports of every
+    // widget, in the order they were found.
+    const std::vector<string> serials = registry.Serials();
+    for (unsigned int i = 0; i < serials.size(); i++) {
+      for (unsigned int port = 0; port < kExamplePorts; port++) {
+        registry.AssignUniverse(i * kExamplePorts + port, serials[i], port);
+      }
+    }
 
-  while (1) {
-    uint8_t request[] = {1, 2, 3};
+    // With --checksums, every frame we send carries a CRC.
+    if (argc > 1 && string(argv[1]) == "--checksums") {
+      registry.SetChecksums(true);
+    }
 
-    if (!sender.SendRequest(UsbSender::TX_DMX, request,
-                            arraysize(request))) {
-      break;
+    ReconnectManager *manager = registry.Route(0);
+    if (argc > 1 && string(argv[1]) == "--benchmark") {
+      if (manager->Sender()) {
+        RunTerminationBenchmark(manager->Sender());
+      }
+    } else if (argc > 2 && string(argv[1]) == "--play") {
+      // --play <prefix> [offset in ms]
+      DmxPlayer player(argv[2]);
+      const uint64_t offset = argc > 3 ? strtoull(argv[3], NULL, 10) : 0;
+      if (player.Open() && player.Seek(offset * 1000000)) {
+        cout << "Playing " << std::dec << player.Duration() / 1000000
+             << "ms of DMX from " << offset << "ms" << endl;
+        const uint64_t sent = player.Play(&registry);
+        cout << "Played " << sent << " frames, at most "
+             << player.MaxLateness() / 1000 << "us late" << endl;
+      }
+    } else {
+      // With --record <prefix>, everything sent by RunDmxTicks() is
+      // recorded.
+      DmxRecorder *recorder = NULL;
+      if (argc > 2 && string(argv[1]) == "--record") {
+        recorder = new DmxRecorder(argv[2]);
+        if (recorder->Start()) {
+          registry.SetRecorder(recorder);
+        } else {
+          delete recorder;
+          recorder = NULL;
+        }
+      }
+      RunExamples(manager);
+      RunDmxTicks(&registry, serials.size() * kExamplePorts);
+      if (recorder) {
+        registry.SetRecorder(NULL);
+        recorder->Stop();
+        cout << "Recorded " << recorder->Recorded() << " frames, dropped "
+             << recorder->Dropped() << endl;
+        delete recorder;
+      }
+      if (manager->IsConnected()) {
+        RunDmxInput(manager);
+      }
+      if (manager->Sender()) {
+        RunRdm(manager->Sender());
+      }
     }
-    sender.Wait();
-    sleep(1);
-    break;
+    cout << manager->Metrics() << endl;
   }
 
-  r = libusb_release_interface(device, 0);
-  thread.CloseDevice(device);
   libusb_exit(context);
   return 0;
 }
+#endif  // VENDOR_DEVICE_NO_MAIN